@@ -1,6 +1,8 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <velib/platform/plt.h>
 #include <velib/types/types.h>
@@ -11,18 +13,66 @@
 #include <velib/vecan/products.h>
 
 #include "ble-dbus.h"
+#include "ble-feedback.h"
+#include "ble-filter.h"
+#include "ble-regs.h"
 #include "ble-scan.h"
 #include "task.h"
 
+/* Channels of one advertiser, like the tanks of a Garnet SeeLeveL */
+#define REGISTRY_CHANNELS	8
+#define REGISTRY_MIN_SIZE	64
+
+/* Longest payload remembered to recognise repeats */
+#define PAYLOAD_MAX		32
+
+/* Gateways, plus local reception, remembered per device */
+#define SOURCES_MAX		4
+
+/* How much stronger another source must be heard to take over, in dB */
+#define SOURCE_HYSTERESIS	6
+#define SOURCE_RSSI_WEIGHT	0.25f
+
+struct source {
+	enum data_source	type;
+	bdaddr_t		gateway;
+	uint32_t		last_tick;
+	float			rssi;	/* smoothed, NAN if unknown */
+};
+
+/* Items of an alarm, resolved when it is added */
+struct alarm_items {
+	const struct alarm	*alarm;
+	struct VeItem		*item;		/* monitored, found on first use */
+	struct VeItem		*state;
+	struct VeItem		*enable;
+	struct VeItem		*active;
+	struct VeItem		*restore;
+};
+
 struct device {
 	struct dev_info		info;
 	struct VeItem		*ctl;
 	struct VeItem		*settings_cname;
+	struct VeItem		*enabled;
+	struct VeItem		*rssi;
+	struct VeItem		**regs;		/* one per info.regs entry */
+	const struct reg_table	*reg_table;
+	struct alarm_items	*alarms;
+	int			num_alarms;
 	const void		*data;
-	uint32_t		last_tick[DATA_SOURCE_NONE];
+	bdaddr_t		addr;
+	int			channel;	/* -1 for single devices */
+	int			registered;
+	struct source		sources[SOURCES_MAX];
+	int			num_sources;
+	int			active;	/* index in sources, -1 if none */
 	uint32_t		last_seqno;
-	enum data_source	active_source;
+	uint8_t			last_payload[PAYLOAD_MAX];
+	int			last_len;	/* 0 if none */
 	int			deferred_created;
+	int			accept_listed;
+	int			flush_queued;
 	VeVariant		names[NAME_ORIG_NONE];
 	enum name_source	cname_source;
 	enum name_source	dname_source;
@@ -38,6 +88,8 @@ const VeVariantUnitFmt veUnitPPM = { 0, "ppm" };
 const VeVariantUnitFmt veUnitUgM3 = { 1, "ug/m3" };
 const VeVariantUnitFmt veUnitLux = { 2, "lux" };
 const VeVariantUnitFmt veUnitIndex = { 0, "" };
+const VeVariantUnitFmt veUnitPerSec = { 1, "/s" };
+const VeVariantUnitFmt veUnitms = { 3, "ms" };
 
 static struct VeSettingProperties bool_val = {
 	.type = VE_SN32,
@@ -55,8 +107,19 @@ static struct VeSettingProperties dedup_window_props = {
 
 static int dedup_window_ticks = 2 * TICKS_PER_SEC;
 
+/* Payloads skipped as repeats of the last one decoded */
+static uint32_t unchanged_count;
+static struct VeItem *unchanged_item;
+
 static const char *data_source_str[] = { "Bluetooth LE", "BLE Gateway", "None" };
 
+/* Devices updated during a batch, sent out when it ends */
+#define FLUSH_MAX	64
+
+static struct VeItem *flush_pending[FLUSH_MAX];
+static int num_flush_pending;
+static int flush_batch;
+
 static veBool readOnlySetValue(struct VeItem *item, void *ctx, VeVariant *variant)
 {
 	VE_UNUSED(item);
@@ -192,173 +255,318 @@ static inline struct device *get_device(struct VeItem *root)
 	return veItemCtx(root)->ptr;
 }
 
-static void free_device_data(struct VeItem *item)
+/*
+ * Open addressing hash table of devices by advertiser address, so the
+ * decoders need not format and look up the item path for every
+ * advertisement. A slot holds the device without a channel, and lazily
+ * a sub-index of the channel devices of the same advertiser.
+ */
+struct registry_slot {
+	bdaddr_t		addr;
+	int			used;
+	struct VeItem		*droot;
+	struct VeItem		**channels;
+};
+
+static struct registry_slot *registry;
+static int registry_size;
+static int registry_used;
+
+static int parse_addr(const char *dev, bdaddr_t *addr)
 {
-	struct device *d = get_device(item);
+	unsigned int b[6];
+	int i;
 
-	for (int i = 0; i < NAME_ORIG_NONE; i++) {
-		veVariantFree(&d->names[i]);
-	}
+	if (sscanf(dev, "%2x%2x%2x%2x%2x%2x",
+		   &b[5], &b[4], &b[3], &b[2], &b[1], &b[0]) != 6)
+		return -1;
 
-	free(d);
+	for (i = 0; i < 6; i++)
+		addr->b[i] = b[i];
+
+	return 0;
 }
 
-static void *alloc_item_data(struct VeItem *item, size_t size, VeItemAboutToBeRemoved *fun)
+static void format_dev(char *dev, size_t size, const bdaddr_t *addr, int channel)
 {
-	void *p = calloc(1, size);
-
-	veItemCtx(item)->ptr = p;
-	veItemSetAboutToRemoved(item, fun);
+	const uint8_t *b = addr->b;
 
-	return p;
+	if (channel < 0)
+		snprintf(dev, size, "%02x%02x%02x%02x%02x%02x",
+			 b[5], b[4], b[3], b[2], b[1], b[0]);
+	else
+		snprintf(dev, size, "%02x%02x%02x%02x%02x%02x_%d",
+			 b[5], b[4], b[3], b[2], b[1], b[0], channel);
 }
 
-static inline const struct dev_info *get_dev_info(struct VeItem *root)
+static unsigned int registry_hash(const bdaddr_t *addr)
 {
-	struct device *d = get_device(root);
-	return &d->info;
+	uint64_t k = 0;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		k |= (uint64_t)addr->b[i] << (8 * i);
+
+	return (k * 0x9e3779b97f4a7c15ull) >> 32;
 }
 
-static inline const void *get_dev_data(struct VeItem *root)
+static struct registry_slot *registry_find(const bdaddr_t *addr)
 {
-	struct device *d = get_device(root);
-	return d->data;
+	unsigned int mask = registry_size - 1;
+	unsigned int i;
+
+	if (!registry)
+		return NULL;
+
+	for (i = registry_hash(addr) & mask; registry[i].used; i = (i + 1) & mask)
+		if (!bacmp(&registry[i].addr, addr))
+			return &registry[i];
+
+	return NULL;
 }
 
-static inline struct VeItem *get_dev_control(struct VeItem *root)
+static struct registry_slot *registry_insert(struct registry_slot *table, int size,
+					     const bdaddr_t *addr)
 {
-	struct device *d = get_device(root);
-	return d->ctl;
-}
+	unsigned int mask = size - 1;
+	unsigned int i;
 
-static const struct dev_class null_class;
+	for (i = registry_hash(addr) & mask; table[i].used; i = (i + 1) & mask)
+		if (!bacmp(&table[i].addr, addr))
+			return &table[i];
 
-static inline const struct dev_class *get_dev_class(const struct dev_info *info)
+	bacpy(&table[i].addr, addr);
+	table[i].used = 1;
+
+	return &table[i];
+}
+
+/* Keeps the load factor at most one half */
+static int registry_grow(void)
 {
-	return info->dev_class ?: &null_class;
+	int size = registry_size ? 2 * registry_size : REGISTRY_MIN_SIZE;
+	struct registry_slot *table;
+	int i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < registry_size; i++)
+		if (registry[i].used)
+			*registry_insert(table, size, &registry[i].addr) = registry[i];
+
+	free(registry);
+	registry = table;
+	registry_size = size;
+
+	return 0;
 }
 
-static int type_size(VeDataBasicType t)
+/* Backward shift deletion, linear probing needs no tombstones then */
+static void registry_remove(struct registry_slot *slot)
 {
-	return (t + 1) / 2;
+	unsigned int mask = registry_size - 1;
+	unsigned int i = slot - registry;
+	unsigned int j = i;
+	unsigned int home;
+
+	free(slot->channels);
+	memset(slot, 0, sizeof(*slot));
+	registry_used--;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (!registry[j].used)
+			return;
+
+		/* Move j into the hole unless its home lies cyclically in (i, j] */
+		home = registry_hash(&registry[j].addr) & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+
+		registry[i] = registry[j];
+		memset(&registry[j], 0, sizeof(registry[j]));
+		i = j;
+	}
 }
 
-static int type_isint(VeDataBasicType t)
+static struct VeItem **registry_ref(struct registry_slot *slot, int channel)
 {
-	if (t < VE_UN8)
-		return 0;
-	if (t <= VE_SN32)
-		return 1;
-	return 0;
+	if (channel < 0)
+		return &slot->droot;
+
+	if (!slot->channels) {
+		slot->channels = calloc(REGISTRY_CHANNELS, sizeof(*slot->channels));
+		if (!slot->channels)
+			return NULL;
+	}
+
+	return &slot->channels[channel];
 }
 
-static int type_issigned(VeDataBasicType t)
+static void registry_add(struct VeItem *droot)
 {
-	return !(t & 1);
+	struct device *d = get_device(droot);
+	struct registry_slot *slot;
+	struct VeItem **ref;
+	const char *id = veItemId(droot);
+
+	if (parse_addr(id, &d->addr))
+		return;
+
+	d->channel = id[12] == '_' ? atoi(id + 13) : -1;
+	if (d->channel >= REGISTRY_CHANNELS)
+		return;
+
+	if (2 * (registry_used + 1) > registry_size && registry_grow() < 0)
+		return;
+
+	slot = registry_insert(registry, registry_size, &d->addr);
+	if (!slot->droot && !slot->channels)
+		registry_used++;
+
+	ref = registry_ref(slot, d->channel);
+	if (!ref)
+		return;
+
+	*ref = droot;
+	d->registered = 1;
 }
 
-static int64_t sext(int64_t v, int b)
+static void registry_del(struct device *d)
 {
-	b = 64 - b;
-	return v << b >> b;
+	struct registry_slot *slot = registry_find(&d->addr);
+	int i;
+
+	if (!slot)
+		return;
+
+	*registry_ref(slot, d->channel) = NULL;
+
+	if (slot->droot)
+		return;
+
+	for (i = 0; slot->channels && i < REGISTRY_CHANNELS; i++)
+		if (slot->channels[i])
+			return;
+
+	registry_remove(slot);
 }
 
-static uint64_t zext(uint64_t v, int b)
+/* Finds a device by address and channel, -1 if it has none */
+struct VeItem *ble_dbus_get_dev_addr(const bdaddr_t *addr, int channel)
 {
-	b = 64 - b;
-	return v << b >> b;
+	struct registry_slot *slot = registry_find(addr);
+
+	if (!slot)
+		return NULL;
+
+	if (channel < 0)
+		return slot->droot;
+
+	if (channel >= REGISTRY_CHANNELS || !slot->channels)
+		return NULL;
+
+	return slot->channels[channel];
 }
 
-static int load_int(VeVariant *val, const struct reg_info *reg,
-		    const uint8_t *buf, int len, struct VeItem *root)
+/* Whether any device of the advertiser, on any channel, is enabled */
+int ble_dbus_addr_enabled(const bdaddr_t *addr)
 {
-	VeDataBasicType type = reg->type;
-	float scale = reg->scale;
-	float bias = reg->bias;
-	int bits = reg->bits;
-	uint64_t v;
-	int size;
-	float f;
+	struct registry_slot *slot = registry_find(addr);
 	int i;
 
-	if (!bits)
-		bits = 8 * type_size(type);
+	if (!slot)
+		return 0;
 
-	size = (bits + reg->shift + 7) >> 3;
+	if (slot->droot && ble_dbus_is_enabled(slot->droot))
+		return 1;
 
-	if (len < size)
-		return -1;
+	for (i = 0; slot->channels && i < REGISTRY_CHANNELS; i++)
+		if (slot->channels[i] && ble_dbus_is_enabled(slot->channels[i]))
+			return 1;
 
-	if (reg->flags & REG_FLAG_BIG_ENDIAN) {
-		for (v = 0, i = 0; i < size; i++)
-			v = v << 8 | *buf++;
-	} else {
-		for (v = 0, i = 0; i < size; i++)
-			v |= *buf++ << (8 * i);
-	}
+	return 0;
+}
 
-	v = zext(v >> reg->shift, bits);
+static void free_device_data(struct VeItem *item)
+{
+	struct device *d = get_device(item);
 
-	if ((reg->flags & REG_FLAG_WARN_ALARM)) {
-		if (v == 0)
-			return -1;
-		veVariantSn32(val, (int)v - 1);
-		return 0;
+	if (d->registered)
+		registry_del(d);
+
+	free(d->regs);
+	free(d->alarms);
+
+	for (int i = 0; i < NAME_ORIG_NONE; i++) {
+		veVariantFree(&d->names[i]);
 	}
-	if ((reg->flags & REG_FLAG_INVALID) && v == reg->inval)
-		return -1;
 
-	if (reg->xlate) {
-		return reg->xlate(root, val, v);
-	} else if (scale) {
-		if (type_issigned(type))
-			f = sext(v, bits);
-		else
-			f = v;
-		veVariantFloat(val, f / scale + bias);
-	} else if (type_issigned(type)) {
-		veVariantSn32(val, sext(v, bits));
-	} else {
-		veVariantUn32(val, v);
+	for (int i = 0; d->flush_queued && i < num_flush_pending; i++) {
+		if (flush_pending[i] == item) {
+			flush_pending[i] = flush_pending[--num_flush_pending];
+			break;
+		}
 	}
 
-	return 0;
+	free(d);
 }
 
-static int load_reg(const struct reg_info *reg, VeVariant *val,
-		    const uint8_t *buf, int len, struct VeItem *root)
+static void *alloc_item_data(struct VeItem *item, size_t size, VeItemAboutToBeRemoved *fun)
 {
-	buf += reg->offset;
-	len -= reg->offset;
+	void *p = calloc(1, size);
 
-	if (!type_isint(reg->type))
-		return -1;
+	veItemCtx(item)->ptr = p;
+	veItemSetAboutToRemoved(item, fun);
 
-	return load_int(val, reg, buf, len, root);
+	return p;
 }
 
-static int set_reg(struct VeItem *root, const struct reg_info *reg,
-		    const uint8_t *buf, int len)
+static inline const struct dev_info *get_dev_info(struct VeItem *root)
 {
-	VeVariant val;
-	int err;
+	struct device *d = get_device(root);
+	return &d->info;
+}
 
-	err = load_reg(reg, &val, buf, len, root);
-	if (err)
-		veVariantInvalidType(&val, reg->type);
+static inline const void *get_dev_data(struct VeItem *root)
+{
+	struct device *d = get_device(root);
+	return d->data;
+}
 
-	return ble_dbus_set_item(root, reg->name, &val);
+static inline struct VeItem *get_dev_control(struct VeItem *root)
+{
+	struct device *d = get_device(root);
+	return d->ctl;
+}
+
+static const struct dev_class null_class;
+
+static inline const struct dev_class *get_dev_class(const struct dev_info *info)
+{
+	return info->dev_class ?: &null_class;
 }
 
 static void create_regs(struct VeItem *root)
 {
-	const struct dev_info *info = get_dev_info(root);
+	struct device *d = get_device(root);
+	const struct dev_info *info = &d->info;
 	VeVariant val;
 	int i;
 
+	d->regs = calloc(info->num_regs, sizeof(*d->regs));
+	d->reg_table = ble_regs_compile(info->regs, info->num_regs);
+	if ((info->num_regs && !d->regs) || !d->reg_table) {
+		fprintf(stderr, "failed to allocate registers\n");
+		pltExit(-1);
+	}
+
 	for (i = 0; i < info->num_regs; i++) {
 		const struct reg_info *reg = &info->regs[i];
-		ble_dbus_create_item(root, reg->name, veVariantInvalidType(&val, reg->type), reg->format);
+		d->regs[i] = ble_dbus_create_item(root, reg->name,
+				veVariantInvalidType(&val, reg->type), reg->format);
 	}
 }
 
@@ -389,27 +597,57 @@ int ble_dbus_init(void)
 					  veVariantFmt, &veUnitNone, &dedup_window_props);
 	veItemSetChanged(dedup, on_dedup_window_changed);
 
+	unchanged_item = ble_dbus_create_int(ctl, "Stats/UnchangedPayloads", 0);
+
 	return 0;
 }
 
-int ble_dbus_add_interface(const char *name, const char *addr)
+/* Returns the Interfaces/<name> item, statistics are created below it */
+struct VeItem *ble_dbus_add_interface(const char *name, const char *addr)
 {
 	struct VeItem *ctl = get_control();
+	struct VeItem *intf;
 	char buf[256];
 
-	snprintf(buf, sizeof(buf), "Interfaces/%s/Address", name);
-	ble_dbus_create_str(ctl, buf, addr);
+	snprintf(buf, sizeof(buf), "Interfaces/%s", name);
+	intf = veItemGetOrCreateUid(ctl, buf);
+	if (!intf) {
+		fprintf(stderr, "failed to create item %s\n", buf);
+		pltExit(-1);
+	}
+
+	ble_dbus_create_str(intf, "Address", addr);
 
-	return 0;
+	return intf;
+}
+
+struct VeItem *ble_dbus_add_interface_item(struct VeItem *intf,
+					   const char *path,
+					   VeDataBasicType type,
+					   const void *format)
+{
+	VeVariant val;
+
+	return ble_dbus_create_item(intf, path,
+				    veVariantInvalidType(&val, type), format);
 }
 
 int ble_dbus_invalidate_interface(const char *name)
 {
 	struct VeItem *ctl = get_control();
+	struct VeItem *intf;
+	struct VeItem *item;
 	char buf[256];
 
-	snprintf(buf, sizeof(buf), "Interfaces/%s/Address", name);
-	return ble_dbus_set_invalid(ctl, buf);
+	snprintf(buf, sizeof(buf), "Interfaces/%s", name);
+	intf = veItemByUid(ctl, buf);
+	if (!intf)
+		return -1;
+
+	for (item = veItemFirstChild(intf); item; item = veItemNextChild(item))
+		veItemInvalidate(item);
+
+	return 0;
 }
 
 struct VeItem *ble_dbus_get_dev(const char *dev)
@@ -417,15 +655,99 @@ struct VeItem *ble_dbus_get_dev(const char *dev)
 	return veItemByUid(devices, dev);
 }
 
+/*
+ * Collects the distinct advertiser addresses of all known devices, up to
+ * @max. Returns the number of distinct addresses, which may exceed @max.
+ * If @enabled is set, it tells for each address whether any of its
+ * devices is enabled.
+ */
+int ble_dbus_get_addrs(bdaddr_t *addrs, uint8_t *enabled, int max)
+{
+	struct VeItem *dev;
+	bdaddr_t addr;
+	int n = 0;
+	int i;
+
+	for (dev = veItemFirstChild(devices); dev; dev = veItemNextChild(dev)) {
+		if (parse_addr(veItemId(dev), &addr))
+			continue;
+
+		for (i = 0; i < n && i < max; i++)
+			if (!bacmp(&addrs[i], &addr))
+				break;
+
+		if (i < n && i < max) {
+			if (enabled)
+				enabled[i] |= ble_dbus_is_enabled(dev);
+			continue;
+		}
+
+		if (n < max) {
+			bacpy(&addrs[n], &addr);
+			if (enabled)
+				enabled[n] = ble_dbus_is_enabled(dev);
+		}
+		n++;
+	}
+
+	return n;
+}
+
 struct VeItem *ble_dbus_get_control_item(struct VeItem *root, const char *path)
 {
 	return veItemByUid(get_dev_control(root), path);
 }
 
+/* Value of an item by handle, 0 if it is invalid */
+int ble_dbus_item_int(struct VeItem *item)
+{
+	VeVariant val;
+
+	if (!veVariantIsValid(veItemLocalValue(item, &val)))
+		return 0;
+
+	veVariantToN32(&val);
+
+	return val.value.SN32;
+}
+
+float ble_dbus_item_float(struct VeItem *item)
+{
+	VeVariant val;
+
+	if (!veVariantIsValid(veItemLocalValue(item, &val)))
+		return 0;
+
+	veVariantToFloat(&val);
+
+	return val.value.Float;
+}
+
+void ble_dbus_item_set_int(struct VeItem *item, int num)
+{
+	VeVariant val;
+
+	veItemOwnerSet(item, veVariantSn32(&val, num));
+}
+
+void ble_dbus_item_set_float(struct VeItem *item, float num)
+{
+	VeVariant val;
+
+	veItemOwnerSet(item, veVariantFloat(&val, num));
+}
+
+void ble_dbus_item_set_str(struct VeItem *item, const char *str)
+{
+	VeVariant val;
+
+	veItemOwnerSet(item, veVariantHeapStr(&val, str));
+}
+
 int ble_dbus_is_enabled(struct VeItem *droot)
 {
-	struct VeItem *ctl = get_dev_control(droot);
-	return veItemValueInt(ctl, "Enabled") == 1;
+	struct device *d = get_device(droot);
+	return ble_dbus_item_int(d->enabled) == 1;
 }
 
 void *ble_dbus_get_pdata(struct VeItem *root)
@@ -454,15 +776,24 @@ static int settings_path(struct VeItem *droot, char *buf, size_t size)
 			info->dev_prefix, dev);
 }
 
+/* Settings may change how a payload decodes, so decode the next one */
+static void forget_payload(struct VeItem *droot)
+{
+	get_device(droot)->last_len = 0;
+}
+
 static void on_setting_changed(struct VeItem *item)
 {
 	struct setting_data *d = veItemCtx(item)->ptr;
 	const void *data = get_dev_data(d->root);
 
+	forget_payload(d->root);
+
 	if (!veItemIsValid(item))
 		return;
 
-	d->onchange(d->root, item, data);
+	if (d->onchange)
+		d->onchange(d->root, item, data);
 }
 
 static int add_settings(struct VeItem *droot,
@@ -484,12 +815,10 @@ static int add_settings(struct VeItem *droot,
 		item = veItemCreateSettingsProxySync(settings, path, root,
 			ds->name, veVariantFmt, &veUnitNone, ds->props);
 
-		if (ds->onchange) {
-			d = alloc_item_data(item, sizeof(*d), free_setting_data);
-			d->root = droot;
-			d->onchange = ds->onchange;
-			veItemSetChanged(item, on_setting_changed);
-		}
+		d = alloc_item_data(item, sizeof(*d), free_setting_data);
+		d->root = droot;
+		d->onchange = ds->onchange;
+		veItemSetChanged(item, on_setting_changed);
 	}
 
 	return 0;
@@ -553,14 +882,35 @@ static void set_names(struct VeItem *droot, enum name_source changed)
 	}
 }
 
+/* Keeps the scanner's accept list in line with the enabled devices */
+static void update_accept(struct VeItem *droot, int enabled)
+{
+	struct device *d = get_device(droot);
+	bdaddr_t addr;
+
+	if (d->accept_listed == enabled)
+		return;
+
+	if (parse_addr(veItemId(droot), &addr))
+		return;
+
+	ble_scan_accept(&addr, enabled);
+	ble_feedback_update();
+	d->accept_listed = enabled;
+}
+
 static void on_enabled_changed(struct VeItem *ena)
 {
 	struct VeItem *droot = veItemCtx(ena)->ptr;
 	struct VeDbus *dbus;
 	VeVariant val;
+	int enabled;
 
 	veItemLocalValue(ena, &val);
-	if (veVariantIsValid(&val) && val.value.SN32)
+	enabled = veVariantIsValid(&val) && val.value.SN32;
+	update_accept(droot, enabled);
+	forget_payload(droot);
+	if (enabled)
 		return;
 
 	dbus = veItemDbus(droot);
@@ -599,7 +949,7 @@ static struct device *init_dev(struct VeItem *root, const struct dev_info *info,
 	d->info = *info;
 	d->data = data;
 	d->ctl = ctl;
-	d->active_source = DATA_SOURCE_NONE;
+	d->active = -1;
 
 	return d;
 }
@@ -631,6 +981,19 @@ static int deferred_create(struct VeItem *droot)
 	return 0;
 }
 
+/* Marks the device as heard, restarting its timeout */
+static struct VeItem *ble_dbus_seen(struct VeItem *droot)
+{
+	VeVariant val;
+
+	if (ble_dbus_is_enabled(droot))
+		deferred_create(droot);
+
+	veItemLocalSet(droot, veVariantUn32(&val, tick));
+
+	return droot;
+}
+
 struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
 			       const void *data)
 {
@@ -652,6 +1015,7 @@ struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
 	dev_ctl = veItemGetOrCreateUid(ctl, name);
 	droot = veItemGetOrCreateUid(devices, dev);
 	d = init_dev(droot, info, data, dev_ctl);
+	registry_add(droot);
 
 	snprintf(path, sizeof(path), "Settings/Devices/%s/CustomName", veItemId(dev_ctl));
 	d->settings_cname = veItemGetOrCreateUid(settings, path);
@@ -666,6 +1030,8 @@ struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
  					     &veUnitNone, &bool_val);
 	veItemCtx(item)->ptr = droot;
 	veItemSetChanged(item, on_enabled_changed);
+	d->enabled = item;
+	update_accept(droot, ble_dbus_is_enabled(droot));
 	ble_dbus_create_item(dev_ctl, "Age", veVariantSn32(&val, 0), &veUnitIndex);
 	ble_dbus_create_item(dev_ctl, "Name", veVariantInvalidType(&val, VE_HEAP_STR), &veUnitIndex);
 	item = ble_dbus_create_item(dev_ctl, "CustomName",
@@ -682,7 +1048,11 @@ struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
 
 	ble_dbus_create_str(droot, "Mgmt/ProcessName", pltProgramName());
 	ble_dbus_create_str(droot, "Mgmt/ProcessVersion", VERSION);
-	ble_dbus_create_str(droot, "Mgmt/Connection", data_source_str[d->active_source]);
+	ble_dbus_create_str(droot, "Mgmt/Connection", data_source_str[DATA_SOURCE_NONE]);
+	ble_dbus_create_item(droot, "Mgmt/Gateway",
+			     veVariantInvalidType(&val, VE_HEAP_STR), &veUnitNone);
+	d->rssi = ble_dbus_create_item(droot, "Mgmt/Rssi",
+				       veVariantInvalidType(&val, VE_SN32), &veUnitdBm);
 	ble_dbus_create_int(droot, "Mgmt/InsecureConnection", 1);
 	ble_dbus_create_int(droot, "Connected", 1);
 	ble_dbus_create_int(droot, "Devices/0/ProductId", info->product_id);
@@ -700,13 +1070,29 @@ struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
 	set_names(droot, NAME_ORIG_NONE);
 	veItemSendPendingChanges(ctl);
 
+	ble_filter_update();
+	ble_feedback_update();
+
 out:
-	if (ble_dbus_is_enabled(droot))
-		deferred_create(droot);
+	return ble_dbus_seen(droot);
+}
 
-	veItemLocalSet(droot, veVariantUn32(&val, tick));
+/*
+ * Like ble_dbus_create(), for device @addr, or channel @channel of it.
+ * Known devices are found without building their path.
+ */
+struct VeItem *ble_dbus_create_addr(const bdaddr_t *addr, int channel,
+				    const struct dev_info *info, const void *data)
+{
+	struct VeItem *droot = ble_dbus_get_dev_addr(addr, channel);
+	char dev[24];
 
-	return droot;
+	if (droot)
+		return ble_dbus_seen(droot);
+
+	format_dev(dev, sizeof(dev), addr, channel);
+
+	return ble_dbus_create(dev, info, data);
 }
 
 static int ble_dbus_connect(struct VeItem *droot)
@@ -757,16 +1143,25 @@ static int ble_dbus_connect(struct VeItem *droot)
 
 int ble_dbus_set_regs(struct VeItem *droot, const uint8_t *data, int len)
 {
-	const struct dev_info *info = get_dev_info(droot);
+	struct device *d = get_device(droot);
+	struct reg_ctx ctx;
+	VeVariant val;
 	int i;
 
-	for (i = 0; i < info->num_regs; i++) {
-		const struct reg_info *reg = &info->regs[i];
+	ctx.root = droot;
+	ctx.table = d->reg_table;
+	ble_regs_extract(&ctx, data, len);
+
+	for (i = 0; i < d->info.num_regs; i++) {
+		const struct reg_info *reg = &d->info.regs[i];
 
-		if ((reg->flags & REG_FLAG_KEY) && reg->key != info->reg_key)
+		if ((reg->flags & REG_FLAG_KEY) && reg->key != d->info.reg_key)
 			continue;
 
-		set_reg(droot, reg, data, len);
+		if (ble_regs_decode(&ctx, i, &val))
+			veVariantInvalidType(&val, reg->type);
+
+		veItemOwnerSet(d->regs[i], &val);
 	}
 
 	return 0;
@@ -796,8 +1191,14 @@ static int alarm_name(const struct alarm *alarm, char *buf, size_t size)
 	return snprintf(buf, size, "Alarms/%s", alarm->name);
 }
 
-static void add_alarm_config(struct VeItem *droot, const struct alarm *alarm)
+static void on_alarm_setting_changed(struct VeItem *item)
 {
+	forget_payload(veItemCtx(item)->ptr);
+}
+
+static void add_alarm_config(struct VeItem *droot, struct alarm_items *a)
+{
+	const struct alarm *alarm = a->alarm;
 	struct VeItem *settings = get_settings();
 	char path[64];
 	char buf[64];
@@ -805,60 +1206,78 @@ static void add_alarm_config(struct VeItem *droot, const struct alarm *alarm)
 	settings_path(droot, path, sizeof(path));
 
 	snprintf(buf, sizeof(buf), "Alarms/%s/Enable", alarm->name);
-	veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
-				  &veUnitNone, &bool_val);
+	a->enable = veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
+					      &veUnitNone, &bool_val);
 
 	snprintf(buf, sizeof(buf), "Alarms/%s/Active", alarm->name);
-	veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
-				  &veUnitNone, alarm->active);
+	a->active = veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
+					      &veUnitNone, alarm->active);
 
 	snprintf(buf, sizeof(buf), "Alarms/%s/Restore", alarm->name);
-	veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
-				  &veUnitNone, alarm->restore);
+	a->restore = veItemCreateSettingsProxy(settings, path, droot, buf, veVariantFmt,
+					       &veUnitNone, alarm->restore);
+
+	veItemCtx(a->enable)->ptr = droot;
+	veItemSetChanged(a->enable, on_alarm_setting_changed);
+	veItemCtx(a->active)->ptr = droot;
+	veItemSetChanged(a->active, on_alarm_setting_changed);
+	veItemCtx(a->restore)->ptr = droot;
+	veItemSetChanged(a->restore, on_alarm_setting_changed);
 }
 
 int ble_dbus_add_alarms(struct VeItem *droot, const struct alarm *alarms,
 			int num_alarms)
 {
+	struct device *d = get_device(droot);
+	struct alarm_items *a;
 	VeVariant val;
 	char buf[64];
 	int i;
 
-	for (i = 0; i < num_alarms; i++) {
+	if (!num_alarms)
+		return 0;
+
+	a = realloc(d->alarms, (d->num_alarms + num_alarms) * sizeof(*a));
+	if (!a) {
+		fprintf(stderr, "failed to allocate alarms\n");
+		return -1;
+	}
+
+	d->alarms = a;
+	a += d->num_alarms;
+	d->num_alarms += num_alarms;
+
+	for (i = 0; i < num_alarms; i++, a++) {
 		const struct alarm *alarm = &alarms[i];
 
+		memset(a, 0, sizeof(*a));
+		a->alarm = alarm;
+
 		alarm_name(alarm, buf, sizeof(buf));
-		ble_dbus_create_item(droot, buf, veVariantUn32(&val, 0), &veUnitNone);
+		a->state = ble_dbus_create_item(droot, buf, veVariantUn32(&val, 0), &veUnitNone);
 		if (alarm->flags & ALARM_FLAG_CONFIG)
-			add_alarm_config(droot, alarm);
+			add_alarm_config(droot, a);
 	}
 
 	return 0;
 }
 
-static int alarm_enabled(struct VeItem *droot, const struct alarm *alarm)
+static int alarm_enabled(const struct alarm_items *a)
 {
-	char buf[64];
-
-	if (alarm->flags & ALARM_FLAG_CONFIG) {
-		snprintf(buf, sizeof(buf), "Alarms/%s/Enable", alarm->name);
-		return veItemValueInt(droot, buf);
-	}
+	if (a->alarm->flags & ALARM_FLAG_CONFIG)
+		return ble_dbus_item_int(a->enable);
 
 	return 1;
 }
 
-static float alarm_level(struct VeItem *droot, const struct alarm *alarm,
+static float alarm_level(struct VeItem *droot, const struct alarm_items *a,
 			 int active)
 {
-	char buf[64];
+	const struct alarm *alarm = a->alarm;
 	float level;
 
-	if (alarm->flags & ALARM_FLAG_CONFIG) {
-		snprintf(buf, sizeof(buf), "Alarms/%s/%s", alarm->name,
-			 active ? "Restore" : "Active");
-		return veItemValueFloat(droot, buf);
-	}
+	if (alarm->flags & ALARM_FLAG_CONFIG)
+		return ble_dbus_item_float(active ? a->restore : a->active);
 
 	if (alarm->get_level)
 		level = alarm->get_level(droot, alarm);
@@ -871,32 +1290,31 @@ static float alarm_level(struct VeItem *droot, const struct alarm *alarm,
 	return level;
 }
 
-static void update_alarm(struct VeItem *droot, const struct alarm *alarm)
+static void update_alarm(struct VeItem *droot, struct alarm_items *a)
 {
-	struct VeItem *alarm_item;
+	const struct alarm *alarm = a->alarm;
+	struct VeItem *alarm_item = a->state;
 	struct VeItem *item;
 	VeVariant val;
 	float level;
 	int active = 0;
-	char buf[64];
 
-	item = veItemByUid(droot, alarm->item);
-	if (!item || !veItemIsValid(item))
-		return;
+	/* The monitored item may be created by the init after the alarm */
+	if (!a->item)
+		a->item = veItemByUid(droot, alarm->item);
 
-	alarm_name(alarm, buf, sizeof(buf));
-	alarm_item = veItemGetOrCreateUid(droot, buf);
-	if (!alarm_item)
+	item = a->item;
+	if (!item || !veItemIsValid(item))
 		return;
 
-	if (alarm_enabled(droot, alarm)) {
+	if (alarm_enabled(a)) {
 		if (veItemIsValid(alarm_item)) {
 			veItemLocalValue(alarm_item, &val);
 			veVariantToN32(&val);
 			active = val.value.UN32;
 		}
 
-		level = alarm_level(droot, alarm, active);
+		level = alarm_level(droot, a, active);
 
 		veItemLocalValue(item, &val);
 		veVariantToFloat(&val);
@@ -913,15 +1331,47 @@ static void update_alarm(struct VeItem *droot, const struct alarm *alarm)
 
 void ble_dbus_update_alarms(struct VeItem *droot)
 {
-	const struct dev_info *info = get_dev_info(droot);
-	const struct dev_class *dclass = get_dev_class(info);
+	struct device *d = get_device(droot);
+	int i;
+
+	for (i = 0; i < d->num_alarms; i++)
+		update_alarm(droot, &d->alarms[i]);
+}
+
+static void send_changes(struct VeItem *droot)
+{
+	struct device *d = get_device(droot);
+
+	if (!flush_batch || num_flush_pending == FLUSH_MAX) {
+		veItemSendPendingChanges(droot);
+		return;
+	}
+
+	if (d->flush_queued)
+		return;
+
+	d->flush_queued = 1;
+	flush_pending[num_flush_pending++] = droot;
+}
+
+/* Coalesces the D-Bus signals of devices updated more than once */
+void ble_dbus_batch_begin(void)
+{
+	flush_batch = 1;
+}
+
+void ble_dbus_batch_end(void)
+{
 	int i;
 
-	for (i = 0; i < dclass->num_alarms; i++)
-		update_alarm(droot, &dclass->alarms[i]);
+	flush_batch = 0;
 
-	for (i = 0; i < info->num_alarms; i++)
-		update_alarm(droot, &info->alarms[i]);
+	for (i = 0; i < num_flush_pending; i++) {
+		get_device(flush_pending[i])->flush_queued = 0;
+		veItemSendPendingChanges(flush_pending[i]);
+	}
+
+	num_flush_pending = 0;
 }
 
 int ble_dbus_update(struct VeItem *droot)
@@ -935,38 +1385,129 @@ int ble_dbus_update(struct VeItem *droot)
 
 	ble_dbus_update_alarms(droot);
 	ble_dbus_connect(droot);
-	veItemSendPendingChanges(droot);
+	send_changes(droot);
 
 	return 0;
 }
 
-static void set_active_source(struct VeItem *root, enum data_source source)
+static struct source *active_source(struct device *d)
+{
+	return d->active >= 0 ? &d->sources[d->active] : NULL;
+}
+
+/*
+ * Finds the entry of the source the data being handled came from, see
+ * ble_set_origin(), and records that it was heard. When the table is
+ * full, the entry heard least recently, other than the active one, is
+ * reused.
+ */
+static struct source *update_source(struct device *d, enum data_source type)
+{
+	const struct ble_origin *origin = ble_get_origin();
+	const bdaddr_t *gateway = type == origin->source ? &origin->gateway : BDADDR_ANY;
+	uint32_t age = origin->age * TICKS_PER_SEC / 1000;
+	struct source *s = NULL;
+	int i;
+
+	for (i = 0; i < d->num_sources; i++) {
+		if (d->sources[i].type == type &&
+		    !bacmp(&d->sources[i].gateway, gateway)) {
+			s = &d->sources[i];
+			break;
+		}
+	}
+
+	if (!s) {
+		if (d->num_sources < SOURCES_MAX) {
+			s = &d->sources[d->num_sources++];
+		} else {
+			for (i = 0; i < SOURCES_MAX; i++) {
+				if (i == d->active)
+					continue;
+				if (!s || tick - d->sources[i].last_tick > tick - s->last_tick)
+					s = &d->sources[i];
+			}
+		}
+
+		s->type = type;
+		bacpy(&s->gateway, gateway);
+		s->rssi = NAN;
+	}
+
+	s->last_tick = tick - (age < dedup_window_ticks ? age : dedup_window_ticks);
+
+	if (type == origin->source && origin->rssi != BLE_RSSI_INVALID) {
+		if (isnan(s->rssi))
+			s->rssi = origin->rssi;
+		else
+			s->rssi += (origin->rssi - s->rssi) * SOURCE_RSSI_WEIGHT;
+	}
+
+	return s;
+}
+
+static void publish_rssi(struct VeItem *root, const struct source *s)
 {
 	struct device *d = get_device(root);
-	if (source == d->active_source)
+	VeVariant val;
+
+	if (isnan(s->rssi))
+		veItemInvalidate(d->rssi);
+	else
+		veItemOwnerSet(d->rssi, veVariantSn32(&val, lrintf(s->rssi)));
+}
+
+static void set_active_source(struct VeItem *root, struct source *s)
+{
+	struct device *d = get_device(root);
+	const bdaddr_t *gw = &s->gateway;
+	char addr[18];
+
+	publish_rssi(root, s);
+
+	if (s == active_source(d))
 		return;
 
-	d->active_source = source;
-	ble_dbus_set_str(root, "Mgmt/Connection", data_source_str[d->active_source]);
+	d->active = s - d->sources;
+	ble_dbus_set_str(root, "Mgmt/Connection", data_source_str[s->type]);
+
+	if (!bacmp(gw, BDADDR_ANY)) {
+		ble_dbus_set_invalid(root, "Mgmt/Gateway");
+		return;
+	}
+
+	snprintf(addr, sizeof(addr), "%02X:%02X:%02X:%02X:%02X:%02X",
+		 gw->b[5], gw->b[4], gw->b[3], gw->b[2], gw->b[1], gw->b[0]);
+	ble_dbus_set_str(root, "Mgmt/Gateway", addr);
+}
+
+/*
+ * Whether s should replace the active source. One that went silent is
+ * replaced by anything. Otherwise a source must be heard clearly
+ * stronger, or, if the levels are not known, be local reception
+ * replacing a gateway.
+ */
+static int better_source(struct device *d, const struct source *s)
+{
+	const struct source *a = active_source(d);
+
+	if (!a || tick - a->last_tick > dedup_window_ticks)
+		return 1;
+
+	if (!isnan(s->rssi) && !isnan(a->rssi))
+		return s->rssi > a->rssi + SOURCE_HYSTERESIS;
+
+	return s->type == DATA_SOURCE_BLE && a->type != DATA_SOURCE_BLE;
 }
 
 veBool ble_dbus_check_dup(struct VeItem *root, enum data_source source)
 {
 	struct device *d = get_device(root);
-	// When it comes from the same source as the last active one, it is never considered a duplicate
-	d->last_tick[source] = tick;
-	if (source == d->active_source)
-		return veFalse;
+	struct source *s = update_source(d, source);
 
-	if (source == DATA_SOURCE_BLE) {
-		// When it is received via BLE, it is never considered a duplicate
-		set_active_source(root, source);
-		return veFalse;
-	} else if (!d->last_tick[DATA_SOURCE_BLE]
-		   || tick - d->last_tick[DATA_SOURCE_BLE] > dedup_window_ticks) {
-		// When we haven't received data from BLE for a while, consider the source changed and not a
-		// duplicate
-		set_active_source(root, source);
+	// Data from the active source is never considered a duplicate
+	if (s == active_source(d) || better_source(d, s)) {
+		set_active_source(root, s);
 		return veFalse;
 	}
 
@@ -976,21 +1517,64 @@ veBool ble_dbus_check_dup(struct VeItem *root, enum data_source source)
 veBool ble_dbus_check_dup_seq(struct VeItem *root, enum data_source source, uint32_t seqnr)
 {
 	struct device *d     = get_device(root);
-	d->last_tick[source] = tick;
+	uint32_t mask	     = (1u << d->info.seqnr_bits) - 1;
+	struct source *s     = update_source(d, source);
+	struct source *a     = active_source(d);
 
-	if (d->active_source != DATA_SOURCE_NONE) {
+	if (a) {
 		if (seqnr == d->last_seqno)
 			return veFalse; // Return false, so that the data is processed and it doesn't timeout
 
 		// Check if the distance between seqnr and d->last_seqno is negative and smaller
 		// than d->seqnr_window.
-		uint32_t mask	= (1u << d->info.seqnr_bits) - 1;
 		uint32_t window = d->info.seqnr_window;
 		if (((seqnr - d->last_seqno + window) & mask) < window)
 			return veTrue;
 	}
+
+	// Gaps in a BLE stream tell the scan scheduler reports are being missed
+	if (s->type == DATA_SOURCE_BLE && a == s && ble_dbus_is_enabled(root))
+		ble_scan_seq_gap((seqnr - d->last_seqno) & mask);
+
 	d->last_seqno = seqnr;
-	set_active_source(root, source);
+
+	// Any source may deliver a new reading, the link shown changes less often
+	if (s == a || better_source(d, s))
+		set_active_source(root, s);
+
+	return veFalse;
+}
+
+/*
+ * Whether buf repeats the payload last decoded for the device, which
+ * then need not be decoded and published again. Its liveness was
+ * already refreshed when it was looked up, and the source items the
+ * duplicate checks changed are sent here. Call after the duplicate
+ * checks, right before decoding.
+ */
+veBool ble_dbus_check_unchanged(struct VeItem *root, const uint8_t *buf, int len)
+{
+	struct device *d = get_device(root);
+
+	/* Not published yet, ble_dbus_update() still has to connect it */
+	if (!veItemDbus(root)) {
+		d->last_len = 0;
+		return veFalse;
+	}
+
+	if (len == d->last_len && !memcmp(buf, d->last_payload, len)) {
+		unchanged_count++;
+		send_changes(root);
+		return veTrue;
+	}
+
+	if (len > PAYLOAD_MAX) {
+		d->last_len = 0;
+		return veFalse;
+	}
+
+	memcpy(d->last_payload, buf, len);
+	d->last_len = len;
 
 	return veFalse;
 }
@@ -1005,6 +1589,8 @@ static void ble_dbus_delete(struct VeItem *droot)
 	struct device *d = get_device(droot);
 	struct VeDbus *dbus;
 
+	update_accept(droot, 0);
+
 	veItemCtx(d->settings_cname)->ptr = NULL;
 	veItemSetChanged(d->settings_cname, NULL);
 
@@ -1015,6 +1601,9 @@ static void ble_dbus_delete(struct VeItem *droot)
 		veDbusDisconnect(dbus);
 
 	veItemDeleteBranch(droot);
+
+	ble_filter_update();
+	ble_feedback_update();
 }
 
 static void ble_dbus_expire(void)
@@ -1046,6 +1635,7 @@ void ble_dbus_tick(void)
 	if (!--dev_expire) {
 		dev_expire = 10 * TICKS_PER_SEC;
 		ble_dbus_expire();
+		ble_dbus_item_set_int(unchanged_item, unchanged_count);
 		veItemSendPendingChanges(get_control());
 	}
 }
@@ -39,6 +39,8 @@ struct alarm {
 #define ALARM_FLAG_HIGH		(1 << 0)
 #define ALARM_FLAG_CONFIG	(1 << 1)
 
+struct reg_ctx;
+
 struct reg_info {
 	uint16_t	type;
 	uint16_t	offset;
@@ -49,7 +51,7 @@ struct reg_info {
 	uint32_t	inval;
 	uint32_t	flags;
 	uint32_t	key;
-	int		(*xlate)(struct VeItem *root, VeVariant *val,
+	int		(*xlate)(const struct reg_ctx *ctx, VeVariant *val,
 				 uint64_t rawval);
 	const char	*name;
 	const void	*format;
@@ -114,13 +116,24 @@ extern const VeVariantUnitFmt veUnitPPM;
 extern const VeVariantUnitFmt veUnitUgM3;
 extern const VeVariantUnitFmt veUnitLux;
 extern const VeVariantUnitFmt veUnitIndex;
+extern const VeVariantUnitFmt veUnitPerSec;
+extern const VeVariantUnitFmt veUnitms;
 
 int ble_dbus_init(void);
-int ble_dbus_add_interface(const char *name, const char *addr);
+struct VeItem *ble_dbus_add_interface(const char *name, const char *addr);
+struct VeItem *ble_dbus_add_interface_item(struct VeItem *intf,
+					   const char *path,
+					   VeDataBasicType type,
+					   const void *format);
 int ble_dbus_invalidate_interface(const char *name);
 struct VeItem *ble_dbus_create(const char *dev, const struct dev_info *info,
 			       const void *data);
+struct VeItem *ble_dbus_create_addr(const bdaddr_t *addr, int channel,
+				    const struct dev_info *info, const void *data);
 struct VeItem *ble_dbus_get_dev(const char *dev);
+struct VeItem *ble_dbus_get_dev_addr(const bdaddr_t *addr, int channel);
+int ble_dbus_get_addrs(bdaddr_t *addrs, uint8_t *enabled, int max);
+int ble_dbus_addr_enabled(const bdaddr_t *addr);
 void *ble_dbus_get_pdata(struct VeItem *root);
 void *ble_dbus_get_cdata(struct VeItem *root);
 int ble_dbus_add_settings(struct VeItem *droot,
@@ -129,7 +142,15 @@ int ble_dbus_add_settings(struct VeItem *droot,
 int ble_dbus_add_alarms(struct VeItem *droot, const struct alarm *alarms,
 			int num_alarms);
 int ble_dbus_is_enabled(struct VeItem *root);
+int ble_dbus_item_int(struct VeItem *item);
+float ble_dbus_item_float(struct VeItem *item);
+void ble_dbus_item_set_int(struct VeItem *item, int num);
+void ble_dbus_item_set_float(struct VeItem *item, float num);
+void ble_dbus_item_set_str(struct VeItem *item, const char *str);
 int ble_dbus_set_regs(struct VeItem *root, const uint8_t *data, int len);
+struct VeItem *ble_dbus_reg_root(const struct reg_ctx *ctx);
+int ble_dbus_reg_raw(const struct reg_ctx *ctx, int reg, uint64_t *raw);
+int ble_dbus_reg_value(const struct reg_ctx *ctx, int reg, VeVariant *val);
 int ble_dbus_set_name(struct VeItem *root, const char *name, enum name_source source);
 struct VeItem *ble_dbus_create_item(struct VeItem *droot, const char *path, VeVariant *val,
 				    const void *format);
@@ -148,9 +169,12 @@ int ble_dbus_set_remote_invalid(struct VeItem *root, const char *path);
 struct VeItem *ble_dbus_get_control_item(struct VeItem *droot, const char *name);
 void ble_dbus_update_alarms(struct VeItem *droot);
 int ble_dbus_update(struct VeItem *root);
+void ble_dbus_batch_begin(void);
+void ble_dbus_batch_end(void);
 void ble_dbus_tick(void);
 
 veBool ble_dbus_check_dup(struct VeItem *root, enum data_source source);
 veBool ble_dbus_check_dup_seq(struct VeItem *root, enum data_source source, uint32_t seqnr);
+veBool ble_dbus_check_unchanged(struct VeItem *root, const uint8_t *buf, int len);
 
 #endif
@@ -0,0 +1,568 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+#include <velib/utils/ve_item_utils.h>
+
+#include "ble-dbus.h"
+#include "ble-feedback.h"
+#include "ble-handler.h"
+#include "task.h"
+
+/*
+ * Feedback to gateways, so they forward only advertisements we use.
+ *
+ * A gateway subscribes by sending, to the gateway socket, and repeating
+ * at least every FEEDBACK_EXPIRE / 2 seconds:
+ *   byte 0: BLE_FEEDBACK_SUBSCRIBE
+ *   bytes 1-4: epoch of the table it holds, 0 if none (little endian)
+ *   bytes 5-8: version of the table it holds (little endian)
+ *   bytes 9-12: cookie (little endian), left out until it has one
+ *
+ * Over UDP, a subscribe without the cookie the daemon issued for that
+ * address and port is answered only with a new cookie, no larger than
+ * the request:
+ *   byte 0: BLE_FEEDBACK_COOKIE
+ *   bytes 1-4: cookie (little endian)
+ * The gateway sends the subscribe again with it, and keeps using it for
+ * renewals. A spoofed sender never sees the cookie, so it can neither
+ * subscribe nor have the table sent anywhere. Local forwarders need no
+ * cookie.
+ *
+ * It is answered with the changes since that version, or the whole table
+ * if they are no longer known, and sent the changes as they happen:
+ *   byte 0: BLE_FEEDBACK_TABLE
+ *   byte 1: flags, BLE_FEEDBACK_FLAG_*
+ *   bytes 2-5: epoch (little endian)
+ *   bytes 6-9: version the changes apply to, 0 with FLAG_FULL
+ *   bytes 10-13: version after applying (little endian)
+ *   byte 14: number of manufacturer IDs M, only in the first FULL packet
+ *   2 * M bytes: manufacturer IDs (little endian)
+ *   byte: number of entries N
+ *   7 * N bytes: entries, an operation BLE_FEEDBACK_OP_* and a bdaddr
+ *
+ * FLAG_FULL starts a new table, FLAG_MORE marks that more packets of the
+ * same update follow. A gateway takes the new version only after the
+ * last packet. Operations may be applied more than once, so an update
+ * that was partly lost is simply repeated on the next subscribe.
+ *
+ * Listed enabled addresses are forwarded, listed disabled ones dropped.
+ * Others are forwarded if they carry one of the manufacturer IDs, so new
+ * devices are still found.
+ *
+ * Cookies are only issued to hosts that sent gateway data within
+ * FEEDBACK_EXPIRE. The whole table is sent to a subscriber at most once
+ * every FEEDBACK_FULL_INTERVAL seconds, however often it asks for it.
+ */
+
+#define FEEDBACK_MAX_ADDRS	256
+#define FEEDBACK_MAX_MFG_IDS	16
+#define FEEDBACK_MAX_GATEWAYS	16
+#define FEEDBACK_MAX_SOURCES	32
+#define FEEDBACK_MAX_COOKIES	16
+#define FEEDBACK_LOG_SIZE	256
+
+/* Seconds a gateway stays subscribed without renewing */
+#define FEEDBACK_EXPIRE		120
+
+/* Seconds an issued cookie may take to come back */
+#define FEEDBACK_COOKIE_EXPIRE	30
+
+/* Minimum seconds between two full tables to one subscriber */
+#define FEEDBACK_FULL_INTERVAL	10
+
+#define FEEDBACK_PACKET_SIZE	1400
+#define FEEDBACK_HDR_SIZE	14
+#define FEEDBACK_ENTRY_SIZE	7
+#define FEEDBACK_SUBSCRIBE_SIZE	9
+#define FEEDBACK_COOKIE_SIZE	5
+
+struct feedback_entry {
+	bdaddr_t addr;
+	uint8_t op;
+	uint32_t version;	/* log entries only */
+};
+
+struct feedback_gateway {
+	int sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint32_t cookie;
+	uint32_t version;
+	uint32_t last_seen;	/* seconds */
+	uint32_t last_full;	/* seconds */
+};
+
+/* A cookie sent to an address that has not subscribed with it yet */
+struct feedback_cookie {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	uint32_t cookie;
+	uint32_t issued;	/* seconds */
+};
+
+static struct feedback_entry table[FEEDBACK_MAX_ADDRS];
+static int table_len;
+
+/* Changes after version log_base, oldest first */
+static struct feedback_entry change_log[FEEDBACK_LOG_SIZE];
+static int log_start;
+static int log_len;
+static uint32_t log_base;
+
+struct feedback_source {
+	struct in_addr addr;
+	uint32_t last_seen;	/* seconds */
+};
+
+static struct feedback_gateway gateways[FEEDBACK_MAX_GATEWAYS];
+static int num_gateways;
+
+/* Hosts gateway data came from */
+static struct feedback_source sources[FEEDBACK_MAX_SOURCES];
+static int num_sources;
+
+static struct feedback_cookie cookies[FEEDBACK_MAX_COOKIES];
+static int num_cookies;
+
+static uint32_t epoch;
+static uint32_t version;
+static uint32_t seconds;
+static int dirty = 1;
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* Unpredictable, so that it cannot be guessed without receiving it */
+static uint32_t random_u32(void)
+{
+	uint32_t v;
+
+	if (getrandom(&v, sizeof(v), GRND_NONBLOCK) != sizeof(v))
+		v = random() ^ time(NULL) ^ (uint32_t)getpid() << 16;
+
+	return v;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	return memcmp(&((const struct feedback_entry *)a)->addr,
+		      &((const struct feedback_entry *)b)->addr, sizeof(bdaddr_t));
+}
+
+static void log_change(const bdaddr_t *addr, uint8_t op)
+{
+	struct feedback_entry *e;
+
+	if (log_len == FEEDBACK_LOG_SIZE) {
+		log_base = change_log[log_start].version;
+		log_start = (log_start + 1) % FEEDBACK_LOG_SIZE;
+		log_len--;
+	}
+
+	e = &change_log[(log_start + log_len++) % FEEDBACK_LOG_SIZE];
+	bacpy(&e->addr, addr);
+	e->op = op;
+	e->version = version;
+}
+
+/* Rebuilds the table, logging the differences under a new version */
+static void rebuild(void)
+{
+	static struct feedback_entry next[FEEDBACK_MAX_ADDRS];
+	static bdaddr_t addrs[FEEDBACK_MAX_ADDRS];
+	static uint8_t enabled[FEEDBACK_MAX_ADDRS];
+	int changed = 0;
+	int i, j, n;
+	int c;
+
+	n = ble_dbus_get_addrs(addrs, enabled, FEEDBACK_MAX_ADDRS);
+	if (n > FEEDBACK_MAX_ADDRS)
+		n = FEEDBACK_MAX_ADDRS;
+
+	for (i = 0; i < n; i++) {
+		bacpy(&next[i].addr, &addrs[i]);
+		next[i].op = enabled[i] ? BLE_FEEDBACK_OP_ENABLED : BLE_FEEDBACK_OP_DISABLED;
+	}
+
+	qsort(next, n, sizeof(next[0]), cmp_entry);
+
+	/* Merge the sorted tables */
+	for (i = 0, j = 0; i < table_len || j < n;) {
+		if (i == table_len)
+			c = 1;
+		else if (j == n)
+			c = -1;
+		else
+			c = cmp_entry(&table[i], &next[j]);
+
+		if (!changed && (c || table[i].op != next[j].op)) {
+			version++;
+			changed = 1;
+		}
+
+		if (c < 0) {
+			log_change(&table[i++].addr, BLE_FEEDBACK_OP_REMOVE);
+		} else if (c > 0) {
+			log_change(&next[j].addr, next[j].op);
+			j++;
+		} else {
+			if (table[i].op != next[j].op)
+				log_change(&next[j].addr, next[j].op);
+			i++;
+			j++;
+		}
+	}
+
+	memcpy(table, next, n * sizeof(next[0]));
+	table_len = n;
+}
+
+static void send_packet(struct feedback_gateway *gw, uint8_t *buf, int len)
+{
+	const struct sockaddr *addr = gw->addrlen ? (struct sockaddr *)&gw->addr : NULL;
+
+	if (sendto(gw->sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL, addr, gw->addrlen) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("feedback sendto");
+}
+
+static int begin_packet(uint8_t *buf, uint8_t flags, uint32_t base)
+{
+	buf[0] = BLE_FEEDBACK_TABLE;
+	buf[1] = flags;
+	put_le32(buf + 2, epoch);
+	put_le32(buf + 6, base);
+	put_le32(buf + 10, version);
+	buf[FEEDBACK_HDR_SIZE] = 0;
+
+	return FEEDBACK_HDR_SIZE + 1;
+}
+
+/*
+ * Sends entries in as many packets as needed. The first packet is in
+ * @buf, with the entry count going at @len.
+ */
+static void send_entries(struct feedback_gateway *gw, uint8_t *buf, int len,
+			 uint32_t base, const struct feedback_entry **entries, int n)
+{
+	int per_packet;
+	int count;
+	int i;
+
+	do {
+		per_packet = (FEEDBACK_PACKET_SIZE - len - 1) / FEEDBACK_ENTRY_SIZE;
+		count = n < per_packet ? n : per_packet;
+		n -= count;
+
+		if (n)
+			buf[1] |= BLE_FEEDBACK_FLAG_MORE;
+		else
+			buf[1] &= ~BLE_FEEDBACK_FLAG_MORE;
+
+		buf[len] = count;
+		for (i = 0; i < count; i++) {
+			uint8_t *p = buf + len + 1 + i * FEEDBACK_ENTRY_SIZE;
+
+			p[0] = entries[i]->op;
+			memcpy(p + 1, &entries[i]->addr, 6);
+		}
+
+		send_packet(gw, buf, len + 1 + count * FEEDBACK_ENTRY_SIZE);
+
+		/* Later packets carry no manufacturer IDs */
+		entries += count;
+		len = begin_packet(buf, buf[1] & ~BLE_FEEDBACK_FLAG_FULL, base);
+	} while (n);
+}
+
+static void send_update(struct feedback_gateway *gw)
+{
+	static const struct feedback_entry *entries[FEEDBACK_MAX_ADDRS + FEEDBACK_LOG_SIZE];
+	uint8_t buf[FEEDBACK_PACKET_SIZE];
+	uint16_t ids[FEEDBACK_MAX_MFG_IDS];
+	int num_ids;
+	int len;
+	int n = 0;
+	int i;
+
+	if (gw->version == version)
+		return;
+
+	if (gw->version && gw->version >= log_base && gw->version < version) {
+		for (i = 0; i < log_len; i++) {
+			struct feedback_entry *e =
+				&change_log[(log_start + i) % FEEDBACK_LOG_SIZE];
+
+			if (e->version > gw->version)
+				entries[n++] = e;
+		}
+
+		len = begin_packet(buf, 0, gw->version);
+		send_entries(gw, buf, len, gw->version, entries, n);
+	} else {
+		/* Tried again on the next subscribe or change */
+		if (seconds - gw->last_full < FEEDBACK_FULL_INTERVAL)
+			return;
+
+		for (i = 0; i < table_len; i++)
+			entries[n++] = &table[i];
+
+		len = begin_packet(buf, BLE_FEEDBACK_FLAG_FULL, 0) - 1;
+		num_ids = ble_get_mfg_ids(ids, FEEDBACK_MAX_MFG_IDS);
+		buf[len++] = num_ids;
+		for (i = 0; i < num_ids; i++) {
+			buf[len++] = ids[i];
+			buf[len++] = ids[i] >> 8;
+		}
+
+		send_entries(gw, buf, len, 0, entries, n);
+		gw->last_full = seconds;
+	}
+
+	gw->version = version;
+}
+
+static struct feedback_source *find_source(const struct sockaddr *addr,
+					   socklen_t addrlen)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	int i;
+
+	if (addrlen < sizeof(*sin) || sin->sin_family != AF_INET)
+		return NULL;
+
+	for (i = 0; i < num_sources; i++)
+		if (sources[i].addr.s_addr == sin->sin_addr.s_addr)
+			return &sources[i];
+
+	return NULL;
+}
+
+/* Called for gateway data received over UDP, replacing the oldest host */
+void ble_feedback_source(const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	struct feedback_source *src = find_source(addr, addrlen);
+	int i;
+
+	if (addrlen < sizeof(*sin) || sin->sin_family != AF_INET)
+		return;
+
+	if (!src) {
+		if (num_sources < FEEDBACK_MAX_SOURCES) {
+			src = &sources[num_sources++];
+		} else {
+			src = &sources[0];
+			for (i = 1; i < num_sources; i++)
+				if (sources[i].last_seen < src->last_seen)
+					src = &sources[i];
+		}
+
+		src->addr = sin->sin_addr;
+	}
+
+	src->last_seen = seconds;
+}
+
+/* Whether @cookie was issued to the address, forgetting it if so */
+static int take_cookie(const struct sockaddr *addr, socklen_t addrlen,
+		       uint32_t cookie)
+{
+	int i;
+
+	for (i = 0; i < num_cookies; i++) {
+		if (cookies[i].cookie == cookie && cookies[i].addrlen == addrlen &&
+		    !memcmp(&cookies[i].addr, addr, addrlen)) {
+			cookies[i] = cookies[--num_cookies];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Sends the address a cookie, replacing the oldest one issued if needed */
+static void send_cookie(int sock, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct feedback_cookie *c = NULL;
+	uint8_t buf[FEEDBACK_COOKIE_SIZE];
+	int i;
+
+	for (i = 0; i < num_cookies && !c; i++)
+		if (cookies[i].addrlen == addrlen &&
+		    !memcmp(&cookies[i].addr, addr, addrlen))
+			c = &cookies[i];
+
+	if (!c) {
+		if (num_cookies < FEEDBACK_MAX_COOKIES) {
+			c = &cookies[num_cookies++];
+		} else {
+			c = &cookies[0];
+			for (i = 1; i < num_cookies; i++)
+				if (cookies[i].issued < c->issued)
+					c = &cookies[i];
+		}
+
+		memcpy(&c->addr, addr, addrlen);
+		c->addrlen = addrlen;
+		c->cookie = random_u32() ?: 1;
+	}
+
+	c->issued = seconds;
+
+	buf[0] = BLE_FEEDBACK_COOKIE;
+	put_le32(buf + 1, c->cookie);
+
+	if (sendto(sock, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL, addr, addrlen) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("feedback sendto");
+}
+
+/*
+ * Subscribes over UDP must carry the cookie issued to their sender, only
+ * hosts that sent gateway data are issued one. Local connections, with
+ * addrlen 0, are trusted.
+ */
+void ble_feedback_subscribe(int sock, const struct sockaddr *addr, socklen_t addrlen,
+			    const uint8_t *buf, int len)
+{
+	struct feedback_gateway *gw = NULL;
+	uint32_t cookie = 0;
+	int i;
+
+	if (len < FEEDBACK_SUBSCRIBE_SIZE || addrlen > sizeof(gw->addr))
+		return;
+
+	if (len >= FEEDBACK_SUBSCRIBE_SIZE + 4)
+		cookie = get_le32(buf + FEEDBACK_SUBSCRIBE_SIZE);
+
+	for (i = 0; i < num_gateways; i++) {
+		if (gateways[i].sock == sock && gateways[i].addrlen == addrlen &&
+		    !memcmp(&gateways[i].addr, addr, addrlen)) {
+			gw = &gateways[i];
+			break;
+		}
+	}
+
+	if (addrlen && !(cookie && gw && cookie == gw->cookie) &&
+	    !(cookie && take_cookie(addr, addrlen, cookie))) {
+		if (find_source(addr, addrlen))
+			send_cookie(sock, addr, addrlen);
+		return;
+	}
+
+	if (!gw) {
+		if (num_gateways == FEEDBACK_MAX_GATEWAYS) {
+			fprintf(stderr, "too many feedback subscribers\n");
+			return;
+		}
+
+		gw = &gateways[num_gateways++];
+		gw->sock = sock;
+		gw->addrlen = addrlen;
+		if (addrlen)
+			memcpy(&gw->addr, addr, addrlen);
+		gw->last_full = seconds - FEEDBACK_FULL_INTERVAL;
+	}
+
+	gw->cookie = cookie;
+	gw->last_seen = seconds;
+
+	/* A table from another run of the daemon, or one ahead of ours */
+	gw->version = get_le32(buf + 5);
+	if (get_le32(buf + 1) != epoch || gw->version > version)
+		gw->version = 0;
+
+	if (!dirty)
+		send_update(gw);
+}
+
+/* Forgets the subscribers reached through a socket being closed */
+void ble_feedback_detach(int sock)
+{
+	int i = 0;
+
+	while (i < num_gateways) {
+		if (gateways[i].sock == sock)
+			gateways[i] = gateways[--num_gateways];
+		else
+			i++;
+	}
+}
+
+/* Called when a device is added, removed, enabled or disabled */
+void ble_feedback_update(void)
+{
+	dirty = 1;
+}
+
+void ble_feedback_tick(void)
+{
+	static uint32_t ticks = TICKS_PER_SEC;
+	int i = 0;
+
+	if (--ticks)
+		return;
+
+	ticks = TICKS_PER_SEC;
+	seconds++;
+
+	while (i < num_sources) {
+		if (seconds - sources[i].last_seen > FEEDBACK_EXPIRE)
+			sources[i] = sources[--num_sources];
+		else
+			i++;
+	}
+
+	i = 0;
+	while (i < num_cookies) {
+		if (seconds - cookies[i].issued > FEEDBACK_COOKIE_EXPIRE)
+			cookies[i] = cookies[--num_cookies];
+		else
+			i++;
+	}
+
+	i = 0;
+	while (i < num_gateways) {
+		if (seconds - gateways[i].last_seen > FEEDBACK_EXPIRE)
+			gateways[i] = gateways[--num_gateways];
+		else
+			i++;
+	}
+
+	if (!dirty)
+		return;
+
+	dirty = 0;
+
+	/* Random, as the time may repeat across boots without an RTC */
+	if (!epoch) {
+		epoch = random_u32() ?: 1;
+		version = 1;
+		log_base = version;
+	}
+
+	rebuild();
+
+	for (i = 0; i < num_gateways; i++)
+		send_update(&gateways[i]);
+}
@@ -0,0 +1,29 @@
+#ifndef BLE_FEEDBACK_H
+#define BLE_FEEDBACK_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <bluetooth/bluetooth.h>
+
+/* Packet types of the feedback channel, beyond the gateway formats */
+#define BLE_FEEDBACK_SUBSCRIBE	0x80
+#define BLE_FEEDBACK_TABLE	0x81
+#define BLE_FEEDBACK_COOKIE	0x82
+
+/* Table packet flags */
+#define BLE_FEEDBACK_FLAG_FULL	(1 << 0)
+#define BLE_FEEDBACK_FLAG_MORE	(1 << 1)
+
+/* Table entry operations */
+#define BLE_FEEDBACK_OP_REMOVE	 0
+#define BLE_FEEDBACK_OP_ENABLED	 1
+#define BLE_FEEDBACK_OP_DISABLED 2
+
+void ble_feedback_source(const struct sockaddr *addr, socklen_t addrlen);
+void ble_feedback_subscribe(int sock, const struct sockaddr *addr, socklen_t addrlen,
+			    const uint8_t *buf, int len);
+void ble_feedback_detach(int sock);
+void ble_feedback_update(void);
+void ble_feedback_tick(void);
+
+#endif
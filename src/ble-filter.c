@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include <velib/utils/ve_todo.h>
+
+#include "ble-dbus.h"
+#include "ble-filter.h"
+#include "ble-handler.h"
+#include "task.h"
+
+/*
+ * Classic BPF socket filters dropping advertisements we would not decode
+ * anyway, before they wake us up.
+ *
+ * An advertisement is accepted when it carries Manufacturer Specific Data
+ * with one of the IDs from the handler table, or a Complete Local Name
+ * while the advertiser is already a known device. Anything that is not an
+ * advertisement we know how to walk (other HCI events, multi-report
+ * events, unknown gateway packet versions) is passed on unchanged.
+ *
+ * With extended scanning, legacy PDUs are reported in extended reports
+ * and walked the same way. Extended PDUs are passed on: the final
+ * fragment of a chained advertisement is indistinguishable from a
+ * complete one, and dropping it would leave the reassembly hanging.
+ *
+ * Out of bounds loads make the kernel drop the packet. That only happens
+ * for truncated AD structures, which ble_parse_adv() ignores as well.
+ */
+
+/*
+ * Program size is bounded by 5 instructions per address and about
+ * 12 + MAX_FILTER_MFG_IDS per AD structure, twice for the HCI filter,
+ * well below BPF_MAXINSNS.
+ */
+#define MAX_FILTER_SOCKS	(HCI_MAX_DEV + 1)
+#define MAX_FILTER_MFG_IDS	16
+#define MAX_FILTER_ADDRS	128
+
+/* 31 bytes of legacy advertising data hold at most 15 AD structures */
+#define MAX_FILTER_AD		16
+
+/* Offsets in an HCI LE Advertising Report event with a single report */
+#define HCI_OFS_NUM_REPORTS	4
+#define HCI_OFS_BDADDR		7
+#define HCI_OFS_DATA		14
+
+/* Offsets in an HCI LE Extended Advertising Report event */
+#define EVT_LE_EXT_ADVERTISING_REPORT	0x0D
+#define HCI_OFS_EXT_TYPE	5
+#define HCI_OFS_EXT_BDADDR	8
+#define HCI_OFS_EXT_DATA	29
+#define EXT_ADV_LEGACY		(1 << 4)
+
+/*
+ * Offsets in gateway packets, see ble_socket_parse(). UDP socket filters
+ * see the packet starting at the UDP header.
+ */
+#define SOCK_OFS_VERSION	sizeof(struct udphdr)
+#define SOCK_OFS_V1_MFG_ID	(SOCK_OFS_VERSION + 8)
+#define SOCK_OFS_V2_BDADDR	(SOCK_OFS_VERSION + 7)
+#define SOCK_OFS_V2_DATA	(SOCK_OFS_VERSION + 14)
+
+#define ACCEPT			0xffffffff
+#define REJECT			0
+
+/* Scratch memory slots */
+#define MEM_ADLEN		0
+#define MEM_KNOWN		1
+
+struct filter_sock {
+	int sock;
+	enum ble_filter_type type;
+};
+
+struct filter_prog {
+	struct sock_filter insns[BPF_MAXINSNS];
+	int len;
+	uint16_t mfg_ids[MAX_FILTER_MFG_IDS];
+	int num_mfg_ids;
+	bdaddr_t addrs[MAX_FILTER_ADDRS];
+	int num_addrs;
+};
+
+static struct filter_sock filter_socks[MAX_FILTER_SOCKS];
+static int num_filter_socks;
+static struct filter_prog prog;
+static int filter_dirty;
+
+static int emit(struct filter_prog *p, uint16_t code, uint8_t jt, uint8_t jf,
+		uint32_t k)
+{
+	struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+
+	p->insns[p->len] = insn;
+
+	return p->len++;
+}
+
+static void set_jt(struct filter_prog *p, int pc, int target)
+{
+	p->insns[pc].jt = target - pc - 1;
+}
+
+static void set_jf(struct filter_prog *p, int pc, int target)
+{
+	p->insns[pc].jf = target - pc - 1;
+}
+
+static void set_ja(struct filter_prog *p, int pc, int target)
+{
+	p->insns[pc].k = target - pc - 1;
+}
+
+/* The halfword loads are big endian, manufacturer IDs are little endian */
+static uint32_t mfg_id_be(uint16_t id)
+{
+	return (id & 0xff) << 8 | id >> 8;
+}
+
+/* Pass the packet on unless byte @ofs equals @val */
+static void emit_require(struct filter_prog *p, uint32_t ofs, uint32_t val)
+{
+	emit(p, BPF_LD | BPF_B | BPF_ABS, 0, 0, ofs);
+	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, val);
+	emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+}
+
+/*
+ * Compare the mfg ID in A against the table. Returns the first compare,
+ * the match target is filled in later by set_mfg_match().
+ */
+static int emit_mfg_match(struct filter_prog *p)
+{
+	int first = p->len;
+	int i;
+
+	for (i = 0; i < p->num_mfg_ids; i++)
+		emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0,
+		     mfg_id_be(p->mfg_ids[i]));
+
+	return first;
+}
+
+static void set_mfg_match(struct filter_prog *p, int first, int target)
+{
+	int i;
+
+	for (i = 0; i < p->num_mfg_ids; i++)
+		set_jt(p, first + i, target);
+}
+
+/*
+ * Store 1 in M[MEM_KNOWN] when the advertiser address at @ofs belongs to a
+ * known device, 0 otherwise. With too many devices to list, names are
+ * let through for everyone.
+ */
+static void emit_known_addr(struct filter_prog *p, uint32_t ofs)
+{
+	int known[MAX_FILTER_ADDRS];
+	int done;
+	int i;
+
+	if (p->num_addrs > MAX_FILTER_ADDRS) {
+		emit(p, BPF_LD | BPF_IMM, 0, 0, 1);
+		emit(p, BPF_ST, 0, 0, MEM_KNOWN);
+		return;
+	}
+
+	for (i = 0; i < p->num_addrs; i++) {
+		const uint8_t *b = p->addrs[i].b;
+
+		emit(p, BPF_LD | BPF_W | BPF_ABS, 0, 0, ofs);
+		emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 3,
+		     b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]);
+		emit(p, BPF_LD | BPF_H | BPF_ABS, 0, 0, ofs + 4);
+		emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, b[4] << 8 | b[5]);
+		known[i] = emit(p, BPF_JMP | BPF_JA, 0, 0, 0);
+	}
+
+	emit(p, BPF_LD | BPF_IMM, 0, 0, 0);
+	done = emit(p, BPF_JMP | BPF_JA, 0, 0, 0);
+
+	for (i = 0; i < p->num_addrs; i++)
+		set_ja(p, known[i], p->len);
+
+	emit(p, BPF_LD | BPF_IMM, 0, 0, 1);
+	set_ja(p, done, p->len);
+	emit(p, BPF_ST, 0, 0, MEM_KNOWN);
+}
+
+/*
+ * Walk the AD structures starting at @ofs, unrolled since classic BPF
+ * has no backward jumps. X holds the offset of the current structure.
+ *
+ * The kernel checks scratch memory use without following returns, so
+ * M[MEM_ADLEN] is stored before anything can branch to the returns.
+ */
+static void emit_ad_walk(struct filter_prog *p, uint32_t ofs)
+{
+	int i;
+
+	emit(p, BPF_LDX | BPF_IMM, 0, 0, ofs);
+
+	for (i = 0; i < MAX_FILTER_AD; i++) {
+		int zero, name, mfg, minlen, match, skip, known;
+		int accept, reject, next;
+
+		emit(p, BPF_LD | BPF_B | BPF_IND, 0, 0, 0);
+		emit(p, BPF_ST, 0, 0, MEM_ADLEN);
+		zero = emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0);
+
+		emit(p, BPF_LD | BPF_B | BPF_IND, 0, 0, 1);
+		name = emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0x09);
+		mfg = emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 0xff);
+
+		/* Manufacturer Specific Data: id plus at least one byte */
+		emit(p, BPF_LD | BPF_MEM, 0, 0, MEM_ADLEN);
+		minlen = emit(p, BPF_JMP | BPF_JGE | BPF_K, 0, 0, 4);
+		emit(p, BPF_LD | BPF_H | BPF_IND, 0, 0, 2);
+		match = emit_mfg_match(p);
+		skip = emit(p, BPF_JMP | BPF_JA, 0, 0, 0);
+
+		/* Complete Local Name */
+		set_jt(p, name, p->len);
+		emit(p, BPF_LD | BPF_MEM, 0, 0, MEM_KNOWN);
+		known = emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+
+		accept = emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+		reject = emit(p, BPF_RET | BPF_K, 0, 0, REJECT);
+
+		next = emit(p, BPF_LD | BPF_MEM, 0, 0, MEM_ADLEN);
+		emit(p, BPF_ALU | BPF_ADD | BPF_K, 0, 0, 1);
+		emit(p, BPF_ALU | BPF_ADD | BPF_X, 0, 0, 0);
+		emit(p, BPF_MISC | BPF_TAX, 0, 0, 0);
+
+		set_jt(p, zero, reject);
+		set_jf(p, mfg, next);
+		set_jf(p, minlen, next);
+		set_mfg_match(p, match, accept);
+		set_ja(p, skip, next);
+		set_jt(p, known, accept);
+		set_jf(p, known, next);
+	}
+
+	emit(p, BPF_RET | BPF_K, 0, 0, REJECT);
+}
+
+static void build_hci(struct filter_prog *p)
+{
+	int legacy;
+
+	p->len = 0;
+
+	emit_require(p, 0, HCI_EVENT_PKT);
+	emit_require(p, 1, EVT_LE_META_EVENT);
+
+	/* The walks are too long for a conditional jump over them */
+	emit(p, BPF_LD | BPF_B | BPF_ABS, 0, 0, 1 + HCI_EVENT_HDR_SIZE);
+	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 1, EVT_LE_ADVERTISING_REPORT);
+	legacy = emit(p, BPF_JMP | BPF_JA, 0, 0, 0);
+	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, EVT_LE_EXT_ADVERTISING_REPORT);
+	emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+
+	emit_require(p, HCI_OFS_NUM_REPORTS, 1);
+	emit(p, BPF_LD | BPF_B | BPF_ABS, 0, 0, HCI_OFS_EXT_TYPE);
+	emit(p, BPF_JMP | BPF_JSET | BPF_K, 1, 0, EXT_ADV_LEGACY);
+	emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+
+	emit_known_addr(p, HCI_OFS_EXT_BDADDR);
+	emit_ad_walk(p, HCI_OFS_EXT_DATA);
+
+	set_ja(p, legacy, p->len);
+	emit_require(p, HCI_OFS_NUM_REPORTS, 1);
+
+	emit_known_addr(p, HCI_OFS_BDADDR);
+	emit_ad_walk(p, HCI_OFS_DATA);
+}
+
+static void build_socket(struct filter_prog *p)
+{
+	int v1, match, accept;
+
+	p->len = 0;
+
+	/* Format 1 carries the manufacturer ID at a fixed offset */
+	emit(p, BPF_LD | BPF_B | BPF_ABS, 0, 0, SOCK_OFS_VERSION);
+	v1 = emit(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	emit(p, BPF_LD | BPF_H | BPF_ABS, 0, 0, SOCK_OFS_V1_MFG_ID);
+	match = emit_mfg_match(p);
+	emit(p, BPF_RET | BPF_K, 0, 0, REJECT);
+	accept = emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+	set_mfg_match(p, match, accept);
+
+	/* Format 2 carries raw advertising data */
+	set_jf(p, v1, p->len);
+	emit(p, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 2);
+	emit(p, BPF_RET | BPF_K, 0, 0, ACCEPT);
+
+	emit_known_addr(p, SOCK_OFS_V2_BDADDR);
+	emit_ad_walk(p, SOCK_OFS_V2_DATA);
+}
+
+static int attach(struct filter_sock *fs)
+{
+	struct sock_fprog fprog;
+
+	switch (fs->type) {
+	case BLE_FILTER_HCI:
+		build_hci(&prog);
+		break;
+	case BLE_FILTER_SOCKET:
+		build_socket(&prog);
+		break;
+	}
+
+	fprog.len = prog.len;
+	fprog.filter = prog.insns;
+
+	/*
+	 * A replacement filter is charged against optmem_max before the old
+	 * one is released, so drop the old filter first.
+	 */
+	setsockopt(fs->sock, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0);
+
+	if (setsockopt(fs->sock, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &fprog, sizeof(fprog)) < 0) {
+		perror("SO_ATTACH_FILTER");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void load_tables(void)
+{
+	prog.num_mfg_ids = ble_get_mfg_ids(prog.mfg_ids, MAX_FILTER_MFG_IDS);
+	prog.num_addrs = ble_dbus_get_addrs(prog.addrs, NULL, MAX_FILTER_ADDRS);
+}
+
+int ble_filter_attach(int sock, enum ble_filter_type type)
+{
+	struct filter_sock *fs;
+
+	if (num_filter_socks >= MAX_FILTER_SOCKS)
+		return -1;
+
+	fs = &filter_socks[num_filter_socks];
+	fs->sock = sock;
+	fs->type = type;
+
+	load_tables();
+	if (attach(fs) < 0)
+		return -1;
+
+	num_filter_socks++;
+
+	return 0;
+}
+
+void ble_filter_detach(int sock)
+{
+	int i;
+
+	for (i = 0; i < num_filter_socks; i++) {
+		if (filter_socks[i].sock == sock) {
+			filter_socks[i] = filter_socks[--num_filter_socks];
+			return;
+		}
+	}
+}
+
+/* Called when the set of known devices changes */
+void ble_filter_update(void)
+{
+	filter_dirty = 1;
+}
+
+void ble_filter_tick(void)
+{
+	static uint32_t ticks = TICKS_PER_SEC;
+	int i;
+
+	if (--ticks)
+		return;
+
+	ticks = TICKS_PER_SEC;
+
+	if (!filter_dirty)
+		return;
+
+	filter_dirty = 0;
+	load_tables();
+
+	for (i = 0; i < num_filter_socks; i++)
+		attach(&filter_socks[i]);
+}
@@ -0,0 +1,14 @@
+#ifndef BLE_FILTER_H
+#define BLE_FILTER_H
+
+enum ble_filter_type {
+	BLE_FILTER_HCI,
+	BLE_FILTER_SOCKET,
+};
+
+int ble_filter_attach(int sock, enum ble_filter_type type);
+void ble_filter_detach(int sock);
+void ble_filter_update(void);
+void ble_filter_tick(void);
+
+#endif
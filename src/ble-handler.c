@@ -12,6 +12,11 @@ struct mfg_data_handler {
 	int (*handler)(const bdaddr_t *addr, const uint8_t *buf, int len, enum data_source source);
 };
 
+static struct ble_origin origin = {
+	.source = DATA_SOURCE_BLE,
+	.rssi	= BLE_RSSI_INVALID,
+};
+
 static const struct mfg_data_handler mfg_data_handlers[] = {
 	{ MFG_ID_GOBIUS,	gobius_handle_mfg },
 	{ MFG_ID_RUUVI,		ruuvi_handle_mfg },
@@ -21,16 +26,47 @@ static const struct mfg_data_handler mfg_data_handlers[] = {
 	{ MFG_ID_GARNET,	garnet_handle_mfg },
 };
 
+/*
+ * Set by the receive paths before handing over an advertisement, so the
+ * device can tell its sources apart without every decoder passing it.
+ */
+void ble_set_origin(enum data_source source, const bdaddr_t *gateway, int rssi,
+		    uint32_t age)
+{
+	origin.source = source;
+	bacpy(&origin.gateway, gateway);
+	origin.rssi = rssi;
+	origin.age = age;
+}
+
+const struct ble_origin *ble_get_origin(void)
+{
+	return &origin;
+}
+
+int ble_get_mfg_ids(uint16_t *ids, int max)
+{
+	int n = 0;
+	int i, j;
+
+	for (i = 0; i < array_size(mfg_data_handlers) && n < max; i++) {
+		for (j = 0; j < n; j++)
+			if (ids[j] == mfg_data_handlers[i].id)
+				break;
+
+		if (j == n)
+			ids[n++] = mfg_data_handlers[i].id;
+	}
+
+	return n;
+}
+
 void ble_handle_name(const bdaddr_t *bdaddr, const uint8_t *buf, int len)
 {
 	struct VeItem *droot;
 	char name[256];
-	char dev[16];
 
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x", bdaddr->b[5], bdaddr->b[4], bdaddr->b[3],
-		 bdaddr->b[2], bdaddr->b[1], bdaddr->b[0]);
-
-	droot = ble_dbus_get_dev(dev);
+	droot = ble_dbus_get_dev_addr(bdaddr, -1);
 	if (!droot)
 		return;
 
@@ -42,6 +78,7 @@ void ble_handle_name(const bdaddr_t *bdaddr, const uint8_t *buf, int len)
 	ble_dbus_set_name(droot, name, NAME_ORIG_BLE);
 }
 
+/* Returns 1 if one of the decoders took the data */
 int ble_handle_mfg(const bdaddr_t *bdaddr, uint16_t mfg, const uint8_t *buf, int len,
 		   enum data_source source)
 {
@@ -50,24 +87,33 @@ int ble_handle_mfg(const bdaddr_t *bdaddr, uint16_t mfg, const uint8_t *buf, int
 	for (i = 0; i < array_size(mfg_data_handlers); i++) {
 		if (mfg == mfg_data_handlers[i].id) {
 			if (!mfg_data_handlers[i].handler(bdaddr, buf, len, source))
-				break;
+				return 1;
 		}
 	}
 
 	return 0;
 }
 
+/*
+ * Returns the number of AD structures taken by a decoder, or -1 if the
+ * data was truncated.
+ */
 int ble_parse_adv(const bdaddr_t *bdaddr, const uint8_t *buf, int len)
 {
+	int matched = 0;
+
 	while (len >= 2) {
 		int adlen, adtyp;
 
 		adlen = *buf++;
 		len--;
 
-		if (!adlen || len < adlen)
+		if (!adlen)
 			break;
 
+		if (len < adlen)
+			return -1;
+
 		adtyp = *buf++;
 		adlen--;
 		len--;
@@ -79,10 +125,10 @@ int ble_parse_adv(const bdaddr_t *bdaddr, const uint8_t *buf, int len)
 
 		case 0xff:	/* Manufacturer Specific Data */
 			if (adlen > 2)
-				ble_handle_mfg(bdaddr,
+				matched += ble_handle_mfg(bdaddr,
 					bt_get_le16(buf),
 					buf + 2, adlen - 2,
-					DATA_SOURCE_BLE);
+					origin.source);
 			break;
 		}
 
@@ -90,5 +136,5 @@ int ble_parse_adv(const bdaddr_t *bdaddr, const uint8_t *buf, int len)
 		len -= adlen;
 	}
 
-	return 0;
+	return matched;
 }
\ No newline at end of file
@@ -17,10 +17,26 @@ enum data_source {
 	DATA_SOURCE_NONE,
 };
 
+/* RSSI meaning not available, as used by HCI and the gateway packets */
+#define BLE_RSSI_INVALID 127
+
+/* Where the advertisement being handled was received */
+struct ble_origin {
+	enum data_source source;
+	bdaddr_t gateway;	/* BDADDR_ANY if received locally */
+	int rssi;		/* dBm, or BLE_RSSI_INVALID */
+	uint32_t age;		/* ms from reception to forwarding */
+};
+
+void ble_set_origin(enum data_source source, const bdaddr_t *gateway, int rssi,
+		    uint32_t age);
+const struct ble_origin *ble_get_origin(void);
+
 int ble_handle_mfg(const bdaddr_t *bdaddr, uint16_t mfg_id, const uint8_t *data, int len,
 		   enum data_source source);
 void ble_handle_name(const bdaddr_t *bdaddr, const uint8_t *buf, int len);
 
 int ble_parse_adv(const bdaddr_t *bdaddr, const uint8_t *buf, int len);
+int ble_get_mfg_ids(uint16_t *ids, int max);
 
 #endif
@@ -0,0 +1,626 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/utils/ve_item_utils.h>
+
+#include "ble-dbus.h"
+#include "ble-ingest.h"
+#include "task.h"
+
+/*
+ * Sockets are drained on a thread of their own, so that a slow D-Bus
+ * peer stalling the main loop does not make the kernel drop reports.
+ * Raw messages are passed to the main loop through a single producer,
+ * single consumer ring and decoded there. An eventfd wakes the main
+ * loop up once per round of reads.
+ *
+ * Sources are added and removed from the main loop under ingest_lock,
+ * which the ingest thread holds while reading. Removing a source bumps
+ * its generation so messages already in the ring are skipped.
+ *
+ * Sources with backpressure are taken out of the epoll set while the
+ * ring is full. The main loop pokes ingest_resume once it made room.
+ */
+
+#define INGEST_RING_SIZE	256
+#define INGEST_MAX_SOURCES	32
+#define INGEST_MAX_EVENTS	16
+#define INGEST_READ_BATCH	32	/* per read call */
+#define INGEST_MAX_DRAIN	128	/* per source and wakeup */
+#define INGEST_BATCH_BUCKETS	6	/* 1, 2-3, .. 32 messages per recvmmsg */
+
+struct ingest_ring {
+	struct ingest_msg slots[INGEST_RING_SIZE];
+	atomic_uint head;	/* written by the ingest thread */
+	atomic_uint tail;	/* written by the main loop */
+	atomic_uint high;
+	atomic_uint overflows;
+	atomic_uint truncated;
+	atomic_uint batches[INGEST_BATCH_BUCKETS];
+	atomic_int throttled;
+};
+
+static struct ingest_ring ring;
+static struct ingest_msg ring_scratch;
+static pthread_mutex_t ingest_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ingest_thread;
+static int ingest_epoll = -1;
+static int ingest_wake = -1;
+static int ingest_resume = -1;
+static struct event *ingest_ev;
+static struct ingest_source *sources[INGEST_MAX_SOURCES];
+static int num_sources;
+static int batch_size = 64;
+static int batch_time = 10;
+
+/* Statistics items, created once and set on every publish */
+static struct VeItem *stat_depth;
+static struct VeItem *stat_high;
+static struct VeItem *stat_overflows;
+static struct VeItem *stat_truncated;
+static struct VeItem *stat_batches[INGEST_BATCH_BUCKETS];
+
+static struct VeSettingProperties batch_size_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 64,
+	.min.value.SN32 = 1,
+	.max.value.SN32 = INGEST_RING_SIZE,
+};
+
+static struct VeSettingProperties batch_time_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 10,
+	.min.value.SN32 = 1,
+	.max.value.SN32 = 1000,
+};
+
+static uint64_t ingest_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ingest_queued(unsigned int head, unsigned int tail)
+{
+	unsigned int depth = head - tail;
+
+	atomic_store_explicit(&ring.head, head, memory_order_release);
+
+	if (depth > atomic_load_explicit(&ring.high, memory_order_relaxed))
+		atomic_store_explicit(&ring.high, depth, memory_order_relaxed);
+}
+
+static void ingest_count_batch(int n)
+{
+	int bucket = 0;
+
+	while (n >>= 1)
+		bucket++;
+
+	if (bucket >= INGEST_BATCH_BUCKETS)
+		bucket = INGEST_BATCH_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(&ring.batches[bucket], 1, memory_order_relaxed);
+}
+
+/*
+ * Sources without a read() of their own are datagram sockets, received
+ * straight into free ring slots a batch at a time until the socket runs
+ * dry. Datagrams too large for a slot are dropped, and the ones after
+ * them moved up. Runs on the ingest thread, returns the number of
+ * messages read.
+ */
+static int ingest_drain_batch(struct ingest_source *src)
+{
+	struct mmsghdr hdrs[INGEST_READ_BATCH];
+	struct iovec iov[INGEST_READ_BATCH];
+	unsigned int head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	unsigned int tail;
+	unsigned int space;
+	struct ingest_msg *msg;
+	struct ingest_msg *from;
+	uint64_t now;
+	int total = 0;
+	int want;
+	int n;
+	int i;
+	int j;
+
+	while (total < INGEST_MAX_DRAIN) {
+		tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+		space = INGEST_RING_SIZE - (head - tail);
+		want = space && space < INGEST_READ_BATCH ? space : INGEST_READ_BATCH;
+
+		/* Keep draining the socket, dropping what does not fit */
+		for (i = 0; i < want; i++) {
+			msg = space ? &ring.slots[(head + i) % INGEST_RING_SIZE] :
+				      &ring_scratch;
+			iov[i].iov_base = msg->buf;
+			iov[i].iov_len	= sizeof(msg->buf);
+			memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+			hdrs[i].msg_hdr.msg_name    = &msg->addr;
+			hdrs[i].msg_hdr.msg_namelen = sizeof(msg->addr);
+			hdrs[i].msg_hdr.msg_iov	    = &iov[i];
+			hdrs[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		n = recvmmsg(src->fd, hdrs, want, MSG_DONTWAIT, NULL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (n < 0) {
+			if (!space)
+				break;
+			msg = &ring.slots[head % INGEST_RING_SIZE];
+			msg->src  = src;
+			msg->gen  = src->gen;
+			msg->time = ingest_now_us();
+			msg->len  = -errno;
+			msg->addrlen = 0;
+			ingest_queued(++head, tail);
+			total++;
+			break;
+		}
+
+		total += n;
+		ingest_count_batch(n);
+
+		if (!space) {
+			atomic_fetch_add_explicit(&ring.overflows, n,
+						  memory_order_relaxed);
+		} else {
+			now = ingest_now_us();
+			for (i = 0, j = 0; i < n; i++) {
+				if (hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					atomic_fetch_add_explicit(&ring.truncated, 1,
+								  memory_order_relaxed);
+					continue;
+				}
+
+				msg = &ring.slots[(head + j) % INGEST_RING_SIZE];
+				if (j != i) {
+					from = &ring.slots[(head + i) % INGEST_RING_SIZE];
+					memcpy(msg->buf, from->buf, hdrs[i].msg_len);
+					msg->addr = from->addr;
+				}
+
+				msg->src   = src;
+				msg->gen   = src->gen;
+				msg->time  = now;
+				msg->len   = hdrs[i].msg_len;
+				msg->addrlen = hdrs[i].msg_hdr.msg_namelen;
+				j++;
+			}
+			head += j;
+			ingest_queued(head, tail);
+		}
+
+		/* A short batch means the socket is empty */
+		if (n < want)
+			break;
+	}
+
+	return total;
+}
+
+/* Called with ingest_lock held */
+static void ingest_watch(struct ingest_source *src, uint32_t events)
+{
+	struct epoll_event ev = {
+		.events	  = events,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(ingest_epoll, EPOLL_CTL_MOD, src->fd, &ev) < 0)
+		perror("epoll_ctl");
+}
+
+static void ingest_throttle(struct ingest_source *src, unsigned int head)
+{
+	unsigned int tail;
+
+	ingest_watch(src, 0);
+	src->throttled = 1;
+	atomic_store_explicit(&ring.throttled, 1, memory_order_relaxed);
+
+	/* Pairs with the fence in on_ingest_ready(), see it made room */
+	atomic_thread_fence(memory_order_seq_cst);
+	tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+	if (head - tail < INGEST_RING_SIZE) {
+		ingest_watch(src, EPOLLIN | EPOLLRDHUP);
+		src->throttled = 0;
+	}
+}
+
+static void ingest_unthrottle(void)
+{
+	uint64_t val;
+	int i;
+
+	if (read(ingest_resume, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+
+	for (i = 0; i < num_sources; i++) {
+		if (!sources[i]->throttled)
+			continue;
+
+		sources[i]->throttled = 0;
+		if (sources[i]->active)
+			ingest_watch(sources[i], EPOLLIN | EPOLLRDHUP);
+	}
+}
+
+/* Runs on the ingest thread, returns the number of messages queued */
+static int ingest_drain(struct ingest_source *src, uint32_t revents)
+{
+	unsigned int head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	unsigned int start = head;
+	unsigned int tail;
+	struct ingest_msg *msg;
+	int full;
+	int len;
+	int n;
+
+	if (!src->read)
+		return ingest_drain_batch(src);
+
+	for (n = 0; n < INGEST_READ_BATCH; n++) {
+		tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+		full = head - tail >= INGEST_RING_SIZE;
+
+		if (full && src->backpressure) {
+			ingest_throttle(src, head);
+			break;
+		}
+
+		/* Keep draining the socket, dropping what does not fit */
+		msg = full ? &ring_scratch : &ring.slots[head % INGEST_RING_SIZE];
+
+		msg->addrlen = 0;
+		len = src->read(src, msg);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (len == 0 && !(revents & (EPOLLHUP | EPOLLRDHUP)))
+			break;
+
+		if (len > (int)sizeof(msg->buf)) {
+			atomic_fetch_add_explicit(&ring.truncated, 1,
+						  memory_order_relaxed);
+			continue;
+		}
+
+		/* The hangup or error must reach the owner, read it again later */
+		if (len <= 0 && full) {
+			ingest_throttle(src, head);
+			break;
+		}
+
+		if (len < 0)
+			len = -errno;
+
+		/*
+		 * Stop watching a closed or failed source, and tell its owner.
+		 * Level triggered, it would wake us up again until removed.
+		 */
+		if (len <= 0) {
+			epoll_ctl(ingest_epoll, EPOLL_CTL_DEL, src->fd, NULL);
+			src->active = 0;
+		}
+
+		if (full) {
+			atomic_fetch_add_explicit(&ring.overflows, 1,
+						  memory_order_relaxed);
+			continue;
+		}
+
+		msg->src  = src;
+		msg->gen  = src->gen;
+		msg->time = ingest_now_us();
+		msg->len  = len;
+
+		ingest_queued(++head, tail);
+
+		/* Errors are handled by the owner, which removes the source */
+		if (len <= 0)
+			break;
+	}
+
+	return head - start;
+}
+
+static void *ingest_main(void *arg)
+{
+	struct epoll_event events[INGEST_MAX_EVENTS];
+	uint64_t one = 1;
+	int queued;
+	int n;
+	int i;
+
+	for (;;) {
+		n = epoll_wait(ingest_epoll, events, INGEST_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+
+		queued = 0;
+
+		pthread_mutex_lock(&ingest_lock);
+		for (i = 0; i < n; i++) {
+			struct ingest_source *src = events[i].data.ptr;
+
+			if (!src)
+				ingest_unthrottle();
+			else if (src->active && !src->throttled)
+				queued += ingest_drain(src, events[i].events);
+		}
+		pthread_mutex_unlock(&ingest_lock);
+
+		if (queued &&
+		    write(ingest_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("eventfd write");
+	}
+}
+
+/*
+ * Handle up to batch_size messages, or as many as fit in batch_time ms,
+ * then return to the main loop so D-Bus traffic is not starved.
+ */
+static void on_ingest_ready(evutil_socket_t fd, short events, void *ctx)
+{
+	uint64_t deadline = ingest_now_us() + batch_time * 1000;
+	unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+	unsigned int head;
+	uint64_t one = 1;
+	uint64_t val;
+	int n;
+	int i;
+
+	if ((events & EV_READ) && read(fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		perror("eventfd read");
+
+	head = atomic_load_explicit(&ring.head, memory_order_acquire);
+
+	ble_dbus_batch_begin();
+
+	for (n = 0; n < batch_size && tail != head; n++) {
+		struct ingest_msg *msg = &ring.slots[tail % INGEST_RING_SIZE];
+		struct ingest_source *src = msg->src;
+
+		if (msg->gen == src->gen) {
+			src->pending = 1;
+			src->handle(src, msg);
+		}
+
+		atomic_store_explicit(&ring.tail, ++tail, memory_order_release);
+
+		if (ingest_now_us() >= deadline)
+			break;
+	}
+
+	for (i = 0; i < num_sources; i++) {
+		if (!sources[i]->pending)
+			continue;
+
+		sources[i]->pending = 0;
+		if (sources[i]->flush)
+			sources[i]->flush(sources[i]);
+	}
+
+	ble_dbus_batch_end();
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_exchange_explicit(&ring.throttled, 0, memory_order_relaxed) &&
+	    write(ingest_resume, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+
+	if (tail != atomic_load_explicit(&ring.head, memory_order_acquire))
+		event_active(ingest_ev, EV_TIMEOUT, 0);
+}
+
+int ble_ingest_add(struct ingest_source *src)
+{
+	struct epoll_event ev = {
+		.events	  = EPOLLIN | EPOLLRDHUP,
+		.data.ptr = src,
+	};
+	int err;
+
+	if (num_sources == INGEST_MAX_SOURCES) {
+		fprintf(stderr, "too many ingest sources\n");
+		return -1;
+	}
+
+	src->pending = 0;
+	src->throttled = 0;
+
+	pthread_mutex_lock(&ingest_lock);
+	err = epoll_ctl(ingest_epoll, EPOLL_CTL_ADD, src->fd, &ev);
+	src->active = !err;
+	if (!err)
+		sources[num_sources++] = src;
+	pthread_mutex_unlock(&ingest_lock);
+
+	if (err < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The socket may be closed once this returns */
+void ble_ingest_remove(struct ingest_source *src)
+{
+	int i;
+
+	pthread_mutex_lock(&ingest_lock);
+	if (src->active)
+		epoll_ctl(ingest_epoll, EPOLL_CTL_DEL, src->fd, NULL);
+	src->active = 0;
+	src->gen++;
+
+	for (i = 0; i < num_sources; i++) {
+		if (sources[i] == src) {
+			sources[i] = sources[--num_sources];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ingest_lock);
+
+	src->pending = 0;
+}
+
+/* Whether the main loop is falling behind and should shed load */
+int ble_ingest_overloaded(void)
+{
+	unsigned int head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+
+	return head - tail > INGEST_RING_SIZE / 2;
+}
+
+void ble_ingest_tick(void)
+{
+	static uint32_t ticks = 10 * TICKS_PER_SEC;
+	unsigned int head;
+	unsigned int tail;
+	int i;
+
+	if (--ticks)
+		return;
+
+	ticks = 10 * TICKS_PER_SEC;
+
+	head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+
+	ble_dbus_item_set_int(stat_depth, head - tail);
+	ble_dbus_item_set_int(stat_high,
+		atomic_load_explicit(&ring.high, memory_order_relaxed));
+	ble_dbus_item_set_int(stat_overflows,
+		atomic_load_explicit(&ring.overflows, memory_order_relaxed));
+	ble_dbus_item_set_int(stat_truncated,
+		atomic_load_explicit(&ring.truncated, memory_order_relaxed));
+
+	for (i = 0; i < INGEST_BATCH_BUCKETS; i++)
+		ble_dbus_item_set_int(stat_batches[i],
+			atomic_load_explicit(&ring.batches[i], memory_order_relaxed));
+}
+
+static void on_batch_size_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		batch_size = val.value.SN32;
+}
+
+static void on_batch_time_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		batch_time = val.value.SN32;
+}
+
+int ble_ingest_init(void)
+{
+	struct VeItem *settings = get_settings();
+	struct VeItem *ctl	= get_control();
+	struct VeItem *item;
+	char path[32];
+	sigset_t mask;
+	sigset_t old;
+	int err;
+	int i;
+
+	/* Kept under the Bluetooth prefix they were introduced with */
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/BatchSize",
+					     veVariantFmt, &veUnitNone, &batch_size_props);
+	veItemSetChanged(item, on_batch_size_changed);
+	on_batch_size_changed(item);
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/BatchTime",
+					     veVariantFmt, &veUnitNone, &batch_time_props);
+	veItemSetChanged(item, on_batch_time_changed);
+	on_batch_time_changed(item);
+
+	stat_depth = ble_dbus_create_int(ctl, "Ingest/Depth", 0);
+	stat_high = ble_dbus_create_int(ctl, "Ingest/HighWater", 0);
+	stat_overflows = ble_dbus_create_int(ctl, "Ingest/Overflows", 0);
+	stat_truncated = ble_dbus_create_int(ctl, "Ingest/Truncated", 0);
+
+	for (i = 0; i < INGEST_BATCH_BUCKETS; i++) {
+		snprintf(path, sizeof(path), "Ingest/RecvBatch/%d", 1 << i);
+		stat_batches[i] = ble_dbus_create_int(ctl, path, 0);
+	}
+
+	ingest_epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (ingest_epoll < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	ingest_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ingest_resume = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ingest_wake < 0 || ingest_resume < 0) {
+		perror("eventfd");
+		return -1;
+	}
+
+	/* A NULL source marks the resume eventfd */
+	if (epoll_ctl(ingest_epoll, EPOLL_CTL_ADD, ingest_resume,
+		      &(struct epoll_event){ .events = EPOLLIN }) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	ingest_ev = event_new(pltGetLibEventBase(), ingest_wake,
+			      EV_READ | EV_PERSIST, on_ingest_ready, NULL);
+	if (!ingest_ev || event_add(ingest_ev, NULL) < 0) {
+		perror("event_new");
+		return -1;
+	}
+
+	/* Signals are for the main loop */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	err = pthread_create(&ingest_thread, NULL, ingest_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef BLE_INGEST_H
+#define BLE_INGEST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Large enough for any HCI event, or a gateway packet in one frame */
+#define INGEST_MSG_SIZE		1472
+
+struct ingest_source;
+
+struct ingest_msg {
+	struct ingest_source *src;
+	uint32_t gen;
+	uint64_t time;		/* receive time, us since boot */
+	struct sockaddr_storage addr;	/* sender, if addrlen is set */
+	socklen_t addrlen;
+	int len;		/* -errno if reading failed, 0 on hangup */
+	uint8_t buf[INGEST_MSG_SIZE];
+};
+
+/*
+ * read() runs on the ingest thread and must not touch anything but the
+ * socket and the message. It returns like recv(), the source is no
+ * longer read after an error or hangup. A length larger than the buffer,
+ * as recv() with MSG_TRUNC reports, drops the message. Without a read(),
+ * the socket is drained with recvmmsg() in batches. handle() runs on
+ * the main loop for each message, and flush(), if set, once a drained
+ * batch contained any of its messages.
+ *
+ * Sources with backpressure set are not read while the ring is full,
+ * leaving the messages to block the sender, rather than dropped.
+ */
+struct ingest_source {
+	int fd;
+	int (*read)(struct ingest_source *src, struct ingest_msg *msg);
+	void (*handle)(struct ingest_source *src, const struct ingest_msg *msg);
+	void (*flush)(struct ingest_source *src);
+	void *ctx;
+	int backpressure;
+
+	/* Private to ble-ingest.c */
+	uint32_t gen;
+	int active;
+	int throttled;
+	int pending;
+};
+
+int ble_ingest_init(void);
+int ble_ingest_add(struct ingest_source *src);
+void ble_ingest_remove(struct ingest_source *src);
+int ble_ingest_overloaded(void);
+void ble_ingest_tick(void);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+#include <velib/types/types.h>
+#include <velib/types/variant.h>
+
+#include "ble-dbus.h"
+#include "ble-regs.h"
+
+static int type_size(VeDataBasicType t)
+{
+	return (t + 1) / 2;
+}
+
+static int type_isint(VeDataBasicType t)
+{
+	if (t < VE_UN8)
+		return 0;
+	if (t <= VE_SN32)
+		return 1;
+	return 0;
+}
+
+static int type_issigned(VeDataBasicType t)
+{
+	return !(t & 1);
+}
+
+/*
+ * Register tables are compiled the first time a device uses them. Each
+ * register gets a load function for its size and byte order, a mask
+ * and a conversion, so a payload is decoded without interpreting the
+ * reg_info fields again. A table also records the payload length
+ * covering all its registers, above which no register needs a bounds
+ * check.
+ */
+typedef uint64_t reg_load_fn(const uint8_t *buf, int size);
+
+enum reg_conv {
+	REG_CONV_NONE,		/* not an integer, never valid */
+	REG_CONV_WARN,
+	REG_CONV_XLATE,
+	REG_CONV_FLOAT,
+	REG_CONV_SFLOAT,
+	REG_CONV_INT,
+	REG_CONV_UINT,
+};
+
+struct reg_op {
+	const struct reg_info	*reg;
+	reg_load_fn		*load;
+	uint64_t		mask;
+	uint16_t		offset;
+	uint16_t		end;		/* payload length needed */
+	uint8_t			size;
+	uint8_t			shift;
+	uint8_t			sext;		/* 64 - bits */
+	uint8_t			conv;
+	uint8_t			check_inval;
+};
+
+struct reg_table {
+	struct reg_table	*next;
+	const struct reg_info	*regs;
+	int			num_regs;
+	int			min_len;
+	struct reg_op		ops[];
+};
+
+static struct reg_table *reg_tables;
+
+static uint64_t load_u8(const uint8_t *buf, int size)
+{
+	return buf[0];
+}
+
+static uint64_t load_le16(const uint8_t *buf, int size)
+{
+	uint16_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return le16toh(v);
+}
+
+static uint64_t load_be16(const uint8_t *buf, int size)
+{
+	uint16_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return be16toh(v);
+}
+
+static uint64_t load_le24(const uint8_t *buf, int size)
+{
+	return load_le16(buf, 2) | (uint32_t)buf[2] << 16;
+}
+
+static uint64_t load_be24(const uint8_t *buf, int size)
+{
+	return load_be16(buf, 2) << 8 | buf[2];
+}
+
+static uint64_t load_le32(const uint8_t *buf, int size)
+{
+	uint32_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return le32toh(v);
+}
+
+static uint64_t load_be32(const uint8_t *buf, int size)
+{
+	uint32_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return be32toh(v);
+}
+
+static uint64_t load_le(const uint8_t *buf, int size)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		v |= (uint64_t)buf[i] << (8 * i);
+
+	return v;
+}
+
+static uint64_t load_be(const uint8_t *buf, int size)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < size; i++)
+		v = v << 8 | buf[i];
+
+	return v;
+}
+
+static reg_load_fn *const reg_loads[2][5] = {
+	{ load_le, load_u8, load_le16, load_le24, load_le32 },
+	{ load_be, load_u8, load_be16, load_be24, load_be32 },
+};
+
+static void compile_reg(struct reg_op *op, const struct reg_info *reg)
+{
+	VeDataBasicType type = reg->type;
+	int bits = reg->bits;
+	int be;
+
+	op->reg = reg;
+
+	if (!type_isint(type)) {
+		op->conv = REG_CONV_NONE;
+		return;
+	}
+
+	if (!bits)
+		bits = 8 * type_size(type);
+
+	be = !!(reg->flags & REG_FLAG_BIG_ENDIAN);
+
+	op->size = (bits + reg->shift + 7) >> 3;
+	op->load = reg_loads[be][op->size <= 4 ? op->size : 0];
+	op->offset = reg->offset;
+	op->end = reg->offset + op->size;
+	op->shift = reg->shift;
+	op->sext = 64 - bits;
+	op->mask = bits < 64 ? (1ull << bits) - 1 : ~0ull;
+	op->check_inval = !!(reg->flags & REG_FLAG_INVALID);
+
+	if (reg->flags & REG_FLAG_WARN_ALARM)
+		op->conv = REG_CONV_WARN;
+	else if (reg->xlate)
+		op->conv = REG_CONV_XLATE;
+	else if (reg->scale)
+		op->conv = type_issigned(type) ? REG_CONV_SFLOAT : REG_CONV_FLOAT;
+	else
+		op->conv = type_issigned(type) ? REG_CONV_INT : REG_CONV_UINT;
+}
+
+/* The compiled table of @regs, compiled now if no device used it yet */
+const struct reg_table *ble_regs_compile(const struct reg_info *regs,
+					 int num_regs)
+{
+	struct reg_table *t;
+	int i;
+
+	for (t = reg_tables; t; t = t->next)
+		if (t->regs == regs && t->num_regs == num_regs)
+			return t;
+
+	if (num_regs > REG_CTX_MAX) {
+		fprintf(stderr, "too many registers: %d\n", num_regs);
+		return NULL;
+	}
+
+	t = calloc(1, sizeof(*t) + num_regs * sizeof(t->ops[0]));
+	if (!t)
+		return NULL;
+
+	t->regs = regs;
+	t->num_regs = num_regs;
+
+	for (i = 0; i < num_regs; i++) {
+		compile_reg(&t->ops[i], &regs[i]);
+		if (t->ops[i].end > t->min_len)
+			t->min_len = t->ops[i].end;
+	}
+
+	t->next = reg_tables;
+	reg_tables = t;
+
+	return t;
+}
+
+static int64_t sext(uint64_t v, int s)
+{
+	return (int64_t)(v << s) >> s;
+}
+
+/* Extracts the raw values of all registers of @ctx->table from a packet */
+void ble_regs_extract(struct reg_ctx *ctx, const uint8_t *buf, int len)
+{
+	const struct reg_table *t = ctx->table;
+	int check_len = len < t->min_len;
+	int i;
+
+	ctx->valid = 0;
+
+	for (i = 0; i < t->num_regs; i++) {
+		const struct reg_op *op = &t->ops[i];
+
+		if (op->conv == REG_CONV_NONE || (check_len && len < op->end))
+			continue;
+
+		ctx->raw[i] = (op->load(buf + op->offset, op->size) >> op->shift) & op->mask;
+		ctx->valid |= 1ull << i;
+	}
+}
+
+/* Converts register @i of the packet extracted into @ctx */
+int ble_regs_decode(const struct reg_ctx *ctx, int i, VeVariant *val)
+{
+	const struct reg_op *op = &ctx->table->ops[i];
+	const struct reg_info *reg = op->reg;
+	uint64_t v = ctx->raw[i];
+
+	if (!(ctx->valid & 1ull << i))
+		return -1;
+
+	if (op->check_inval && op->conv != REG_CONV_WARN && v == reg->inval)
+		return -1;
+
+	switch (op->conv) {
+	case REG_CONV_WARN:
+		if (v == 0)
+			return -1;
+		veVariantSn32(val, (int)v - 1);
+		break;
+	case REG_CONV_XLATE:
+		return reg->xlate(ctx, val, v);
+	case REG_CONV_FLOAT:
+		veVariantFloat(val, (float)v / reg->scale + reg->bias);
+		break;
+	case REG_CONV_SFLOAT:
+		veVariantFloat(val, (float)sext(v, op->sext) / reg->scale + reg->bias);
+		break;
+	case REG_CONV_INT:
+		veVariantSn32(val, sext(v, op->sext));
+		break;
+	default:
+		veVariantUn32(val, v);
+		break;
+	}
+
+	return 0;
+}
+
+/* The device whose packet is being decoded */
+struct VeItem *ble_dbus_reg_root(const struct reg_ctx *ctx)
+{
+	return ctx->root;
+}
+
+/*
+ * Raw value of register @reg, an index into the register table, in the
+ * packet being decoded. Fails if the packet is too short to hold it.
+ */
+int ble_dbus_reg_raw(const struct reg_ctx *ctx, int reg, uint64_t *raw)
+{
+	if (reg < 0 || reg >= ctx->table->num_regs || !(ctx->valid & 1ull << reg))
+		return -1;
+
+	*raw = ctx->raw[reg];
+
+	return 0;
+}
+
+/*
+ * Value of register @reg as it is published. Registers translated by a
+ * callback themselves are not available, so callbacks cannot recurse.
+ */
+int ble_dbus_reg_value(const struct reg_ctx *ctx, int reg, VeVariant *val)
+{
+	if (reg < 0 || reg >= ctx->table->num_regs ||
+	    ctx->table->ops[reg].conv == REG_CONV_XLATE)
+		return -1;
+
+	return ble_regs_decode(ctx, reg, val);
+}
+
@@ -0,0 +1,32 @@
+#ifndef BLE_REGS_H
+#define BLE_REGS_H
+
+#include <stdint.h>
+
+#include <velib/types/variant.h>
+
+#include "ble-dbus.h"
+
+/* Registers of a device, limited by the valid mask of struct reg_ctx */
+#define REG_CTX_MAX	64
+
+struct reg_table;
+
+/*
+ * The packet being decoded. All raw register values are extracted
+ * before any is converted, so xlate callbacks can use the other
+ * registers of the same packet, in whatever order they are listed.
+ */
+struct reg_ctx {
+	struct VeItem		*root;
+	const struct reg_table	*table;
+	uint64_t		valid;		/* bit per register */
+	uint64_t		raw[REG_CTX_MAX];
+};
+
+const struct reg_table *ble_regs_compile(const struct reg_info *regs,
+					 int num_regs);
+void ble_regs_extract(struct reg_ctx *ctx, const uint8_t *buf, int len);
+int ble_regs_decode(const struct reg_ctx *ctx, int reg, VeVariant *val);
+
+#endif
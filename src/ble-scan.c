@@ -4,8 +4,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
@@ -16,6 +19,8 @@
 #include <velib/utils/ve_todo.h>
 
 #include "ble-dbus.h"
+#include "ble-filter.h"
+#include "ble-ingest.h"
 #include "ble-scan.h"
 #include "ble-handler.h"
 #include "task.h"
@@ -23,6 +28,36 @@
 #define SCAN_INTERVAL	90
 #define SCAN_WINDOW	15
 
+/*
+ * In accept list mode the controllers only report advertisers in their
+ * Filter Accept List, interrupted by regular open discovery windows so
+ * that new sensors can still be found and address types learned.
+ */
+#define ACCEPT_LIST_MAX		128
+#define ACCEPT_LIST_TIME	(120 * TICKS_PER_SEC)
+#define DISCOVERY_TIME		(15 * TICKS_PER_SEC)
+
+/*
+ * The scan scheduler sizes the duty cycle of each adapter so that every
+ * enabled sensor in range is heard within the target latency.
+ */
+#define SCHED_IDLE_DUTY		64	/* 1/n duty with no sensor in range */
+#define SCHED_IN_RANGE		60000	/* ms */
+#define SCHED_MIN_INTERVAL	20	/* ms, shorter gaps are repeats */
+#define SCHED_DEFAULT_INTERVAL	1000	/* ms, until measured */
+#define SCHED_MAX_INTERVAL	60000	/* ms */
+#define SCHED_MAX_BOOST		8.0f
+#define SCHED_MIN_SAMPLES	20
+#define SCHED_MAX_SEQ_GAP	16
+
+/*
+ * With several adapters, copies of one advertisement are decoded once.
+ * Advertisers hash into a fixed table; a collision just forgets the
+ * older advertiser.
+ */
+#define DEDUP_SIZE		256
+#define DEDUP_WINDOW		1000	/* ms */
+
 struct mgmt_hdr {
 	uint16_t opcode;
 	uint16_t index;
@@ -30,29 +65,403 @@ struct mgmt_hdr {
 } __attribute__ ((packed));
 
 #define MGMT_HDR_SIZE			6
+#define MGMT_EV_CMD_COMPLETE		0x0001
+#define MGMT_EV_CMD_STATUS		0x0002
 #define MGMT_EV_INDEX_ADDED		0x0004
 #define MGMT_EV_INDEX_REMOVED		0x0005
 #define MGMT_EV_UNCONF_INDEX_ADDED	0x001d
 #define MGMT_EV_UNCONF_INDEX_REMOVED	0x001e
 #define MGMT_EV_EXT_INDEX_ADDED		0x0020
 #define MGMT_EV_EXT_INDEX_REMOVED	0x0021
+#define MGMT_EV_DEVICE_FOUND		0x0012
+#define MGMT_EV_ADV_MONITOR_DEVICE_FOUND 0x002f
+#define MGMT_OP_ADD_ADV_PATTERNS_MONITOR 0x0052
+#define MGMT_OP_REMOVE_ADV_MONITOR	0x0053
+
+#define MGMT_ADV_PATTERN_SIZE		31
+#define MGMT_MAX_PATTERNS		16
+
+struct mgmt_ev_cmd_complete {
+	uint16_t opcode;
+	uint8_t status;
+	uint8_t data[];
+} __attribute__ ((packed));
+
+struct mgmt_adv_pattern {
+	uint8_t ad_type;
+	uint8_t offset;
+	uint8_t length;
+	uint8_t value[MGMT_ADV_PATTERN_SIZE];
+} __attribute__ ((packed));
+
+struct mgmt_cp_add_adv_patterns_monitor {
+	uint8_t pattern_count;
+	struct mgmt_adv_pattern patterns[MGMT_MAX_PATTERNS];
+} __attribute__ ((packed));
+
+struct mgmt_ev_device_found {
+	bdaddr_t bdaddr;
+	uint8_t addr_type;
+	int8_t rssi;
+	uint32_t flags;
+	uint16_t eir_len;
+	uint8_t eir[];
+} __attribute__ ((packed));
 
 #define NAME_SIZE sizeof(((struct hci_dev_info *)0)->name)
 
+/* LE extended scanning, not covered by libbluetooth */
+#define OCF_LE_SET_EXT_SCAN_PARAMETERS	0x0041
+#define OCF_LE_SET_EXT_SCAN_ENABLE	0x0042
+#define EVT_LE_EXT_ADVERTISING_REPORT	0x0D
+#define EVT_LE_PA_SYNC_ESTABLISHED	0x0E
+#define EVT_LE_PA_REPORT		0x0F
+#define EVT_LE_PA_SYNC_LOST		0x10
+#define OCF_LE_PA_CREATE_SYNC		0x0044
+#define OCF_LE_PA_CREATE_SYNC_CANCEL	0x0045
+#define OCF_LE_PA_TERMINATE_SYNC	0x0046
+
+#define LE_FEATURE_CODED_PHY	(1 << 3)	/* features[1] */
+#define LE_FEATURE_EXT_ADV	(1 << 4)	/* features[1] */
+
+#define LE_SCAN_PHY_1M		0x01
+#define LE_SCAN_PHY_CODED	0x04
+
+#define EXT_ADV_STATUS(type)	(((type) >> 5) & 3)
+#define EXT_ADV_COMPLETE	0
+#define EXT_ADV_MORE		1
+#define EXT_ADV_ADDR_ANONYMOUS	0xff
+#define HCI_RSSI_UNAVAILABLE	127
+#define EXT_ADV_MAX_DATA	1650
+
+/* Fragmented extended advertisements being reassembled, shared by all adapters */
+#define EXT_REASM_SLOTS		8
+
+/*
+ * Periodic advertising trains of enabled sensors are followed through
+ * sync sessions, one create at a time per adapter.
+ *
+ * The kernel only unmasks the sync events on controllers it uses for
+ * broadcast audio, and even then not Sync Lost. Without the events a
+ * create seems to time out while the controller is synced, which shows
+ * as the cancel being refused, so syncing is given up on that adapter.
+ * Syncs gone quiet for longer than their timeout count as lost.
+ */
+#define PA_SYNC_MAX		8
+#define PA_SYNC_CREATE_TIMEOUT	10000	/* ms */
+#define PA_SID_PERIODIC		0x80	/* keeps train reassembly apart */
+
+struct le_ext_scan_phy {
+	uint8_t type;
+	uint16_t interval;
+	uint16_t window;
+} __attribute__ ((packed));
+
+struct le_set_ext_scan_parameters_cp {
+	uint8_t own_bdaddr_type;
+	uint8_t filter;
+	uint8_t phys;
+	struct le_ext_scan_phy phy[2];
+} __attribute__ ((packed));
+
+struct le_set_ext_scan_enable_cp {
+	uint8_t enable;
+	uint8_t filter_dup;
+	uint16_t duration;
+	uint16_t period;
+} __attribute__ ((packed));
+
+struct le_pa_create_sync_cp {
+	uint8_t options;
+	uint8_t sid;
+	uint8_t bdaddr_type;
+	bdaddr_t bdaddr;
+	uint16_t skip;
+	uint16_t timeout;
+	uint8_t cte_type;
+} __attribute__ ((packed));
+
+struct le_pa_sync_established {
+	uint8_t status;
+	uint16_t handle;
+	uint8_t sid;
+	uint8_t bdaddr_type;
+	bdaddr_t bdaddr;
+	uint8_t phy;
+	uint16_t interval;
+	uint8_t clock_accuracy;
+} __attribute__ ((packed));
+
+struct le_pa_report {
+	uint16_t handle;
+	int8_t tx_power;
+	int8_t rssi;
+	uint8_t cte_type;
+	uint8_t status;
+	uint8_t length;
+	uint8_t data[];
+} __attribute__ ((packed));
+
+enum pa_sync_state {
+	PA_SYNC_NONE,
+	PA_SYNC_CREATING,
+	PA_SYNC_SYNCED,
+};
+
+struct pa_sync {
+	enum pa_sync_state state;
+	bdaddr_t addr;
+	uint8_t addr_type;
+	uint8_t sid;
+	uint16_t handle;
+	uint32_t timeout_ms;
+	uint64_t report_ms;
+};
+
+struct le_ext_advertising_info {
+	uint16_t evt_type;
+	uint8_t bdaddr_type;
+	bdaddr_t bdaddr;
+	uint8_t primary_phy;
+	uint8_t secondary_phy;
+	uint8_t sid;
+	int8_t tx_power;
+	int8_t rssi;
+	uint16_t interval;
+	uint8_t direct_bdaddr_type;
+	bdaddr_t direct_bdaddr;
+	uint8_t length;
+	uint8_t data[];
+} __attribute__ ((packed));
+
+/*
+ * An adapter that stays silent for this many of its average report
+ * gaps gets its scan restarted. Silence alone proves little, filtering
+ * and sensors out of range cause it too, so further steps wait twice
+ * as long as the previous one. A controller that stops answering
+ * commands is power cycled without waiting for a stall.
+ */
+#define WATCHDOG_GAPS		20
+#define WATCHDOG_CMD_TIMEOUTS	3
+#define WATCHDOG_MIN_STALL	30000	/* ms */
+#define WATCHDOG_MAX_STALL	600000	/* ms */
+#define WATCHDOG_STEP		30000	/* ms before the first escalation */
+#define WATCHDOG_MAX_BACKOFF	3600000	/* ms */
+#define WATCHDOG_WEIGHT		0.25f
+
+enum hci_health {
+	HEALTH_OK,
+	HEALTH_RESTARTED,
+	HEALTH_RESET,
+	HEALTH_REOPENED,
+};
+
+/* Statistics published below Interfaces/<name>, created once per adapter */
+enum hci_stat {
+	STAT_EVENT_RATE,
+	STAT_REPORT_RATE,
+	STAT_RSSI,
+	STAT_ADV_EVENTS,
+	STAT_ADV_REPORTS,
+	STAT_ADV_MATCHED,
+	STAT_ADV_ERRORS,
+	STAT_KERNEL_DROPS,
+	STAT_ADV_DUPS,
+	STAT_HEALTH,
+	STAT_RESTARTS,
+	STAT_RESETS,
+	STAT_REOPENS,
+	/* Only for directly scanning adapters */
+	STAT_SCAN_INTERVAL,
+	STAT_SCAN_WINDOW,
+	STAT_SCAN_CODED,
+	STAT_NUM
+};
+
+struct hci_stat_info {
+	const char *path;
+	VeDataBasicType type;
+	const void *format;
+};
+
+static const struct hci_stat_info hci_stats[STAT_NUM] = {
+	[STAT_EVENT_RATE]	= { "EventRate",	VE_FLOAT, &veUnitPerSec },
+	[STAT_REPORT_RATE]	= { "ReportRate",	VE_FLOAT, &veUnitPerSec },
+	[STAT_RSSI]		= { "Rssi",		VE_FLOAT, &veUnitdBm },
+	[STAT_ADV_EVENTS]	= { "AdvEvents",	VE_SN32,  &veUnitNone },
+	[STAT_ADV_REPORTS]	= { "AdvReports",	VE_SN32,  &veUnitNone },
+	[STAT_ADV_MATCHED]	= { "AdvMatched",	VE_SN32,  &veUnitNone },
+	[STAT_ADV_ERRORS]	= { "AdvErrors",	VE_SN32,  &veUnitNone },
+	[STAT_KERNEL_DROPS]	= { "KernelDrops",	VE_SN32,  &veUnitNone },
+	[STAT_ADV_DUPS]		= { "AdvDuplicates",	VE_SN32,  &veUnitNone },
+	[STAT_HEALTH]		= { "Health",		VE_SN32,  &veUnitNone },
+	[STAT_RESTARTS]		= { "Restarts",		VE_SN32,  &veUnitNone },
+	[STAT_RESETS]		= { "Resets",		VE_SN32,  &veUnitNone },
+	[STAT_REOPENS]		= { "Reopens",		VE_SN32,  &veUnitNone },
+	[STAT_SCAN_INTERVAL]	= { "ScanInterval",	VE_FLOAT, &veUnitms },
+	[STAT_SCAN_WINDOW]	= { "ScanWindow",	VE_FLOAT, &veUnitms },
+	[STAT_SCAN_CODED]	= { "ScanCoded",	VE_SN32,  &veUnitNone },
+};
+
+/* HCI commands are queued per adapter and sent one at a time */
+#define HCI_CMD_QUEUE_SIZE	32
+#define HCI_CMD_MAX_PARAM	16
+#define HCI_CMD_TIMEOUT		1000	/* ms */
+
+/* Timed out commands whose late reply is still expected */
+#define HCI_CMD_LATE_MAX	4
+#define HCI_CMD_LATE_EXPIRE	(5 * HCI_CMD_TIMEOUT)
+
+struct hci_device;
+
+typedef void (*hci_cmd_done_fn)(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len);
+
+struct hci_cmd {
+	uint16_t opcode;
+	uint8_t plen;
+	uint8_t param[HCI_CMD_MAX_PARAM];
+	hci_cmd_done_fn done;
+};
+
+struct hci_late_cmd {
+	uint16_t opcode;
+	uint64_t ms;
+};
+
 struct hci_device {
 	uint16_t dev_id;
 	int sock;
 	int addr_type;
 	char name[NAME_SIZE];
-	struct event *ev;
+	struct ingest_source src;
+	uint32_t adv_events;
+	uint32_t adv_reports;
+	uint32_t adv_errors;
+	uint32_t kernel_drops;
+	int accept_ok;
+	int accept_size;
+	int accept_used;
+	int monitor;
+	uint16_t monitor_handle;
+	int scan_interval;
+	int ext_scan;
+	int coded_phy;
+	struct pa_sync syncs[PA_SYNC_MAX];
+	struct pa_sync *sync_creating;
+	uint64_t sync_create_ms;
+	int pa_events;
+	int pa_masked;
+	int stagger_rank;
+	int stagger_count;
+	struct event *stagger_timer;
+	uint32_t adv_dups;
+	uint32_t adv_matched;
+	int32_t rssi_sum;
+	uint32_t rssi_count;
+	uint32_t stat_events;
+	uint32_t stat_reports;
+	uint64_t stat_ms;
+	uint32_t last_reports;
+	uint64_t last_report_ms;
+	float report_rate;
+	enum hci_health health;
+	uint64_t health_ms;
+	uint64_t backoff_ms;
+	uint32_t restarts;
+	uint32_t resets;
+	uint32_t reopens;
+	struct VeItem *stats[STAT_NUM];
+	uint32_t cmd_timeouts;
+	struct hci_cmd cmds[HCI_CMD_QUEUE_SIZE];
+	unsigned int cmd_head;
+	unsigned int cmd_tail;
+	int cmd_busy;
+	struct event *cmd_timer;
+	struct hci_late_cmd cmd_late[HCI_CMD_LATE_MAX];
+	int cmd_num_late;
+};
+
+/* An enabled advertiser, and what the scheduler knows about it */
+struct accept_entry {
+	bdaddr_t addr;
+	int type;
+	int refs;
+	uint64_t last_ms;
+	uint32_t adv_interval;
+	uint64_t seen_ms[HCI_MAX_DEV];
+};
+
+struct dedup_entry {
+	bdaddr_t addr;
+	uint32_t hash;
+	uint64_t time;
+	struct hci_device *dev;
+	int pending;
+	int8_t rssi;
+	uint8_t len;
+	uint8_t data[UINT8_MAX];
+};
+
+struct ext_reasm {
+	struct hci_device *dev;
+	bdaddr_t addr;
+	uint8_t addr_type;
+	uint8_t sid;
+	int active;
+	int len;
+	uint8_t data[EXT_ADV_MAX_DATA];
 };
 
 static struct hci_device devices[HCI_MAX_DEV];
 static int cont_scan;
 static int ble_scan_enabled = 1;
+static uint64_t rx_ms;
 static int hci_ctl_sock = -1;
+static struct accept_entry accept_list[ACCEPT_LIST_MAX];
+static int accept_len;
+static int accept_unknown;
+static int accept_dropped;
+static int accept_mode;
+static int adv_monitor;
+static int accept_discovery = 1;
+static uint32_t accept_ticks = DISCOVERY_TIME;
+static int target_latency;
+static float sched_boost = 1.0f;
+static uint32_t seq_updates;
+static uint32_t seq_missed;
+static int scan_devs;
+static int refresh_pending;
+static int coded_phy;
+static int periodic_sync;
+static struct ext_reasm ext_reasm[EXT_REASM_SLOTS];
+static unsigned int ext_reasm_next;
+static struct dedup_entry dedup[DEDUP_SIZE];
+static struct dedup_entry *dedup_pending[DEDUP_SIZE];
+static int dedup_num_pending;
 static struct event *hci_ctl_ev = NULL;
 
+static struct VeSettingProperties target_latency_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 600,
+};
+
+static struct VeSettingProperties coded_phy_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 1,
+};
+
+static struct VeSettingProperties periodic_sync_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 1,
+};
+
 static struct VeSettingProperties ble_enabled_props = {
 	.type		= VE_SN32,
 	.def.value.SN32 = 1,
@@ -67,150 +476,1579 @@ static struct VeSettingProperties continuous_scan_props = {
 	.max.value.SN32 = 1,
 };
 
-static int ble_scan_setup(struct hci_device *dev, int addr_type)
+static struct VeSettingProperties accept_list_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 1,
+};
+
+static struct VeSettingProperties adv_monitor_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 0,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 1,
+};
+
+static uint64_t ble_scan_now_us(void)
 {
-	int interval = cont_scan ? SCAN_WINDOW : SCAN_INTERVAL;
-	int err;
+	struct timespec ts;
 
-	if (dev->sock < 0)
-		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	hci_le_set_scan_enable(dev->sock, 0, 1, 1000);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	err = hci_le_set_scan_parameters(dev->sock, 0,
-					 htobs(interval), htobs(SCAN_WINDOW),
-					 addr_type, 0, 1000);
-	if (err < 0)
-		return -2;
+static uint64_t ble_scan_now_ms(void)
+{
+	return ble_scan_now_us() / 1000;
+}
 
-	err = hci_le_set_scan_enable(dev->sock, 1, 0, 1000);
-	if (err < 0)
-		return -1;
+static int ble_scan_filter_policy(struct hci_device *dev)
+{
+	return accept_mode && !accept_discovery && !accept_dropped &&
+		dev->accept_ok;
+}
 
-	dev->addr_type = addr_type;
+static int ble_scan_cmd_write(int sock, uint16_t opcode,
+			      const void *param, uint8_t plen)
+{
+	uint8_t buf[1 + HCI_COMMAND_HDR_SIZE + HCI_CMD_MAX_PARAM];
+	hci_command_hdr *hdr = (hci_command_hdr *)(buf + 1);
 
-	return 0;
+	buf[0]      = HCI_COMMAND_PKT;
+	hdr->opcode = htobs(opcode);
+	hdr->plen   = plen;
+	if (plen)
+		memcpy(buf + 1 + HCI_COMMAND_HDR_SIZE, param, plen);
+
+	return write(sock, buf, 1 + HCI_COMMAND_HDR_SIZE + plen);
 }
 
-static int ble_scan_parse_adv(const le_advertising_info *adv)
+static void ble_scan_cmd_next(struct hci_device *dev);
+
+static void ble_scan_cmd_done(struct hci_device *dev, uint8_t status,
+			      const uint8_t *rp, int len)
 {
-	if (!ble_scan_enabled)
-		return 0;
+	struct hci_cmd cmd = dev->cmds[dev->cmd_tail++ % HCI_CMD_QUEUE_SIZE];
 
-	ble_parse_adv(&adv->bdaddr, adv->data, adv->length);
+	dev->cmd_busy = 0;
+	evtimer_del(dev->cmd_timer);
 
-	return 0;
+	if (cmd.done)
+		cmd.done(dev, status, rp, len);
+
+	ble_scan_cmd_next(dev);
 }
 
-static void ble_scan_close_dev(struct hci_device *dev)
+static void ble_scan_cmd_next(struct hci_device *dev)
 {
-	int flags;
+	struct timeval tv = {
+		.tv_sec  = HCI_CMD_TIMEOUT / 1000,
+		.tv_usec = HCI_CMD_TIMEOUT % 1000 * 1000,
+	};
+	struct hci_cmd *cmd;
 
-	if (dev->dev_id == HCI_DEV_NONE)
+	if (dev->sock < 0 || dev->cmd_busy || dev->cmd_tail == dev->cmd_head)
 		return;
 
-	fprintf(stderr, "closing hci%d (%s)\n", dev->dev_id, dev->name);
+	cmd = &dev->cmds[dev->cmd_tail % HCI_CMD_QUEUE_SIZE];
 
-	if (dev->ev != NULL) {
-		event_free(dev->ev);
-		dev->ev = NULL;
+	if (ble_scan_cmd_write(dev->sock, cmd->opcode, cmd->param,
+			       cmd->plen) < 0) {
+		perror("hci command write");
+		ble_scan_cmd_done(dev, HCI_UNSPECIFIED_ERROR, NULL, 0);
+		return;
 	}
 
-	if (dev->sock >= 0) {
+	dev->cmd_busy = 1;
+	evtimer_add(dev->cmd_timer, &tv);
+}
 
-		flags = fcntl(dev->sock, F_GETFL);
-		if (flags > 0)
-			fcntl(dev->sock, F_SETFL, flags & ~O_NONBLOCK);
+/*
+ * Queues an LE controller command. The reply is picked up from the event
+ * socket and handed to @done, which may queue further commands.
+ */
+static int ble_scan_cmd_queue(struct hci_device *dev, uint16_t ocf,
+			      const void *param, uint8_t plen,
+			      hci_cmd_done_fn done)
+{
+	struct hci_cmd *cmd;
 
-		hci_le_set_scan_enable(dev->sock, 0, 1, 1000);
-		hci_close_dev(dev->sock);
-		dev->sock = -1;
+	if (dev->sock < 0 || plen > HCI_CMD_MAX_PARAM)
+		return -1;
+
+	if (dev->cmd_head - dev->cmd_tail == HCI_CMD_QUEUE_SIZE) {
+		fprintf(stderr, "hci%d: command queue full\n", dev->dev_id);
+		return -1;
 	}
 
-	if (dev->name[0]) {
-		ble_dbus_invalidate_interface(dev->name);
-		veItemSendPendingChanges(get_control());
-		dev->name[0]   = '\0';
+	cmd = &dev->cmds[dev->cmd_head++ % HCI_CMD_QUEUE_SIZE];
+	cmd->opcode = cmd_opcode_pack(OGF_LE_CTL, ocf);
+	cmd->plen   = plen;
+	cmd->done   = done;
+	if (plen)
+		memcpy(cmd->param, param, plen);
+
+	ble_scan_cmd_next(dev);
+
+	return 0;
+}
+
+/*
+ * The controller answers commands in order, so a reply to a command
+ * that timed out arrives before the reply to any later command with the
+ * same opcode, such as the second of a scan disable and enable pair.
+ * Such a late reply is dropped instead of being credited to the later
+ * command. Entries expire in case the reply was lost altogether.
+ */
+static int ble_scan_cmd_late(struct hci_device *dev, uint16_t opcode)
+{
+	uint64_t now = ble_scan_now_ms();
+	int i = 0;
+
+	while (i < dev->cmd_num_late) {
+		struct hci_late_cmd *l = &dev->cmd_late[i];
+
+		if (now - l->ms > HCI_CMD_LATE_EXPIRE) {
+			memmove(l, l + 1, (--dev->cmd_num_late - i) * sizeof(*l));
+			continue;
+		}
+
+		if (l->opcode == opcode) {
+			memmove(l, l + 1, (--dev->cmd_num_late - i) * sizeof(*l));
+			return 1;
+		}
+
+		i++;
 	}
 
-	dev->dev_id    = HCI_DEV_NONE;
-	dev->addr_type = LE_PUBLIC_ADDRESS;
+	return 0;
 }
 
-static void ble_scan_close_dev_id(uint16_t device_id) {
-	int i;
+static void ble_scan_cmd_event(struct hci_device *dev, int evt,
+			       const uint8_t *msg, int len)
+{
+	struct hci_cmd *cmd = &dev->cmds[dev->cmd_tail % HCI_CMD_QUEUE_SIZE];
 
-	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
-		if (devices[i].dev_id == device_id) {
-			ble_scan_close_dev(&devices[i]);
+	/* Any reply, even a late one, shows the controller is alive */
+	dev->cmd_timeouts = 0;
+
+	if (evt == EVT_CMD_COMPLETE) {
+		const evt_cmd_complete *cc = (const evt_cmd_complete *)msg;
+
+		if (len < EVT_CMD_COMPLETE_SIZE + 1)
 			return;
-		}
+		if (ble_scan_cmd_late(dev, btohs(cc->opcode)))
+			return;
+		if (!dev->cmd_busy || btohs(cc->opcode) != cmd->opcode)
+			return;
+
+		msg += EVT_CMD_COMPLETE_SIZE;
+		len -= EVT_CMD_COMPLETE_SIZE;
+
+		ble_scan_cmd_done(dev, msg[0], msg, len);
+	} else {
+		const evt_cmd_status *cs = (const evt_cmd_status *)msg;
+
+		if (len < EVT_CMD_STATUS_SIZE)
+			return;
+		if (ble_scan_cmd_late(dev, btohs(cs->opcode)))
+			return;
+		if (!dev->cmd_busy || btohs(cs->opcode) != cmd->opcode)
+			return;
+
+		ble_scan_cmd_done(dev, cs->status, NULL, 0);
 	}
 }
 
-static void on_dev_socket_readable(evutil_socket_t fd, short events, void *ctx)
+static void on_cmd_timeout(evutil_socket_t fd, short events, void *ctx)
 {
 	struct hci_device *dev = ctx;
-	uint8_t buf[HCI_MAX_EVENT_SIZE];
-	hci_event_hdr *evt;
-	evt_le_meta_event *mev;
-	le_advertising_info *adv;
-	int len;
+	struct hci_cmd *cmd = &dev->cmds[dev->cmd_tail % HCI_CMD_QUEUE_SIZE];
 
-	for (;;) {
-		uint8_t *msg = buf;
+	fprintf(stderr, "hci%d: command 0x%04x timed out\n",
+		dev->dev_id, cmd->opcode);
 
-		len = read(dev->sock, buf, sizeof(buf));
-		if (len < 0 && errno != EAGAIN) {
-			fprintf(stderr, "%s: read: %s\n", dev->name, strerror(errno));
-			ble_scan_close_dev(dev);
-			return;
-		}
+	dev->cmd_timeouts++;
 
-		if (len <= 0)
-			break;
+	/* Forget the oldest when full, its reply is the least likely */
+	if (dev->cmd_num_late == HCI_CMD_LATE_MAX)
+		memmove(dev->cmd_late, dev->cmd_late + 1,
+			--dev->cmd_num_late * sizeof(dev->cmd_late[0]));
 
-		if (msg[0] != HCI_EVENT_PKT)
-			continue;
+	dev->cmd_late[dev->cmd_num_late].opcode = cmd->opcode;
+	dev->cmd_late[dev->cmd_num_late].ms = ble_scan_now_ms();
+	dev->cmd_num_late++;
 
-		msg++;
-		len--;
+	ble_scan_cmd_done(dev, HCI_UNSPECIFIED_ERROR, NULL, 0);
+}
 
-		if (len < HCI_EVENT_HDR_SIZE)
-			continue;
+static void ble_scan_cmd_clear(struct hci_device *dev)
+{
+	if (dev->cmd_timer)
+		evtimer_del(dev->cmd_timer);
+
+	dev->cmd_head = 0;
+	dev->cmd_tail = 0;
+	dev->cmd_busy = 0;
+	dev->cmd_num_late = 0;
+	dev->cmd_timeouts = 0;
+}
 
-		evt = (hci_event_hdr *)msg;
-		msg += HCI_EVENT_HDR_SIZE;
-		len -= HCI_EVENT_HDR_SIZE;
+static void ble_scan_cmd_flush(struct hci_device *dev)
+{
+	ble_scan_cmd_clear(dev);
 
-		if (evt->evt != EVT_LE_META_EVENT)
-			continue;
+	if (dev->cmd_timer) {
+		event_free(dev->cmd_timer);
+		dev->cmd_timer = NULL;
+	}
+}
 
-		if (evt->plen != len)
-			continue;
+static void on_scan_enable_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	/* Enabling an already enabled scan is disallowed, but harmless */
+	if (status && status != HCI_COMMAND_DISALLOWED)
+		fprintf(stderr, "hci%d: scan enable failed (0x%02x)\n",
+			dev->dev_id, status);
+}
 
-		if (len < EVT_LE_META_EVENT_SIZE + 1)
-			continue;
+static int ble_scan_enable(struct hci_device *dev, int enable)
+{
+	le_set_scan_enable_cp cp = {
+		.enable	    = enable,
+		.filter_dup = !enable,
+	};
+	struct le_set_ext_scan_enable_cp ext_cp = {
+		.enable	    = enable,
+		.filter_dup = !enable,
+	};
+	hci_cmd_done_fn done = enable ? on_scan_enable_done : NULL;
+
+	if (dev->ext_scan)
+		return ble_scan_cmd_queue(dev, OCF_LE_SET_EXT_SCAN_ENABLE,
+					  &ext_cp, sizeof(ext_cp), done);
+
+	return ble_scan_cmd_queue(dev, OCF_LE_SET_SCAN_ENABLE, &cp, sizeof(cp),
+				  done);
+}
+
+static int ble_scan_setup(struct hci_device *dev, int addr_type);
 
-		mev = (evt_le_meta_event *)msg;
-		msg += EVT_LE_META_EVENT_SIZE + 1;
-		len -= EVT_LE_META_EVENT_SIZE + 1;
+static void on_stagger_timeout(evutil_socket_t fd, short events, void *ctx)
+{
+	ble_scan_enable(ctx, 1);
+}
+
+static int ble_scan_stagger_rank(struct hci_device *dev, int *count)
+{
+	int rank = 0;
+	int i;
+
+	*count = 0;
 
-		if (mev->subevent != EVT_LE_ADVERTISING_REPORT)
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		if (devices[i].sock < 0)
 			continue;
+		if (&devices[i] < dev)
+			rank++;
+		(*count)++;
+	}
 
-		if (len < LE_ADVERTISING_INFO_SIZE)
+	scan_devs = *count;
+
+	return rank;
+}
+
+/*
+ * Enables scanning so that the windows of n adapters are spread evenly
+ * over the scan interval. Phases are taken against the monotonic clock,
+ * so adapters configured at different times still line up.
+ */
+static int ble_scan_start(struct hci_device *dev, int interval)
+{
+	uint64_t period = interval * 625;	/* us */
+	uint64_t phase;
+	uint64_t delay;
+	struct timeval tv;
+
+	dev->stagger_rank = ble_scan_stagger_rank(dev, &dev->stagger_count);
+
+	if (dev->stagger_count < 2 || interval == SCAN_WINDOW)
+		return ble_scan_enable(dev, 1);
+
+	phase = period * dev->stagger_rank / dev->stagger_count;
+	delay = (phase + period - ble_scan_now_us() % period) % period;
+
+	tv.tv_sec  = delay / 1000000;
+	tv.tv_usec = delay % 1000000;
+
+	return evtimer_add(dev->stagger_timer, &tv);
+}
+
+static void ble_scan_restagger(void)
+{
+	int count;
+	int rank;
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		struct hci_device *dev = &devices[i];
+
+		if (dev->sock < 0)
 			continue;
 
-		adv = (le_advertising_info *)msg;
-		msg += LE_ADVERTISING_INFO_SIZE;
-		len -= LE_ADVERTISING_INFO_SIZE;
+		rank = ble_scan_stagger_rank(dev, &count);
+		if (rank != dev->stagger_rank || count != dev->stagger_count)
+			ble_scan_setup(dev, dev->addr_type);
+	}
+}
+
+static void on_scan_params_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	if (!status)
+		return;
+
+	if (dev->addr_type == LE_RANDOM_ADDRESS) {
+		ble_scan_setup(dev, LE_PUBLIC_ADDRESS);
+		return;
+	}
+
+	fprintf(stderr, "hci%d: set scan parameters failed (0x%02x)\n",
+		dev->dev_id, status);
+}
+
+/*
+ * Extended scanning takes the same parameters for each scanned PHY. The
+ * Coded PHY trades air time for range.
+ */
+static int ble_scan_setup_ext(struct hci_device *dev, int interval)
+{
+	struct le_set_ext_scan_parameters_cp cp = {
+		.own_bdaddr_type = dev->addr_type,
+		.filter		 = ble_scan_filter_policy(dev),
+		.phys		 = LE_SCAN_PHY_1M,
+	};
+	int num_phys = 1;
+	int i;
+
+	if (coded_phy && dev->coded_phy) {
+		cp.phys |= LE_SCAN_PHY_CODED;
+		num_phys++;
+	}
+
+	for (i = 0; i < num_phys; i++) {
+		cp.phy[i].type	   = 0;
+		cp.phy[i].interval = htobs(interval);
+		cp.phy[i].window   = htobs(SCAN_WINDOW);
+	}
+
+	return ble_scan_cmd_queue(dev, OCF_LE_SET_EXT_SCAN_PARAMETERS, &cp,
+				  offsetof(struct le_set_ext_scan_parameters_cp, phy) +
+				  num_phys * sizeof(cp.phy[0]),
+				  on_scan_params_done);
+}
+
+static int ble_scan_setup(struct hci_device *dev, int addr_type)
+{
+	int interval = cont_scan ? SCAN_WINDOW : dev->scan_interval;
+	le_set_scan_parameters_cp cp = {
+		.type		 = 0,
+		.interval	 = htobs(interval),
+		.window		 = htobs(SCAN_WINDOW),
+		.own_bdaddr_type = addr_type,
+		.filter		 = ble_scan_filter_policy(dev),
+	};
+	int err;
+
+	if (dev->sock < 0)
+		return 0;
+
+	dev->addr_type = addr_type;
+
+	ble_scan_enable(dev, 0);
+
+	if (dev->ext_scan)
+		err = ble_scan_setup_ext(dev, interval);
+	else
+		err = ble_scan_cmd_queue(dev, OCF_LE_SET_SCAN_PARAMETERS,
+					 &cp, sizeof(cp), on_scan_params_done);
+	if (err < 0)
+		return -1;
+
+	return ble_scan_start(dev, interval);
+}
+
+static struct accept_entry *ble_scan_accept_find(const bdaddr_t *addr)
+{
+	int i;
+
+	for (i = 0; i < accept_len; i++)
+		if (!bacmp(&accept_list[i].addr, addr))
+			return &accept_list[i];
+
+	return NULL;
+}
+
+static void on_accept_list_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	if (!status || !dev->accept_ok)
+		return;
+
+	fprintf(stderr, "hci%d: filter accept list update failed (0x%02x)\n",
+		dev->dev_id, status);
+
+	dev->accept_ok = 0;
+	ble_scan_setup(dev, dev->addr_type);
+}
+
+static void ble_scan_accept_add_dev(struct hci_device *dev,
+				    const struct accept_entry *e)
+{
+	le_add_device_to_white_list_cp cp = { .bdaddr_type = e->type };
+
+	if (!dev->accept_ok)
+		return;
+
+	bacpy(&cp.bdaddr, &e->addr);
+
+	if (dev->accept_used >= dev->accept_size ||
+	    ble_scan_cmd_queue(dev, OCF_LE_ADD_DEVICE_TO_WHITE_LIST,
+			       &cp, sizeof(cp), on_accept_list_done) < 0) {
+		fprintf(stderr, "hci%d: filter accept list full\n", dev->dev_id);
+		dev->accept_ok = 0;
+		return;
+	}
+
+	dev->accept_used++;
+}
+
+static void ble_scan_accept_rm_dev(struct hci_device *dev,
+				   const struct accept_entry *e)
+{
+	le_remove_device_from_white_list_cp cp = { .bdaddr_type = e->type };
+
+	if (!dev->accept_ok)
+		return;
+
+	bacpy(&cp.bdaddr, &e->addr);
+
+	if (ble_scan_cmd_queue(dev, OCF_LE_REMOVE_DEVICE_FROM_WHITE_LIST,
+			       &cp, sizeof(cp), on_accept_list_done) < 0) {
+		dev->accept_ok = 0;
+		return;
+	}
+
+	dev->accept_used--;
+}
+
+static void on_accept_size_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	const le_read_white_list_size_rp *r = (const void *)rp;
+	int i;
+
+	if (status || len < sizeof(*r)) {
+		fprintf(stderr, "hci%d: no filter accept list\n", dev->dev_id);
+		return;
+	}
+
+	dev->accept_size = r->size;
+	dev->accept_ok = 1;
+
+	ble_scan_enable(dev, 0);
+	ble_scan_cmd_queue(dev, OCF_LE_CLEAR_WHITE_LIST, NULL, 0,
+			   on_accept_list_done);
+
+	for (i = 0; i < accept_len; i++)
+		if (accept_list[i].type >= 0)
+			ble_scan_accept_add_dev(dev, &accept_list[i]);
+
+	ble_scan_setup(dev, dev->addr_type);
+}
+
+/*
+ * Reprograms the accept list of a controller from scratch. Entries are
+ * only added once their address type has been seen in an advertisement.
+ */
+static void ble_scan_accept_load(struct hci_device *dev)
+{
+	dev->accept_ok = 0;
+	dev->accept_used = 0;
+
+	if (!accept_mode)
+		return;
+
+	ble_scan_enable(dev, 0);
+	ble_scan_cmd_queue(dev, OCF_LE_READ_WHITE_LIST_SIZE, NULL, 0,
+			   on_accept_size_done);
+}
+
+/*
+ * The accept list cannot be changed while scanning uses it, so scanning
+ * is paused around each update.
+ */
+static void ble_scan_accept_apply(const struct accept_entry *e, int add)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		struct hci_device *dev = &devices[i];
+
+		if (dev->sock < 0 || !dev->accept_ok)
+			continue;
+
+		ble_scan_enable(dev, 0);
+
+		if (add)
+			ble_scan_accept_add_dev(dev, e);
+		else
+			ble_scan_accept_rm_dev(dev, e);
+
+		ble_scan_setup(dev, dev->addr_type);
+	}
+}
+
+static void ble_scan_accept_phase(int discovery)
+{
+	int i;
+
+	accept_discovery = discovery;
+	accept_ticks = discovery ? DISCOVERY_TIME : ACCEPT_LIST_TIME;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		struct hci_device *dev = &devices[i];
+
+		if (dev->sock < 0)
+			continue;
+
+		if (!discovery && !dev->accept_ok)
+			ble_scan_accept_load(dev);
+
+		ble_scan_setup(dev, dev->addr_type);
+	}
+}
+
+/*
+ * Controllers that support extended advertising are driven with the
+ * extended commands only, as the specification does not allow mixing
+ * them with the legacy scan commands.
+ */
+static void on_features_done(struct hci_device *dev, uint8_t status,
+			     const uint8_t *rp, int len)
+{
+	const le_read_local_supported_features_rp *r = (const void *)rp;
+
+	dev->ext_scan = 0;
+	dev->coded_phy = 0;
+
+	if (!status && len >= sizeof(*r)) {
+		dev->ext_scan = !!(r->features[1] & LE_FEATURE_EXT_ADV);
+		dev->coded_phy = !!(r->features[1] & LE_FEATURE_CODED_PHY);
+	}
+
+	ble_scan_accept_load(dev);
+	ble_scan_setup(dev, LE_RANDOM_ADDRESS);
+}
+
+static void ble_scan_accept_seen(struct hci_device *dev,
+				 const bdaddr_t *addr, uint8_t addr_type)
+{
+	struct accept_entry *e = ble_scan_accept_find(addr);
+	uint64_t now;
+	uint64_t delta;
+
+	if (!e)
+		return;
+
+	now = rx_ms;
+	delta = now - e->last_ms;
+	e->seen_ms[dev - devices] = now;
+
+	/*
+	 * Track the advertising interval as the shortest gap seen, slowly
+	 * relaxing upwards. Gaps from missed reports only ever overestimate.
+	 */
+	if (!e->last_ms || delta >= SCHED_MIN_INTERVAL) {
+		if (delta > SCHED_MAX_INTERVAL)
+			delta = SCHED_MAX_INTERVAL;
+
+		if (e->last_ms && (!e->adv_interval || delta < e->adv_interval))
+			e->adv_interval = delta;
+		else if (e->last_ms)
+			e->adv_interval += (delta - e->adv_interval) / 64;
+
+		e->last_ms = now;
+	}
+
+	if (e->type >= 0)
+		return;
+
+	/* The accept list only knows public and random addresses */
+	e->type = addr_type & 1;
+	accept_unknown--;
+
+	if (accept_mode)
+		ble_scan_accept_apply(e, 1);
+}
+
+static void ble_scan_sync_drop(const bdaddr_t *addr);
+
+/*
+ * Adds or drops a reference to @addr in the set of addresses the
+ * controllers should report. Several devices may share one address.
+ */
+void ble_scan_accept(const bdaddr_t *addr, int enable)
+{
+	struct accept_entry *e = ble_scan_accept_find(addr);
+
+	if (enable) {
+		if (e) {
+			e->refs++;
+			return;
+		}
+
+		if (accept_len == ACCEPT_LIST_MAX) {
+			if (!accept_dropped++ && accept_mode)
+				ble_scan_accept_phase(accept_discovery);
+			return;
+		}
+
+		e = &accept_list[accept_len++];
+		memset(e, 0, sizeof(*e));
+		bacpy(&e->addr, addr);
+		e->type = -1;
+		e->refs = 1;
+		accept_unknown++;
+		return;
+	}
+
+	if (!e) {
+		if (accept_dropped && !--accept_dropped && accept_mode)
+			ble_scan_accept_phase(accept_discovery);
+		return;
+	}
+
+	if (--e->refs)
+		return;
+
+	ble_scan_sync_drop(addr);
+
+	if (e->type < 0)
+		accept_unknown--;
+	else if (accept_mode)
+		ble_scan_accept_apply(e, 0);
+
+	*e = accept_list[--accept_len];
+}
+
+/* Called for every sequence number step of an enabled sensor heard over BLE */
+void ble_scan_seq_gap(uint32_t gap)
+{
+	seq_updates++;
+
+	if (gap > 1 && gap <= SCHED_MAX_SEQ_GAP)
+		seq_missed += gap - 1;
+}
+
+static struct pa_sync *ble_scan_sync_find(struct hci_device *dev,
+					  const bdaddr_t *addr);
+
+static float ble_scan_sched_duty(struct hci_device *dev, uint64_t now)
+{
+	int idx = dev - devices;
+	float duty = 0;
+	int i;
+
+	for (i = 0; i < accept_len; i++) {
+		const struct accept_entry *e = &accept_list[i];
+		uint32_t adv_interval = e->adv_interval ?: SCHED_DEFAULT_INTERVAL;
+		struct pa_sync *sync;
+		float d;
+
+		if (!e->seen_ms[idx] || now - e->seen_ms[idx] > SCHED_IN_RANGE)
+			continue;
+
+		/* Synced sensors no longer depend on the scan window */
+		sync = ble_scan_sync_find(dev, &e->addr);
+		if (sync && sync->state == PA_SYNC_SYNCED)
+			continue;
+
+		/*
+		 * Hearing one of the T / A advertisements sent within the
+		 * target latency T with 95% probability takes a duty d with
+		 * (1 - d)^(T / A) < 0.05, or roughly d > 3 A / T.
+		 */
+		d = 3.0f * adv_interval / (target_latency * 1000.0f);
+		if (d > duty)
+			duty = d;
+	}
+
+	if (!duty)
+		return 1.0f / SCHED_IDLE_DUTY;
+
+	duty *= sched_boost;
+
+	if (duty < 1.0f / SCHED_IDLE_DUTY)
+		duty = 1.0f / SCHED_IDLE_DUTY;
+	if (duty > 1.0f)
+		duty = 1.0f;
+
+	return duty;
+}
+
+/* Missed sequence numbers mean the estimate is too optimistic */
+static void ble_scan_sched_boost(void)
+{
+	uint32_t total = seq_updates + seq_missed;
+
+	if (total >= SCHED_MIN_SAMPLES) {
+		if (seq_missed * 5 > total && sched_boost < SCHED_MAX_BOOST)
+			sched_boost *= 1.5f;
+		else if (seq_missed * 20 < total && sched_boost > 1.0f)
+			sched_boost /= 1.25f;
+
+		if (sched_boost > SCHED_MAX_BOOST)
+			sched_boost = SCHED_MAX_BOOST;
+		if (sched_boost < 1.0f)
+			sched_boost = 1.0f;
+
+		seq_updates = 0;
+		seq_missed = 0;
+	}
+}
+
+static void ble_scan_schedule(void)
+{
+	uint64_t now = ble_scan_now_ms();
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		struct hci_device *dev = &devices[i];
+		int interval = SCAN_INTERVAL;
+
+		if (dev->sock < 0)
+			continue;
+
+		if (target_latency) {
+			interval = SCAN_WINDOW / ble_scan_sched_duty(dev, now);
+			if (interval > 0x4000)
+				interval = 0x4000;
+		}
+
+		if (interval == dev->scan_interval)
+			continue;
+
+		/* Leave small changes alone to avoid churning the controller */
+		if (target_latency &&
+		    abs(interval - dev->scan_interval) * 4 < dev->scan_interval)
+			continue;
+
+		dev->scan_interval = interval;
+		ble_scan_setup(dev, dev->addr_type);
+	}
+}
+
+static uint32_t ble_scan_hash(const uint8_t *buf, int len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *buf++) * 16777619u;
+
+	return h;
+}
+
+static void ble_scan_decode(struct hci_device *dev, const bdaddr_t *addr,
+			    const uint8_t *data, int len, int8_t rssi)
+{
+	int ret;
+
+	ble_set_origin(DATA_SOURCE_BLE, BDADDR_ANY, rssi, 0);
+	ret = ble_parse_adv(addr, data, len);
+
+	if (ret < 0)
+		dev->adv_errors++;
+	else if (ret > 0)
+		dev->adv_matched++;
+}
+
+static void ble_scan_dedup_decode(struct dedup_entry *e)
+{
+	e->pending = 0;
+	ble_scan_decode(e->dev, &e->addr, e->data, e->len, e->rssi);
+}
+
+static void ble_scan_dedup_flush(void)
+{
+	int i;
+
+	for (i = 0; i < dedup_num_pending; i++)
+		if (dedup_pending[i]->pending)
+			ble_scan_dedup_decode(dedup_pending[i]);
+
+	dedup_num_pending = 0;
+}
+
+/*
+ * Copies of an advertisement from several adapters within one ring batch
+ * are coalesced and decoded when the batch has been drained. The
+ * strongest copy is kept, as its RSSI is what the device's source
+ * selection weighs against gateway reports. Payloads already decoded from another adapter within
+ * DEDUP_WINDOW are dropped.
+ */
+static void ble_scan_dedup(struct hci_device *dev, const bdaddr_t *addr,
+			   const uint8_t *data, int len, int8_t rssi)
+{
+	uint32_t hash = ble_scan_hash(data, len);
+	struct dedup_entry *e;
+	uint64_t now = rx_ms;
+
+	e = &dedup[ble_scan_hash(addr->b, sizeof(*addr)) % DEDUP_SIZE];
+
+	if (bacmp(&e->addr, addr)) {
+		if (e->pending)
+			ble_scan_dedup_decode(e);
+		bacpy(&e->addr, addr);
+		e->dev = NULL;
+	} else if (e->hash == hash && e->pending) {
+		if (rssi > e->rssi) {
+			e->rssi = rssi;
+			e->dev = dev;
+		}
+		dev->adv_dups++;
+		return;
+	} else if (e->hash == hash && e->dev != dev &&
+		   now - e->time < DEDUP_WINDOW) {
+		dev->adv_dups++;
+		return;
+	} else if (e->pending) {
+		ble_scan_dedup_decode(e);
+	}
+
+	if (dedup_num_pending == DEDUP_SIZE)
+		ble_scan_dedup_flush();
+
+	e->hash	   = hash;
+	e->time	   = now;
+	e->dev	   = dev;
+	e->rssi	   = rssi;
+	e->len	   = len;
+	e->pending = 1;
+	memcpy(e->data, data, len);
+
+	dedup_pending[dedup_num_pending++] = e;
+}
+
+static int ble_scan_parse_adv(struct hci_device *dev, const bdaddr_t *addr,
+			      uint8_t addr_type, const uint8_t *data, int len,
+			      int8_t rssi)
+{
+	if (!ble_scan_enabled)
+		return 0;
+
+	if (accept_len)
+		ble_scan_accept_seen(dev, addr, addr_type);
+
+	if (rssi != HCI_RSSI_UNAVAILABLE) {
+		dev->rssi_sum += rssi;
+		dev->rssi_count++;
+	}
+
+	/* Long extended advertisements bypass the dedup table */
+	if (scan_devs > 1 && len <= sizeof(dedup[0].data)) {
+		ble_scan_dedup(dev, addr, data, len, rssi);
+		return 0;
+	}
+
+	ble_scan_decode(dev, addr, data, len, rssi);
+
+	return 0;
+}
+
+static struct ext_reasm *ble_scan_reasm_find(struct hci_device *dev,
+					     const bdaddr_t *addr, uint8_t sid)
+{
+	int i;
+
+	for (i = 0; i < EXT_REASM_SLOTS; i++) {
+		struct ext_reasm *r = &ext_reasm[i];
+
+		if (r->active && r->dev == dev && r->sid == sid &&
+		    !bacmp(&r->addr, addr))
+			return r;
+	}
+
+	return NULL;
+}
+
+/* Slots are reused round robin, dropping the oldest partial report */
+static struct ext_reasm *ble_scan_reasm_new(struct hci_device *dev,
+					    const bdaddr_t *addr,
+					    uint8_t addr_type, uint8_t sid)
+{
+	struct ext_reasm *r = &ext_reasm[ext_reasm_next++ % EXT_REASM_SLOTS];
+
+	if (r->active)
+		r->dev->adv_errors++;
+
+	r->dev = dev;
+	r->sid = sid;
+	r->addr_type = addr_type;
+	bacpy(&r->addr, addr);
+	r->active = 1;
+	r->len = 0;
+
+	return r;
+}
+
+/*
+ * Extended and periodic advertising data longer than one report arrives
+ * in fragments flagged as incomplete, which are appended until the final
+ * one. Truncated data is dropped, partial AD structures would be
+ * misparsed.
+ */
+static void ble_scan_reasm(struct hci_device *dev, const bdaddr_t *addr,
+			   uint8_t addr_type, uint8_t sid, int status,
+			   const uint8_t *data, int len, int8_t rssi)
+{
+	struct ext_reasm *r = ble_scan_reasm_find(dev, addr, sid);
+
+	if (status == EXT_ADV_COMPLETE && !r) {
+		ble_scan_parse_adv(dev, addr, addr_type, data, len, rssi);
+		return;
+	}
+
+	if (!r)
+		r = ble_scan_reasm_new(dev, addr, addr_type, sid);
+
+	if (r->len + len > EXT_ADV_MAX_DATA) {
+		r->active = 0;
+		dev->adv_errors++;
+		return;
+	}
+
+	memcpy(r->data + r->len, data, len);
+	r->len += len;
+
+	if (status == EXT_ADV_MORE)
+		return;
+
+	r->active = 0;
+
+	if (status != EXT_ADV_COMPLETE) {
+		dev->adv_errors++;
+		return;
+	}
+
+	ble_scan_parse_adv(dev, &r->addr, r->addr_type, r->data, r->len, rssi);
+}
+
+static struct pa_sync *ble_scan_sync_find(struct hci_device *dev,
+					  const bdaddr_t *addr)
+{
+	int i;
+
+	for (i = 0; i < PA_SYNC_MAX; i++) {
+		struct pa_sync *sync = &dev->syncs[i];
+
+		if (sync->state != PA_SYNC_NONE && !bacmp(&sync->addr, addr))
+			return sync;
+	}
+
+	return NULL;
+}
+
+static struct pa_sync *ble_scan_sync_handle(struct hci_device *dev,
+					    uint16_t handle)
+{
+	int i;
+
+	for (i = 0; i < PA_SYNC_MAX; i++) {
+		struct pa_sync *sync = &dev->syncs[i];
+
+		if (sync->state == PA_SYNC_SYNCED && sync->handle == handle)
+			return sync;
+	}
+
+	return NULL;
+}
+
+static void on_sync_create_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	if (!status || !dev->sync_creating)
+		return;
+
+	dev->sync_creating->state = PA_SYNC_NONE;
+	dev->sync_creating = NULL;
+}
+
+/* Refused when no create is pending, i.e. it completed unseen */
+static void on_sync_cancel_done(struct hci_device *dev, uint8_t status,
+				const uint8_t *rp, int len)
+{
+	if (status != HCI_COMMAND_DISALLOWED || dev->pa_events ||
+	    dev->pa_masked)
+		return;
+
+	fprintf(stderr, "hci%d: periodic advertising events are masked, "
+		"not syncing\n", dev->dev_id);
+
+	dev->pa_masked = 1;
+
+	if (dev->sync_creating) {
+		dev->sync_creating->state = PA_SYNC_NONE;
+		dev->sync_creating = NULL;
+	}
+}
+
+static void ble_scan_sync_cmd_terminate(struct hci_device *dev,
+					uint16_t handle)
+{
+	handle = htobs(handle);
+	ble_scan_cmd_queue(dev, OCF_LE_PA_TERMINATE_SYNC,
+			   &handle, sizeof(handle), NULL);
+}
+
+static void ble_scan_sync_create(struct hci_device *dev,
+				 const struct le_ext_advertising_info *info)
+{
+	struct le_pa_create_sync_cp cp = {
+		.sid	     = info->sid,
+		.bdaddr_type = info->bdaddr_type & 1,
+	};
+	struct pa_sync *sync = NULL;
+	uint32_t timeout;
+	int i;
+
+	if (dev->sync_creating || ble_scan_sync_find(dev, &info->bdaddr))
+		return;
+
+	for (i = 0; i < PA_SYNC_MAX && !sync; i++)
+		if (dev->syncs[i].state == PA_SYNC_NONE)
+			sync = &dev->syncs[i];
+
+	if (!sync)
+		return;
+
+	/* Give up after missing ten periodic events, in 10 ms units */
+	timeout = btohs(info->interval) * 125 / 100;
+	if (timeout < 100)
+		timeout = 100;
+	if (timeout > 0x4000)
+		timeout = 0x4000;
+
+	bacpy(&cp.bdaddr, &info->bdaddr);
+	cp.timeout = htobs(timeout);
+
+	if (ble_scan_cmd_queue(dev, OCF_LE_PA_CREATE_SYNC, &cp, sizeof(cp),
+			       on_sync_create_done) < 0)
+		return;
+
+	sync->state = PA_SYNC_CREATING;
+	sync->addr_type = cp.bdaddr_type;
+	sync->sid = info->sid;
+	sync->timeout_ms = timeout * 10;
+	bacpy(&sync->addr, &info->bdaddr);
+
+	dev->sync_creating = sync;
+	dev->sync_create_ms = ble_scan_now_ms();
+}
+
+static void ble_scan_sync_terminate(struct hci_device *dev,
+				    struct pa_sync *sync)
+{
+	if (sync->state == PA_SYNC_CREATING)
+		ble_scan_cmd_queue(dev, OCF_LE_PA_CREATE_SYNC_CANCEL,
+				   NULL, 0, on_sync_cancel_done);
+	else if (sync->state == PA_SYNC_SYNCED)
+		ble_scan_sync_cmd_terminate(dev, sync->handle);
+
+	/* A cancelled create still reports Sync Established, with an error */
+	if (sync->state == PA_SYNC_SYNCED)
+		sync->state = PA_SYNC_NONE;
+}
+
+static void ble_scan_sync_drop(const bdaddr_t *addr)
+{
+	struct pa_sync *sync;
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		if (devices[i].sock < 0)
+			continue;
+
+		sync = ble_scan_sync_find(&devices[i], addr);
+		if (sync)
+			ble_scan_sync_terminate(&devices[i], sync);
+	}
+}
+
+/* Sync Lost may never come, a sync without reports is gone as well */
+static void ble_scan_sync_expire(struct hci_device *dev, uint64_t now)
+{
+	int i;
+
+	for (i = 0; i < PA_SYNC_MAX; i++) {
+		struct pa_sync *sync = &dev->syncs[i];
+
+		if (sync->state == PA_SYNC_SYNCED &&
+		    now - sync->report_ms > sync->timeout_ms + PA_SYNC_CREATE_TIMEOUT)
+			ble_scan_sync_terminate(dev, sync);
+	}
+}
+
+static void ble_scan_sync_drop_all(struct hci_device *dev)
+{
+	int i;
+
+	for (i = 0; i < PA_SYNC_MAX; i++)
+		ble_scan_sync_terminate(dev, &dev->syncs[i]);
+}
+
+/*
+ * The event may belong to a create that timed out and was cancelled,
+ * while another create is pending, so it is only credited to the
+ * pending one when the advertiser and SID match.
+ */
+static void ble_scan_sync_established(struct hci_device *dev,
+				      const uint8_t *msg, int len)
+{
+	const struct le_pa_sync_established *ev = (const void *)msg;
+	struct pa_sync *sync = dev->sync_creating;
+
+	if (len < sizeof(*ev))
+		return;
+
+	dev->pa_events = 1;
+
+	if (sync && (bacmp(&sync->addr, &ev->bdaddr) || sync->sid != ev->sid ||
+		     sync->addr_type != (ev->bdaddr_type & 1)))
+		sync = NULL;
+
+	/* Synced after all, but not for a create we still have pending */
+	if (!sync) {
+		if (!ev->status)
+			ble_scan_sync_cmd_terminate(dev, btohs(ev->handle));
+		return;
+	}
+
+	dev->sync_creating = NULL;
+
+	/* No longer wanted */
+	if (ev->status || !periodic_sync || !ble_scan_accept_find(&sync->addr)) {
+		if (!ev->status)
+			ble_scan_sync_cmd_terminate(dev, btohs(ev->handle));
+		sync->state = PA_SYNC_NONE;
+		return;
+	}
+
+	sync->state = PA_SYNC_SYNCED;
+	sync->handle = btohs(ev->handle);
+	sync->report_ms = ble_scan_now_ms();
+
+	fprintf(stderr, "hci%d: synced to periodic advertising\n", dev->dev_id);
+}
+
+static void ble_scan_sync_lost(struct hci_device *dev,
+			       const uint8_t *msg, int len)
+{
+	struct pa_sync *sync;
+
+	if (len < 2)
+		return;
+
+	dev->pa_events = 1;
+
+	sync = ble_scan_sync_handle(dev, bt_get_le16(msg));
+	if (sync)
+		sync->state = PA_SYNC_NONE;
+}
+
+/* Periodic reports carry AD structures just like advertisements */
+static void ble_scan_pa_report(struct hci_device *dev,
+			       const uint8_t *msg, int len)
+{
+	const struct le_pa_report *rep = (const void *)msg;
+	struct pa_sync *sync;
+
+	if (len < sizeof(*rep) || len < sizeof(*rep) + rep->length) {
+		dev->adv_errors++;
+		return;
+	}
+
+	dev->pa_events = 1;
+
+	sync = ble_scan_sync_handle(dev, btohs(rep->handle));
+	if (!sync)
+		return;
+
+	sync->report_ms = ble_scan_now_ms();
+
+	dev->adv_reports++;
+	ble_scan_reasm(dev, &sync->addr, sync->addr_type,
+		       sync->sid | PA_SID_PERIODIC, rep->status,
+		       rep->data, rep->length, rep->rssi);
+}
+
+static void ble_scan_ext_report(struct hci_device *dev,
+				const struct le_ext_advertising_info *info)
+{
+	struct pa_sync *sync;
+
+	if (info->bdaddr_type == EXT_ADV_ADDR_ANONYMOUS)
+		return;
+
+	/* Enabled sensors with a periodic train are followed by sync */
+	if (periodic_sync && !dev->pa_masked && info->interval &&
+	    ble_scan_accept_find(&info->bdaddr))
+		ble_scan_sync_create(dev, info);
+
+	/* Their data arrives through the train */
+	sync = ble_scan_sync_find(dev, &info->bdaddr);
+	if (sync && sync->state == PA_SYNC_SYNCED && sync->sid == info->sid)
+		return;
+
+	ble_scan_reasm(dev, &info->bdaddr, info->bdaddr_type, info->sid,
+		       EXT_ADV_STATUS(btohs(info->evt_type)),
+		       info->data, info->length, info->rssi);
+}
+
+static int ble_scan_mgmt_send(uint16_t opcode, uint16_t index,
+			      const void *param, uint16_t len)
+{
+	uint8_t buf[MGMT_HDR_SIZE + sizeof(struct mgmt_cp_add_adv_patterns_monitor)];
+	struct mgmt_hdr *hdr = (struct mgmt_hdr *)buf;
+
+	if (hci_ctl_sock < 0 || len > sizeof(buf) - MGMT_HDR_SIZE)
+		return -1;
+
+	hdr->opcode = htobs(opcode);
+	hdr->index  = htobs(index);
+	hdr->len    = htobs(len);
+	memcpy(buf + MGMT_HDR_SIZE, param, len);
+
+	if (write(hci_ctl_sock, buf, MGMT_HDR_SIZE + len) < 0) {
+		perror("hci control write");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Registers one pattern per known manufacturer ID with the kernel. The
+ * patterns are or-ed, and capable controllers match them in firmware.
+ * The monitor handle arrives later in the command completion.
+ */
+static int ble_scan_monitor_add(struct hci_device *dev)
+{
+	struct mgmt_cp_add_adv_patterns_monitor cp = { 0 };
+	uint16_t ids[MGMT_MAX_PATTERNS];
+	int n;
+	int i;
+
+	n = ble_get_mfg_ids(ids, MGMT_MAX_PATTERNS);
+	if (n > MGMT_MAX_PATTERNS) {
+		fprintf(stderr, "too many manufacturer IDs for a monitor\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct mgmt_adv_pattern *pat = &cp.patterns[i];
+
+		pat->ad_type  = 0xff;	/* Manufacturer Specific Data */
+		pat->offset   = 0;
+		pat->length   = 2;
+		pat->value[0] = ids[i];
+		pat->value[1] = ids[i] >> 8;
+	}
+	cp.pattern_count = n;
+
+	if (ble_scan_mgmt_send(MGMT_OP_ADD_ADV_PATTERNS_MONITOR, dev->dev_id,
+			       &cp, 1 + n * sizeof(cp.patterns[0])) < 0)
+		return -1;
+
+	dev->monitor = 1;
+	dev->monitor_handle = 0;
+
+	return 0;
+}
+
+static void ble_scan_monitor_remove(uint16_t index, uint16_t handle)
+{
+	uint16_t cp = htobs(handle);
+
+	ble_scan_mgmt_send(MGMT_OP_REMOVE_ADV_MONITOR, index, &cp, sizeof(cp));
+}
+
+static void ble_scan_close_dev(struct hci_device *dev)
+{
+	le_set_scan_enable_cp cp = { .enable = 0, .filter_dup = 1 };
+	struct le_set_ext_scan_enable_cp ext_cp = { .enable = 0 };
+	uint16_t handle;
+	unsigned int i;
+
+	if (dev->dev_id == HCI_DEV_NONE)
+		return;
+
+	fprintf(stderr, "closing hci%d (%s)\n", dev->dev_id, dev->name);
+
+	ble_ingest_remove(&dev->src);
+
+	for (i = 0; i < EXT_REASM_SLOTS; i++)
+		if (ext_reasm[i].dev == dev)
+			ext_reasm[i].active = 0;
+
+	if (dev->monitor_handle)
+		ble_scan_monitor_remove(dev->dev_id, dev->monitor_handle);
+
+	if (dev->sock >= 0) {
+		ble_filter_detach(dev->sock);
+
+		/* Nobody is left to wait for the replies */
+		for (i = 0; i < PA_SYNC_MAX; i++) {
+			if (dev->syncs[i].state != PA_SYNC_SYNCED)
+				continue;
+			handle = htobs(dev->syncs[i].handle);
+			ble_scan_cmd_write(dev->sock,
+					   cmd_opcode_pack(OGF_LE_CTL, OCF_LE_PA_TERMINATE_SYNC),
+					   &handle, sizeof(handle));
+		}
+
+		if (dev->sync_creating)
+			ble_scan_cmd_write(dev->sock,
+					   cmd_opcode_pack(OGF_LE_CTL, OCF_LE_PA_CREATE_SYNC_CANCEL),
+					   NULL, 0);
+
+		if (dev->ext_scan)
+			ble_scan_cmd_write(dev->sock,
+					   cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_EXT_SCAN_ENABLE),
+					   &ext_cp, sizeof(ext_cp));
+		else
+			ble_scan_cmd_write(dev->sock,
+					   cmd_opcode_pack(OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE),
+					   &cp, sizeof(cp));
+		hci_close_dev(dev->sock);
+		dev->sock = -1;
+
+		scan_devs = 0;
+		for (i = 0; i < ARRAY_LENGTH(devices); i++)
+			if (devices[i].sock >= 0)
+				scan_devs++;
+	}
+
+	if (dev->name[0]) {
+		ble_dbus_invalidate_interface(dev->name);
+		veItemSendPendingChanges(get_control());
+		dev->name[0]   = '\0';
+	}
+
+	dev->dev_id    = HCI_DEV_NONE;
+	dev->addr_type = LE_PUBLIC_ADDRESS;
+	dev->monitor   = 0;
+	dev->monitor_handle = 0;
+	dev->sync_creating = NULL;
+	memset(dev->syncs, 0, sizeof(dev->syncs));
+
+	if (dev->stagger_timer) {
+		event_free(dev->stagger_timer);
+		dev->stagger_timer = NULL;
+	}
+
+	ble_scan_cmd_flush(dev);
+}
+
+static void ble_scan_close_dev_id(uint16_t device_id) {
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		if (devices[i].dev_id == device_id) {
+			ble_scan_close_dev(&devices[i]);
+			return;
+		}
+	}
+}
+
+/*
+ * An LE Advertising Report event can carry several reports, each
+ * followed by a trailing RSSI byte:
+ *
+ *   num_reports, { le_advertising_info, data[length], rssi } ...
+ */
+static void ble_scan_parse_reports(struct hci_device *dev,
+				   const uint8_t *msg, int len)
+{
+	const le_advertising_info *adv;
+	int num_reports;
+	int8_t rssi;
+
+	if (len < 1)
+		goto err;
+
+	num_reports = *msg++;
+	len--;
+
+	dev->adv_events++;
+
+	while (num_reports--) {
+		if (len < LE_ADVERTISING_INFO_SIZE)
+			goto err;
+
+		adv = (const le_advertising_info *)msg;
+		msg += LE_ADVERTISING_INFO_SIZE;
+		len -= LE_ADVERTISING_INFO_SIZE;
+
+		if (len < adv->length + 1)
+			goto err;
+
+		rssi = msg[adv->length];
+		msg += adv->length + 1;
+		len -= adv->length + 1;
+
+		dev->adv_reports++;
+		ble_scan_parse_adv(dev, &adv->bdaddr, adv->bdaddr_type,
+				   adv->data, adv->length, rssi);
+	}
+
+	return;
+
+err:
+	dev->adv_errors++;
+}
+
+/*
+ * The extended flavour has a fixed 24 byte header per report, with the
+ * RSSI inside it:
+ *
+ *   num_reports, { le_ext_advertising_info, data[length] } ...
+ */
+static void ble_scan_parse_ext_reports(struct hci_device *dev,
+				       const uint8_t *msg, int len)
+{
+	const struct le_ext_advertising_info *info;
+	int num_reports;
+
+	if (len < 1)
+		goto err;
+
+	num_reports = *msg++;
+	len--;
+
+	dev->adv_events++;
+
+	while (num_reports--) {
+		if (len < sizeof(*info))
+			goto err;
+
+		info = (const struct le_ext_advertising_info *)msg;
+		msg += sizeof(*info);
+		len -= sizeof(*info);
+
+		if (len < info->length)
+			goto err;
+
+		msg += info->length;
+		len -= info->length;
+
+		dev->adv_reports++;
+		ble_scan_ext_report(dev, info);
+	}
+
+	return;
+
+err:
+	dev->adv_errors++;
+}
+
+static void ble_scan_parse_event(struct hci_device *dev, const uint8_t *msg, int len)
+{
+	const hci_event_hdr *evt;
+	const evt_le_meta_event *mev;
+
+	if (msg[0] != HCI_EVENT_PKT)
+		return;
+
+	msg++;
+	len--;
+
+	if (len < HCI_EVENT_HDR_SIZE)
+		return;
+
+	evt = (const hci_event_hdr *)msg;
+	msg += HCI_EVENT_HDR_SIZE;
+	len -= HCI_EVENT_HDR_SIZE;
+
+	if (len < evt->plen)
+		return;
+
+	len = evt->plen;
+
+	switch (evt->evt) {
+	case EVT_CMD_COMPLETE:
+	case EVT_CMD_STATUS:
+		ble_scan_cmd_event(dev, evt->evt, msg, len);
+		return;
+	case EVT_LE_META_EVENT:
+		break;
+	default:
+		return;
+	}
+
+	if (len < EVT_LE_META_EVENT_SIZE)
+		return;
+
+	mev = (const evt_le_meta_event *)msg;
+	msg += EVT_LE_META_EVENT_SIZE;
+	len -= EVT_LE_META_EVENT_SIZE;
+
+	switch (mev->subevent) {
+	case EVT_LE_ADVERTISING_REPORT:
+		ble_scan_parse_reports(dev, msg, len);
+		break;
+	case EVT_LE_EXT_ADVERTISING_REPORT:
+		ble_scan_parse_ext_reports(dev, msg, len);
+		break;
+	case EVT_LE_PA_SYNC_ESTABLISHED:
+		ble_scan_sync_established(dev, msg, len);
+		break;
+	case EVT_LE_PA_REPORT:
+		ble_scan_pa_report(dev, msg, len);
+		break;
+	case EVT_LE_PA_SYNC_LOST:
+		ble_scan_sync_lost(dev, msg, len);
+		break;
+	}
+}
 
-		if (len < adv->length)
-			continue;
+/* Runs on the ingest thread */
+static int ble_scan_read(struct ingest_source *src, struct ingest_msg *msg)
+{
+	return read(src->fd, msg->buf, sizeof(msg->buf));
+}
+
+static void on_hci_msg(struct ingest_source *src, const struct ingest_msg *msg)
+{
+	struct hci_device *dev = src->ctx;
 
-		ble_scan_parse_adv(adv);
+	if (msg->len < 0) {
+		fprintf(stderr, "%s: read: %s\n", dev->name, strerror(-msg->len));
+		ble_scan_close_dev(dev);
+		return;
 	}
+
+	rx_ms = msg->time / 1000;
+	ble_scan_parse_event(dev, msg->buf, msg->len);
+}
+
+static void on_hci_flush(struct ingest_source *src)
+{
+	ble_scan_dedup_flush();
 }
 
 static struct hci_device* ble_scan_first_free_device(void)
@@ -225,11 +2063,31 @@ static struct hci_device* ble_scan_first_free_device(void)
 	return NULL;
 }
 
-static void ble_scan_open_dev(int id)
+static void ble_scan_add_interface(struct hci_device *dev,
+				   const struct hci_dev_info *info)
+{
+	int num = dev->sock < 0 ? STAT_SCAN_INTERVAL : STAT_NUM;
+	struct VeItem *intf;
+	char addr[18];
+	int i;
+
+	ba2str(&info->bdaddr, addr);
+	intf = ble_dbus_add_interface(info->name, addr);
+
+	memset(dev->stats, 0, sizeof(dev->stats));
+	for (i = 0; i < num; i++)
+		dev->stats[i] = ble_dbus_add_interface_item(intf,
+				hci_stats[i].path, hci_stats[i].type,
+				hci_stats[i].format);
+
+	veItemSendPendingChanges(get_control());
+	memcpy(dev->name, info->name, NAME_SIZE);
+}
+
+static void ble_scan_open_dev(int id, int monitor)
 {
 	struct hci_dev_info info = { .dev_id = id };
 	struct hci_filter filter;
-	char addr[18];
 	socklen_t len;
 	int hci_sock;
 	int flags;
@@ -242,14 +2100,48 @@ static void ble_scan_open_dev(int id)
 		pltExit(-1);
 	}
 	dev->dev_id = id;
+	dev->adv_events = 0;
+	dev->adv_reports = 0;
+	dev->adv_errors = 0;
+	dev->kernel_drops = 0;
+	dev->scan_interval = SCAN_INTERVAL;
+	dev->adv_dups = 0;
+	dev->adv_matched = 0;
+	dev->rssi_sum = 0;
+	dev->rssi_count = 0;
+	dev->stat_events = 0;
+	dev->stat_reports = 0;
+	dev->stat_ms = ble_scan_now_ms();
+	dev->ext_scan = 0;
+	dev->coded_phy = 0;
+	dev->sync_creating = NULL;
+	memset(dev->syncs, 0, sizeof(dev->syncs));
+	dev->pa_events = 0;
+	dev->pa_masked = 0;
+	dev->last_reports = 0;
+	dev->last_report_ms = ble_scan_now_ms();
+	dev->report_rate = 0;
+	dev->health = HEALTH_OK;
+	dev->backoff_ms = 0;
+	dev->restarts = 0;
+	dev->resets = 0;
+	dev->reopens = 0;
 
 	hci_sock = hci_open_dev(id);
 	if (hci_sock < 0) {
 		perror("hci_open_dev");
-		return;
+		goto err;
 	}
 	dev->sock = hci_sock;
 
+	dev->cmd_timer = evtimer_new(pltGetLibEventBase(), on_cmd_timeout, dev);
+	dev->stagger_timer = evtimer_new(pltGetLibEventBase(),
+					 on_stagger_timeout, dev);
+	if (dev->cmd_timer == NULL || dev->stagger_timer == NULL) {
+		perror("evtimer_new");
+		goto err;
+	}
+
 	err = ioctl(hci_sock, HCIGETDEVINFO, &info);
 	if (err) {
 		perror("HCIGETDEVINFO");
@@ -262,17 +2154,12 @@ static void ble_scan_open_dev(int id)
 		goto err;
 	}
 
-	err = ble_scan_setup(dev, LE_RANDOM_ADDRESS);
-	if (err < 0)
-		err = ble_scan_setup(dev, LE_PUBLIC_ADDRESS);
-
-	if (err < 0) {
-		if (err == -2)
-			perror("hci_le_set_scan_parameters");
-		else
-			perror("hci_le_set_scan_enable");
-
-		goto err;
+	/* With the monitor backend the kernel owns the scan state */
+	if (monitor && !ble_scan_monitor_add(dev)) {
+		hci_close_dev(hci_sock);
+		dev->sock = -1;
+		ble_scan_add_interface(dev, &info);
+		return;
 	}
 
 	len = sizeof(filter);
@@ -284,6 +2171,8 @@ static void ble_scan_open_dev(int id)
 
 	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
 	hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &filter);
+	hci_filter_set_event(EVT_CMD_STATUS, &filter);
 
 	err = setsockopt(hci_sock, SOL_HCI, HCI_FILTER,
 			 &filter, sizeof(filter));
@@ -292,6 +2181,10 @@ static void ble_scan_open_dev(int id)
 		goto err;
 	}
 
+	err = ble_filter_attach(hci_sock, BLE_FILTER_HCI);
+	if (err < 0)
+		fprintf(stderr, "hci%d: no socket filter\n", id);
+
 	flags = fcntl(hci_sock, F_GETFL);
 	if (flags < 0)
 		goto err;
@@ -300,22 +2193,21 @@ static void ble_scan_open_dev(int id)
 	if (err < 0)
 		goto err;
 
-	ba2str(&info.bdaddr, addr);
-	ble_dbus_add_interface(info.name, addr);
-	veItemSendPendingChanges(get_control());
-	memcpy(dev->name, info.name, NAME_SIZE);
+	ble_scan_add_interface(dev, &info);
 
-	dev->ev = event_new(pltGetLibEventBase(), hci_sock,
-			    EV_READ | EV_PERSIST, on_dev_socket_readable, dev);
-	if (dev->ev == NULL) {
-		perror("event_new");
+	dev->src.fd = hci_sock;
+	dev->src.read = ble_scan_read;
+	dev->src.handle = on_hci_msg;
+	dev->src.flush = on_hci_flush;
+	dev->src.ctx = dev;
+
+	if (ble_ingest_add(&dev->src) < 0)
 		goto err;
-	}
 
-	if (event_add(dev->ev, NULL) < 0) {
-		perror("event_add");
+	/* Replies arrive through the event socket set up above */
+	if (ble_scan_cmd_queue(dev, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES,
+			       NULL, 0, on_features_done) < 0)
 		goto err;
-	}
 
 	return;
 
@@ -399,8 +2291,10 @@ static void ble_scan_refresh_devices(void)
 
 	for (i = 0; i < n; i++) {
 		if (!ble_scan_in_dev_list(device_ids[i]))
-			ble_scan_open_dev(device_ids[i]);
+			ble_scan_open_dev(device_ids[i], adv_monitor);
 	}
+
+	ble_scan_restagger();
 }
 
 static void ble_scan_close_ctl(void)
@@ -415,6 +2309,98 @@ static void ble_scan_close_ctl(void)
 	}
 }
 
+static struct hci_device *ble_scan_monitor_dev(uint16_t dev_id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++)
+		if (devices[i].dev_id == dev_id && devices[i].monitor)
+			return &devices[i];
+
+	return NULL;
+}
+
+static void ble_scan_mgmt_complete(uint16_t dev_id, const uint8_t *buf, int len)
+{
+	const struct mgmt_ev_cmd_complete *ev = (const void *)buf;
+	struct hci_device *dev;
+	uint16_t handle;
+
+	if (len < sizeof(*ev))
+		return;
+
+	if (btohs(ev->opcode) != MGMT_OP_ADD_ADV_PATTERNS_MONITOR)
+		return;
+
+	dev = ble_scan_monitor_dev(dev_id);
+
+	if (ev->status) {
+		fprintf(stderr, "hci%d: advertisement monitor failed (%d), "
+			"scanning directly\n", dev_id, ev->status);
+		if (dev) {
+			ble_scan_close_dev(dev);
+			ble_scan_open_dev(dev_id, 0);
+		}
+		return;
+	}
+
+	if (len < sizeof(*ev) + sizeof(handle))
+		return;
+
+	handle = ev->data[0] | ev->data[1] << 8;
+
+	/* The adapter went away while the command was in flight */
+	if (!dev) {
+		ble_scan_monitor_remove(dev_id, handle);
+		return;
+	}
+
+	dev->monitor_handle = handle;
+}
+
+/*
+ * While our monitor is registered, the kernel reports the adverts it
+ * matches as Monitor Device Found. Device Found events for the same
+ * adverts, seen when another client runs discovery, are ignored so they
+ * are not decoded twice.
+ */
+static void ble_scan_mgmt_found(uint16_t dev_id, const uint8_t *buf, int len,
+				int monitored)
+{
+	const struct mgmt_ev_device_found *ev = (const void *)buf;
+	struct hci_device *dev;
+	int eir_len;
+
+	dev = ble_scan_monitor_dev(dev_id);
+	if (!dev)
+		return;
+
+	if (dev->monitor_handle && !monitored)
+		return;
+
+	dev->adv_events++;
+	rx_ms = ble_scan_now_ms();
+
+	if (len < sizeof(*ev))
+		goto err;
+
+	eir_len = btohs(ev->eir_len);
+	if (sizeof(*ev) + eir_len > len)
+		goto err;
+
+	dev->adv_reports++;
+	if (ev->rssi != HCI_RSSI_UNAVAILABLE) {
+		dev->rssi_sum += ev->rssi;
+		dev->rssi_count++;
+	}
+	ble_scan_decode(dev, &ev->bdaddr, ev->eir, eir_len, ev->rssi);
+
+	return;
+
+err:
+	dev->adv_errors++;
+}
+
 static void on_ctl_socket_readable(evutil_socket_t fd, short events, void *ctx)
 {
 	uint8_t buf[1024];
@@ -463,6 +2449,23 @@ static void on_ctl_socket_readable(evutil_socket_t fd, short events, void *ctx)
 			/* Device availability changes: refresh to detect changes */
 			refresh = veTrue;
 			break;
+
+		case MGMT_EV_CMD_COMPLETE:
+		case MGMT_EV_CMD_STATUS:
+			ble_scan_mgmt_complete(dev_id, buf + MGMT_HDR_SIZE, plen);
+			break;
+
+		case MGMT_EV_DEVICE_FOUND:
+			ble_scan_mgmt_found(dev_id, buf + MGMT_HDR_SIZE, plen, 0);
+			break;
+
+		case MGMT_EV_ADV_MONITOR_DEVICE_FOUND:
+			if (plen < 2)
+				break;
+			/* Same layout as Device Found after the monitor handle */
+			ble_scan_mgmt_found(dev_id, buf + MGMT_HDR_SIZE + 2,
+					    plen - 2, 1);
+			break;
 		}
 	}
 
@@ -519,7 +2522,7 @@ int ble_scan_open(void)
 {
 	if (!ble_scan_enabled)
 		return 0;
-	
+
 	if (ble_scan_open_ctl() < 0)
 		return -1;
 
@@ -552,19 +2555,264 @@ void ble_scan_close(void)
 	ble_scan_close_ctl();
 }
 
+/*
+ * Events the kernel dropped because the socket receive queue was full.
+ * HCI sockets do not support SO_RXQ_OVFL, but count drops all the same.
+ */
+static void ble_scan_read_drops(struct hci_device *dev)
+{
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(meminfo);
+
+	if (dev->sock < 0)
+		return;
+
+	if (getsockopt(dev->sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0 ||
+	    len <= SK_MEMINFO_DROPS * sizeof(meminfo[0]))
+		return;
+
+	dev->kernel_drops = meminfo[SK_MEMINFO_DROPS];
+}
+
+/*
+ * Power cycling the adapter makes the kernel run its full init sequence
+ * again, which a plain HCI reset would not, so the LE event mask is
+ * restored along with everything else the controller forgot.
+ */
+static void ble_scan_reset_dev(struct hci_device *dev)
+{
+	if (ioctl(dev->sock, HCIDEVDOWN, dev->dev_id) < 0)
+		perror("HCIDEVDOWN");
+
+	if (ioctl(dev->sock, HCIDEVUP, dev->dev_id) < 0 && errno != EALREADY) {
+		perror("HCIDEVUP");
+		return;
+	}
+
+	ble_scan_cmd_clear(dev);
+	dev->sync_creating = NULL;
+	memset(dev->syncs, 0, sizeof(dev->syncs));
+
+	ble_scan_cmd_queue(dev, OCF_LE_READ_LOCAL_SUPPORTED_FEATURES,
+			   NULL, 0, on_features_done);
+}
+
+/*
+ * Failing to open again is retried from the tick. The learnt report rate
+ * is kept, so a reopened adapter that stays silent is recovered again.
+ */
+static void ble_scan_reopen_dev(struct hci_device *dev)
+{
+	struct hci_device old = *dev;
+	int i;
+
+	ble_scan_close_dev(dev);
+	ble_scan_open_dev(old.dev_id, 0);
+
+	refresh_pending = 1;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
+		dev = &devices[i];
+
+		if (dev->dev_id != old.dev_id)
+			continue;
+
+		dev->health = HEALTH_REOPENED;
+		dev->health_ms = ble_scan_now_ms();
+		dev->backoff_ms = old.backoff_ms;
+		dev->last_report_ms = old.last_report_ms;
+		dev->report_rate = old.report_rate;
+		dev->restarts = old.restarts;
+		dev->resets = old.resets;
+		dev->reopens = old.reopens + 1;
+		refresh_pending = 0;
+	}
+
+	ble_scan_restagger();
+}
+
+/*
+ * Power cycles the controller, and reopens it if that does not bring it
+ * back, again after each back-off. The scan enable queued by the
+ * watchdog on every silent tick doubles as the probe for commands.
+ */
+static void ble_scan_recover(struct hci_device *dev, uint64_t now)
+{
+	if (dev->health != HEALTH_OK && now - dev->health_ms < dev->backoff_ms)
+		return;
+
+	dev->backoff_ms = dev->backoff_ms ? 2 * dev->backoff_ms : WATCHDOG_STEP;
+	if (dev->backoff_ms > WATCHDOG_MAX_BACKOFF)
+		dev->backoff_ms = WATCHDOG_MAX_BACKOFF;
+
+	switch (dev->health) {
+	case HEALTH_OK:
+	case HEALTH_RESTARTED:
+		fprintf(stderr, "hci%d: adapter not recovering, resetting\n",
+			dev->dev_id);
+		dev->resets++;
+		dev->health = HEALTH_RESET;
+		dev->health_ms = now;
+		ble_scan_reset_dev(dev);
+		break;
+	case HEALTH_RESET:
+	case HEALTH_REOPENED:
+		fprintf(stderr, "hci%d: still not recovering, reopening\n",
+			dev->dev_id);
+		ble_scan_reopen_dev(dev);
+		break;
+	}
+}
+
+/*
+ * Runs every 10 seconds for directly scanning adapters. The expected
+ * report rate is only learnt while reports arrive, so an adapter that
+ * never heard anything is not expected to.
+ */
+static void ble_scan_watchdog(struct hci_device *dev, uint64_t now)
+{
+	uint32_t reports = dev->adv_reports - dev->last_reports;
+	uint64_t stall;
+
+	dev->last_reports = dev->adv_reports;
+
+	if (reports) {
+		dev->report_rate += WATCHDOG_WEIGHT *
+			(reports / 10.0f - dev->report_rate);
+		dev->last_report_ms = now;
+		dev->health = HEALTH_OK;
+		dev->backoff_ms = 0;
+		return;
+	}
+
+	if (dev->cmd_timeouts >= WATCHDOG_CMD_TIMEOUTS) {
+		ble_scan_recover(dev, now);
+		return;
+	}
+
+	/* Scanning can be disabled behind our back */
+	ble_scan_enable(dev, 1);
+
+	if (dev->report_rate <= 0)
+		return;
+
+	/* Still silent after a restart, escalate */
+	if (dev->health != HEALTH_OK) {
+		ble_scan_recover(dev, now);
+		return;
+	}
+
+	stall = WATCHDOG_GAPS * 1000 / dev->report_rate;
+	if (stall < WATCHDOG_MIN_STALL)
+		stall = WATCHDOG_MIN_STALL;
+	if (stall > WATCHDOG_MAX_STALL)
+		stall = WATCHDOG_MAX_STALL;
+
+	if (now - dev->last_report_ms < stall)
+		return;
+
+	fprintf(stderr, "hci%d: no reports for %llu s, restarting scan\n",
+		dev->dev_id, (unsigned long long)(now - dev->last_report_ms) / 1000);
+	dev->restarts++;
+	dev->health = HEALTH_RESTARTED;
+	dev->health_ms = now;
+	dev->backoff_ms = stall;
+	ble_scan_setup(dev, dev->addr_type);
+}
+
+/* Rates and the mean RSSI cover the time since the previous call */
+static void ble_scan_publish(struct hci_device *dev, uint64_t now)
+{
+	float secs = (now - dev->stat_ms) / 1000.0f;
+	int interval = cont_scan ? SCAN_WINDOW : dev->scan_interval;
+	struct VeItem **stats = dev->stats;
+
+	if (secs > 0) {
+		ble_dbus_item_set_float(stats[STAT_EVENT_RATE],
+			(dev->adv_events - dev->stat_events) / secs);
+		ble_dbus_item_set_float(stats[STAT_REPORT_RATE],
+			(dev->adv_reports - dev->stat_reports) / secs);
+	}
+
+	if (dev->rssi_count)
+		ble_dbus_item_set_float(stats[STAT_RSSI],
+			(float)dev->rssi_sum / dev->rssi_count);
+	else
+		veItemInvalidate(stats[STAT_RSSI]);
+
+	dev->stat_events = dev->adv_events;
+	dev->stat_reports = dev->adv_reports;
+	dev->stat_ms = now;
+	dev->rssi_sum = 0;
+	dev->rssi_count = 0;
+
+	ble_scan_read_drops(dev);
+
+	ble_dbus_item_set_int(stats[STAT_ADV_EVENTS], dev->adv_events);
+	ble_dbus_item_set_int(stats[STAT_ADV_REPORTS], dev->adv_reports);
+	ble_dbus_item_set_int(stats[STAT_ADV_MATCHED], dev->adv_matched);
+	ble_dbus_item_set_int(stats[STAT_ADV_ERRORS], dev->adv_errors);
+	ble_dbus_item_set_int(stats[STAT_KERNEL_DROPS], dev->kernel_drops);
+	ble_dbus_item_set_int(stats[STAT_ADV_DUPS], dev->adv_dups);
+	ble_dbus_item_set_int(stats[STAT_HEALTH], dev->health);
+	ble_dbus_item_set_int(stats[STAT_RESTARTS], dev->restarts);
+	ble_dbus_item_set_int(stats[STAT_RESETS], dev->resets);
+	ble_dbus_item_set_int(stats[STAT_REOPENS], dev->reopens);
+
+	/* The kernel picks the parameters of monitored adapters */
+	if (dev->sock < 0)
+		return;
+
+	ble_dbus_item_set_float(stats[STAT_SCAN_INTERVAL], interval * 0.625f);
+	ble_dbus_item_set_float(stats[STAT_SCAN_WINDOW], SCAN_WINDOW * 0.625f);
+	ble_dbus_item_set_int(stats[STAT_SCAN_CODED],
+			      dev->ext_scan && dev->coded_phy && coded_phy);
+}
+
 void ble_scan_tick(void)
 {
 	static uint32_t ticks = 10 * TICKS_PER_SEC;
 	int i;
 
+	if (accept_mode && !--accept_ticks)
+		ble_scan_accept_phase(!accept_discovery);
+
 	if (--ticks)
 		return;
 
 	ticks = 10 * TICKS_PER_SEC;
+
+	ble_scan_sched_boost();
+	ble_scan_schedule();
+
+	if (refresh_pending) {
+		refresh_pending = 0;
+		ble_scan_refresh_devices();
+	}
+
 	for (i = 0; i < ARRAY_LENGTH(devices); i++) {
-		if (devices[i].sock >= 0)
-			hci_le_set_scan_enable(devices[i].sock, 1, 0, 1000);
+		struct hci_device *dev = &devices[i];
+
+		/* Monitored adapters are scanned by the kernel */
+		if (dev->sock >= 0)
+			ble_scan_watchdog(dev, ble_scan_now_ms());
+
+		if (!dev->name[0])
+			continue;
+
+		if (dev->sync_creating &&
+		    ble_scan_now_ms() - dev->sync_create_ms > PA_SYNC_CREATE_TIMEOUT) {
+			ble_scan_sync_terminate(dev, dev->sync_creating);
+			dev->sync_creating->state = PA_SYNC_NONE;
+			dev->sync_creating = NULL;
+		}
+
+		ble_scan_sync_expire(dev, ble_scan_now_ms());
+
+		ble_scan_publish(dev, ble_scan_now_ms());
 	}
+
+	veItemSendPendingChanges(get_control());
 }
 
 static void on_contscan_changed(struct VeItem *cont)
@@ -583,6 +2831,96 @@ static void on_contscan_changed(struct VeItem *cont)
 	}
 }
 
+static void on_accept_list_changed(struct VeItem *item)
+{
+	VeVariant val;
+	int i;
+
+	veItemLocalValue(item, &val);
+	if (!veVariantIsValid(&val))
+		return;
+	if (accept_mode == !!val.value.SN32)
+		return;
+
+	accept_mode = !!val.value.SN32;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++)
+		if (devices[i].sock >= 0)
+			ble_scan_accept_load(&devices[i]);
+
+	ble_scan_accept_phase(1);
+}
+
+static void on_adv_monitor_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (!veVariantIsValid(&val))
+		return;
+	if (adv_monitor == !!val.value.SN32)
+		return;
+
+	adv_monitor = !!val.value.SN32;
+
+	if (ble_scan_enabled) {
+		ble_scan_close();
+		ble_scan_open();
+	}
+}
+
+static void on_target_latency_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (!veVariantIsValid(&val))
+		return;
+	if (target_latency == val.value.SN32)
+		return;
+
+	target_latency = val.value.SN32;
+	ble_scan_schedule();
+}
+
+static void on_coded_phy_changed(struct VeItem *item)
+{
+	VeVariant val;
+	int i;
+
+	veItemLocalValue(item, &val);
+	if (!veVariantIsValid(&val))
+		return;
+	if (coded_phy == !!val.value.SN32)
+		return;
+
+	coded_phy = !!val.value.SN32;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++)
+		if (devices[i].ext_scan && devices[i].coded_phy)
+			ble_scan_setup(&devices[i], devices[i].addr_type);
+}
+
+static void on_periodic_sync_changed(struct VeItem *item)
+{
+	VeVariant val;
+	int i;
+
+	veItemLocalValue(item, &val);
+	if (!veVariantIsValid(&val))
+		return;
+	if (periodic_sync == !!val.value.SN32)
+		return;
+
+	periodic_sync = !!val.value.SN32;
+	if (periodic_sync)
+		return;
+
+	for (i = 0; i < ARRAY_LENGTH(devices); i++)
+		if (devices[i].sock >= 0)
+			ble_scan_sync_drop_all(&devices[i]);
+}
+
 static void on_ble_enabled_changed(struct VeItem *item)
 {
 	VeVariant val;
@@ -612,7 +2950,11 @@ int ble_scan_init(void)
 		devices[i].dev_id  = HCI_DEV_NONE;
 		devices[i].sock	   = -1;
 		devices[i].name[0] = '\0';
-		devices[i].ev	   = NULL;
+		devices[i].accept_ok = 0;
+		devices[i].monitor = 0;
+		devices[i].monitor_handle = 0;
+		devices[i].cmd_timer = NULL;
+		devices[i].stagger_timer = NULL;
 	}
 
 	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "ContinuousScan",
@@ -623,6 +2965,41 @@ int ble_scan_init(void)
 		cont_scan = val.value.SN32 ? 1 : 0;
 	}
 
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/AcceptList",
+					     veVariantFmt, &veUnitNone, &accept_list_props);
+	veItemSetChanged(item, on_accept_list_changed);
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		accept_mode = val.value.SN32 ? 1 : 0;
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/AdvMonitor",
+					     veVariantFmt, &veUnitNone, &adv_monitor_props);
+	veItemSetChanged(item, on_adv_monitor_changed);
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		adv_monitor = val.value.SN32 ? 1 : 0;
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/TargetLatency",
+					     veVariantFmt, &veUnitNone, &target_latency_props);
+	veItemSetChanged(item, on_target_latency_changed);
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		target_latency = val.value.SN32;
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/CodedPhy",
+					     veVariantFmt, &veUnitNone, &coded_phy_props);
+	veItemSetChanged(item, on_coded_phy_changed);
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		coded_phy = val.value.SN32 ? 1 : 0;
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/PeriodicSync",
+					     veVariantFmt, &veUnitNone, &periodic_sync_props);
+	veItemSetChanged(item, on_periodic_sync_changed);
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		periodic_sync = val.value.SN32 ? 1 : 0;
+
 	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Bluetooth/Enabled",
 					     veVariantFmt, &veUnitNone, &ble_enabled_props);
 	veItemSetChanged(item, on_ble_enabled_changed);
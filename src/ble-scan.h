@@ -1,10 +1,15 @@
 #ifndef BLE_SCAN_H
 #define BLE_SCAN_H
 
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+
 int ble_scan_init(void);
 int ble_scan_open(void);
 void ble_scan_continuous(int cont);
 void ble_scan_close(void);
 void ble_scan_tick(void);
+void ble_scan_accept(const bdaddr_t *addr, int enable);
+void ble_scan_seq_gap(uint32_t gap);
 
 #endif
@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_item.h>
+#include <velib/utils/ve_item_utils.h>
+
+#include "ble-dbus.h"
+#include "ble-handler.h"
+#include "ble-shm.h"
+#include "ble-unix.h"
+#include "task.h"
+
+#define BLE_SHM_MAX_RINGS 4
+#define BLE_SHM_MAX_FDS 16	/* received per handshake, the kernel discards more */
+
+/* Records handled per wakeup before yielding to the main loop */
+#define BLE_SHM_BATCH 256
+
+struct ble_shm {
+	int conn;
+	struct event *conn_ev;
+	int efd;
+	struct event *ev;
+	struct ble_shm_ring *ring;
+	uint32_t size;		/* validated copy of ring->size */
+	size_t map_size;
+	struct ucred cred;
+	int handshake_ticks;
+	uint32_t records;
+	uint32_t errors;
+};
+
+struct ble_shm_listener {
+	struct ble_unix listener;
+	struct ble_shm rings[BLE_SHM_MAX_RINGS];
+};
+
+static struct ble_shm_listener shm = {
+	.listener = {
+		.sock = -1,
+		.name = "Shared ring socket",
+	},
+};
+
+static struct VeSettingProperties ring_path_props = {
+	.type	       = VE_STR,
+	.def.value.Ptr = "",
+};
+
+/* Statistics published below Socket/Ring/<n>, created once per slot */
+enum ring_stat {
+	RING_STAT_PID,
+	RING_STAT_SIZE,
+	RING_STAT_RECORDS,
+	RING_STAT_ERRORS,
+	RING_STAT_NUM,
+};
+
+static const char *const ring_stat_names[RING_STAT_NUM] = {
+	"Pid", "Size", "Records", "Errors",
+};
+
+static struct VeItem *ring_stats[BLE_SHM_MAX_RINGS][RING_STAT_NUM];
+
+static void ble_shm_publish(int n)
+{
+	struct VeItem **stats = ring_stats[n];
+	struct ble_shm *r = &shm.rings[n];
+	char path[32];
+	int i;
+
+	for (i = 0; i < RING_STAT_NUM && !stats[i]; i++) {
+		snprintf(path, sizeof(path), "Socket/Ring/%d/%s", n,
+			 ring_stat_names[i]);
+		stats[i] = ble_dbus_create_int(get_control(), path, 0);
+	}
+
+	ble_dbus_item_set_int(stats[RING_STAT_PID], r->cred.pid);
+	ble_dbus_item_set_int(stats[RING_STAT_SIZE], r->size);
+	ble_dbus_item_set_int(stats[RING_STAT_RECORDS], r->records);
+	ble_dbus_item_set_int(stats[RING_STAT_ERRORS], r->errors);
+}
+
+static void ble_shm_unpublish(int n)
+{
+	int i;
+
+	for (i = 0; i < RING_STAT_NUM; i++)
+		if (ring_stats[n][i])
+			veItemInvalidate(ring_stats[n][i]);
+}
+
+static void ble_shm_detach(struct ble_shm *r)
+{
+	if (r->ring) {
+		fprintf(stderr, "Shared ring of pid %d detached\n", r->cred.pid);
+		ble_shm_unpublish(r - shm.rings);
+	}
+
+	if (r->ev) {
+		event_free(r->ev);
+		r->ev = NULL;
+	}
+
+	if (r->efd >= 0) {
+		close(r->efd);
+		r->efd = -1;
+	}
+
+	if (r->ring) {
+		munmap(r->ring, r->map_size);
+		r->ring = NULL;
+	}
+
+	if (r->conn_ev) {
+		event_free(r->conn_ev);
+		r->conn_ev = NULL;
+	}
+
+	if (r->conn >= 0) {
+		close(r->conn);
+		r->conn = -1;
+	}
+}
+
+/*
+ * The producer may change the ring at any time, so the record is copied
+ * out before it is checked and parsed, the parsers read the AD lengths
+ * more than once. Returns the number of bytes consumed, or -1 if the
+ * ring is corrupt.
+ */
+static int ble_shm_record(struct ble_shm *r, uint32_t tail, uint32_t avail)
+{
+	uint32_t offset = tail & (r->size - 1);
+	uint32_t space = r->size - offset;
+	const struct ble_shm_record *rec;
+	struct ble_shm_record hdr;
+	uint8_t data[UINT8_MAX];
+	bdaddr_t gateway = {{ 0 }};
+	bdaddr_t bdaddr;
+	uint32_t size;
+
+	/* Records are aligned, so the size and type are always in the ring */
+	rec = (const struct ble_shm_record *)(r->ring->data + offset);
+	memcpy(&hdr, rec, offsetof(struct ble_shm_record, rssi));
+	size = hdr.size;
+
+	if (hdr.type == BLE_SHM_PAD)
+		return space <= avail ? space : -1;
+
+	if (size < sizeof(hdr) || size % BLE_SHM_ALIGN || size > space ||
+	    size > avail)
+		return -1;
+
+	memcpy(&hdr, rec, sizeof(hdr));
+	if (sizeof(hdr) + hdr.len > size)
+		return -1;
+
+	memcpy(data, rec->data, hdr.len);
+	memcpy(&bdaddr, hdr.bdaddr, sizeof(bdaddr));
+
+	/* Rings name no gateway, FF:02:00:00:00:<n> tells them apart */
+	gateway.b[5] = 0xff;
+	gateway.b[4] = 0x02;
+	gateway.b[0] = r - shm.rings;
+	ble_set_origin(DATA_SOURCE_GATEWAY, &gateway, hdr.rssi, 0);
+
+	switch (hdr.type) {
+	case BLE_SHM_ADV:
+		ble_parse_adv(&bdaddr, data, hdr.len);
+		break;
+	case BLE_SHM_MFG:
+		ble_handle_mfg(&bdaddr, hdr.mfg_id, data, hdr.len,
+			       DATA_SOURCE_GATEWAY);
+		break;
+	default:
+		r->errors++;
+		break;
+	}
+
+	r->records++;
+
+	return size;
+}
+
+static void on_shm_ready(evutil_socket_t fd, short events, void *ctx)
+{
+	struct ble_shm *r = ctx;
+	struct ble_shm_ring *ring = r->ring;
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head;
+	uint64_t val;
+	int len;
+	int n;
+
+	if ((events & EV_READ) && read(fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		perror("eventfd read");
+
+	atomic_store_explicit(&ring->wake, 0, memory_order_relaxed);
+
+	ble_dbus_batch_begin();
+
+	for (n = 0; n < BLE_SHM_BATCH; n++) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		if (head == tail) {
+			/* Ask for a wakeup, then look again for a racing write */
+			atomic_store_explicit(&ring->wake, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			head = atomic_load_explicit(&ring->head, memory_order_acquire);
+			if (head == tail)
+				break;
+			atomic_store_explicit(&ring->wake, 0, memory_order_relaxed);
+		}
+
+		if (head - tail > r->size || (head - tail) % BLE_SHM_ALIGN)
+			len = -1;
+		else
+			len = ble_shm_record(r, tail, head - tail);
+
+		if (len < 0) {
+			fprintf(stderr, "Shared ring of pid %d is corrupt\n",
+				r->cred.pid);
+			ble_dbus_batch_end();
+			ble_shm_detach(r);
+			return;
+		}
+
+		tail += len;
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	ble_dbus_batch_end();
+
+	if (n == BLE_SHM_BATCH)
+		event_active(r->ev, 0, 0);
+}
+
+static int ble_shm_handshake(struct ble_shm *r);
+
+static void on_shm_conn(evutil_socket_t fd, short events, void *ctx)
+{
+	struct ble_shm *r = ctx;
+	char buf[16];
+	ssize_t len;
+	int err;
+
+	if (!r->ring) {
+		err = ble_shm_handshake(r);
+		if (err > 0)
+			return;
+		if (err < 0) {
+			ble_shm_detach(r);
+			return;
+		}
+
+		fprintf(stderr, "Shared ring of %u bytes attached by pid %d\n",
+			r->size, r->cred.pid);
+		ble_shm_publish(r - shm.rings);
+		return;
+	}
+
+	/* Nothing more is expected after the handshake but the hangup */
+	len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (len <= 0)
+		ble_shm_detach(r);
+}
+
+static int ble_shm_map(struct ble_shm *r, int memfd)
+{
+	struct ble_shm_ring *ring;
+	struct stat st;
+	uint32_t size;
+	int seals;
+
+	/* A shrinking file would fault the daemon on access */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK)) {
+		fprintf(stderr, "shared ring is not sealed against shrinking\n");
+		return -1;
+	}
+
+	if (fstat(memfd, &st) < 0) {
+		perror("fstat");
+		return -1;
+	}
+
+	if (st.st_size < sizeof(*ring) + BLE_SHM_MIN_SIZE) {
+		fprintf(stderr, "shared ring too small\n");
+		return -1;
+	}
+
+	ring = mmap(NULL, sizeof(*ring), PROT_READ, MAP_SHARED, memfd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	size = ring->size;
+	if (ring->magic != BLE_SHM_MAGIC || ring->version != BLE_SHM_VERSION ||
+	    size < BLE_SHM_MIN_SIZE || size > BLE_SHM_MAX_SIZE ||
+	    (size & (size - 1)) || st.st_size < sizeof(*ring) + size) {
+		fprintf(stderr, "invalid shared ring header\n");
+		munmap(ring, sizeof(*ring));
+		return -1;
+	}
+
+	munmap(ring, sizeof(*ring));
+
+	r->map_size = sizeof(*ring) + size;
+	ring = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	r->ring = ring;
+	r->size = size;
+
+	return 0;
+}
+
+/*
+ * Closes every descriptor passed in @msg, except the pair taken from the
+ * first SCM_RIGHTS message holding exactly two into @fds.
+ */
+static void ble_shm_take_fds(struct msghdr *msg, int fds[2])
+{
+	struct cmsghdr *cmsg;
+	int *data;
+	int num;
+	int i;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		data = (int *)CMSG_DATA(cmsg);
+		num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (num == 2 && fds[0] < 0) {
+			memcpy(fds, data, 2 * sizeof(int));
+			continue;
+		}
+
+		for (i = 0; i < num; i++)
+			close(data[i]);
+	}
+}
+
+/*
+ * Receive the memfd and eventfd, and start consuming the ring. Returns
+ * 1 while the handshake has not arrived yet.
+ */
+static int ble_shm_handshake(struct ble_shm *r)
+{
+	/* Room for more than the two descriptors, so extra ones get closed */
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(BLE_SHM_MAX_FDS * sizeof(int))];
+	} ctrl;
+	struct msghdr msg;
+	struct iovec iov;
+	uint32_t magic;
+	int fds[2] = { -1, -1 };
+	ssize_t len;
+	int err = -1;
+
+	iov.iov_base = &magic;
+	iov.iov_len  = sizeof(magic);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov	   = &iov;
+	msg.msg_iovlen	   = 1;
+	msg.msg_control	   = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	len = recvmsg(r->conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 1;
+	if (len < 0) {
+		perror("shared ring recvmsg");
+		return -1;
+	}
+
+	ble_shm_take_fds(&msg, fds);
+
+	if (len != sizeof(magic) || magic != BLE_SHM_MAGIC || (msg.msg_flags & MSG_CTRUNC) ||
+	    fds[0] < 0) {
+		fprintf(stderr, "invalid shared ring handshake\n");
+		goto out;
+	}
+
+	if (ble_shm_map(r, fds[0]) < 0)
+		goto out;
+
+	r->efd = fds[1];
+	fds[1] = -1;
+
+	if (fcntl(r->efd, F_SETFL, O_NONBLOCK) < 0) {
+		perror("fcntl");
+		goto out;
+	}
+
+	r->ev = event_new(pltGetLibEventBase(), r->efd, EV_READ | EV_PERSIST,
+			  on_shm_ready, r);
+	if (!r->ev || event_add(r->ev, NULL) < 0) {
+		perror("event_new");
+		goto out;
+	}
+
+	/* Records may have been written before the ring was attached */
+	event_active(r->ev, 0, 0);
+
+	err = 0;
+out:
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+
+	return err;
+}
+
+static void on_shm_accept(evutil_socket_t fd, short events, void *ctx)
+{
+	struct ble_shm *r = NULL;
+	socklen_t len;
+	int conn;
+	int n;
+
+	conn = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (conn < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("shared ring accept");
+		return;
+	}
+
+	for (n = 0; n < BLE_SHM_MAX_RINGS; n++) {
+		if (shm.rings[n].conn < 0) {
+			r = &shm.rings[n];
+			break;
+		}
+	}
+
+	if (!r) {
+		fprintf(stderr, "too many shared rings\n");
+		close(conn);
+		return;
+	}
+
+	r->conn = conn;
+
+	len = sizeof(r->cred);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &r->cred, &len) < 0)
+		memset(&r->cred, 0, sizeof(r->cred));
+
+	r->handshake_ticks = 0;
+	r->records = 0;
+	r->errors  = 0;
+
+	/* The handshake is read once it arrives, see on_shm_conn() */
+	r->conn_ev = event_new(pltGetLibEventBase(), conn, EV_READ | EV_PERSIST,
+			       on_shm_conn, r);
+	if (!r->conn_ev || event_add(r->conn_ev, NULL) < 0) {
+		perror("event_new");
+		ble_shm_detach(r);
+		return;
+	}
+
+	event_active(r->conn_ev, EV_READ, 0);
+}
+
+static void ble_shm_stop(void)
+{
+	int i;
+
+	for (i = 0; i < BLE_SHM_MAX_RINGS; i++)
+		ble_shm_detach(&shm.rings[i]);
+
+	ble_unix_close(&shm.listener);
+}
+
+void ble_shm_open(void)
+{
+	const char *path = ble_unix_path("Socket/RingPath");
+
+	if (ble_unix_listening(&shm.listener, path))
+		return;
+
+	ble_shm_stop();
+	ble_unix_listen(&shm.listener, path, BLE_SHM_MAX_RINGS, on_shm_accept);
+}
+
+static void on_ring_path_changed(struct VeItem *item)
+{
+	ble_shm_open();
+}
+
+int ble_shm_init(void)
+{
+	struct VeItem *settings = get_settings();
+	struct VeItem *ctl	= get_control();
+	struct VeItem *item;
+	int i;
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Socket/RingPath",
+					     veVariantFmt, &veUnitNone, &ring_path_props);
+	veItemSetChanged(item, on_ring_path_changed);
+
+	for (i = 0; i < BLE_SHM_MAX_RINGS; i++) {
+		shm.rings[i].conn = -1;
+		shm.rings[i].efd  = -1;
+	}
+
+	return 0;
+}
+
+void ble_shm_close(void)
+{
+	ble_shm_stop();
+}
+
+void ble_shm_tick(void)
+{
+	static uint32_t ticks = 10 * TICKS_PER_SEC;
+	int i;
+
+	if (--ticks)
+		return;
+
+	ticks = 10 * TICKS_PER_SEC;
+
+	for (i = 0; i < BLE_SHM_MAX_RINGS; i++) {
+		struct ble_shm *r = &shm.rings[i];
+
+		if (r->ring) {
+			ble_shm_publish(i);
+			continue;
+		}
+
+		/* A producer gets 10 to 20 s to send the handshake */
+		if (r->conn >= 0 && r->handshake_ticks++) {
+			fprintf(stderr, "no shared ring handshake from pid %d\n",
+				r->cred.pid);
+			ble_shm_detach(r);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef BLE_SHM_H
+#define BLE_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Shared memory ring for a local capture daemon.
+ *
+ * The producer connects to the SOCK_SEQPACKET socket at Socket/RingPath
+ * and sends BLE_SHM_MAGIC with a memfd and an eventfd attached as
+ * SCM_RIGHTS. The memfd holds a struct ble_shm_ring followed by size
+ * bytes of records, and must be sealed with F_SEAL_SHRINK. Closing the
+ * connection detaches the ring.
+ *
+ * head and tail are free running byte counters, advanced in multiples
+ * of 8. A record never wraps, a BLE_SHM_PAD record fills the end of the
+ * ring instead. After publishing head, the producer writes the eventfd
+ * if it swaps wake from 1 to 0.
+ */
+
+#define BLE_SHM_MAGIC	0x524d4853	/* "SHMR" */
+#define BLE_SHM_VERSION 1
+
+#define BLE_SHM_MIN_SIZE (1 << 12)
+#define BLE_SHM_MAX_SIZE (1 << 24)
+
+#define BLE_SHM_ALIGN 8
+
+enum ble_shm_type {
+	BLE_SHM_PAD,		/* skip to the start of the ring */
+	BLE_SHM_ADV,		/* raw advertising data */
+	BLE_SHM_MFG,		/* manufacturer data of mfg_id */
+};
+
+struct ble_shm_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* of data[], a power of two */
+	uint32_t reserved[13];
+
+	_Atomic uint32_t head;	/* written by the producer */
+	uint32_t pad0[15];
+
+	_Atomic uint32_t tail;	/* written by the daemon */
+	_Atomic uint32_t wake;	/* the daemon waits for the eventfd */
+	uint32_t pad1[14];
+
+	uint8_t data[];
+};
+
+struct ble_shm_record {
+	uint16_t size;		/* of the whole record, BLE_SHM_ALIGN aligned */
+	uint8_t type;
+	int8_t rssi;		/* 0x7F means invalid */
+	uint16_t mfg_id;	/* BLE_SHM_MFG only, host byte order */
+	uint8_t len;		/* of data[] */
+	uint8_t reserved;
+	uint8_t bdaddr[6];
+	uint8_t data[];
+};
+
+int ble_shm_init(void);
+void ble_shm_open(void);
+void ble_shm_close(void);
+void ble_shm_tick(void);
+
+#endif
@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -14,24 +17,93 @@
 #include <velib/utils/ve_item_utils.h>
 
 #include "ble-dbus.h"
+#include "ble-feedback.h"
+#include "ble-filter.h"
 #include "ble-handler.h"
+#include "ble-ingest.h"
 #include "ble-socket.h"
+#include "ble-unix.h"
 #include "task.h"
 
-#define BLE_SOCKET_MAX_PACKET 128
 #define BLE_SOCKET_MIN_SIZE_V1 11
 #define BLE_SOCKET_MIN_SIZE_V2 14
+#define BLE_SOCKET_MIN_SIZE_V3 8
+#define BLE_SOCKET_RECORD_SIZE_V3 10
+#define BLE_SOCKET_MAX_LOCAL 8
+#define BLE_SOCKET_MAX_GATEWAYS 32
+#define BLE_SOCKET_GATEWAY_IDLE 60000	/* ms before a gateway's bucket is reused */
+#define BLE_SOCKET_ADV_BUCKETS 1024
+
+/* Token bucket holding up to a second of traffic, in 1/1000 packets */
+struct ble_bucket {
+	uint64_t tokens;
+	uint64_t last_ms;
+};
+
+struct ble_gateway_bucket {
+	struct in_addr addr;
+	struct ble_bucket bucket;
+};
+
+struct ble_adv_bucket {
+	int used;
+	struct ble_bucket bucket;
+};
 
 struct ble_socket {
 	int sock;
-	struct event *ev;
+	struct ingest_source src;
 	struct sockaddr_in bind_addr;
 };
 
+/* A local forwarder connected to the unix socket */
+struct ble_local_conn {
+	int sock;
+	struct ingest_source src;
+	struct ucred cred;
+	char name[16];
+	uint32_t packets;
+	uint32_t bytes;
+};
+
+struct ble_local {
+	struct ble_unix listener;
+	struct ble_local_conn conns[BLE_SOCKET_MAX_LOCAL];
+};
+
 static struct ble_socket ble_sock = {
 	.sock = -1,
 };
 
+static struct ble_local ble_local = {
+	.listener = {
+		.sock = -1,
+		.name = "Local socket",
+	},
+};
+
+static struct ble_gateway_bucket gw_buckets[BLE_SOCKET_MAX_GATEWAYS];
+static int num_gw_buckets;
+static struct ble_bucket gw_overflow;
+
+/* Buckets of advertisers with an enabled device, and of all others */
+static struct ble_adv_bucket adv_buckets[2][BLE_SOCKET_ADV_BUCKETS];
+
+static int rate_limit = 1000;
+static int adv_rate_limit = 50;
+
+/* State of the packet being parsed */
+static uint64_t now_ms;
+static int shedding;
+static bdaddr_t sender;
+
+static uint32_t shed_gateway;
+static uint32_t shed_adv;
+static uint32_t shed_overload;
+static struct VeItem *shed_gateway_item;
+static struct VeItem *shed_adv_item;
+static struct VeItem *shed_overload_item;
+
 static struct VeSettingProperties port_props = {
 	.type		= VE_SN32,
 	.def.value.SN32 = BLE_SOCKET_DEFAULT_PORT,
@@ -44,22 +116,253 @@ static struct VeSettingProperties bind_props = {
 	.def.value.Ptr = BLE_SOCKET_DEFAULT_BIND,
 };
 
-static void ble_socket_stop(void)
+static struct VeSettingProperties local_path_props = {
+	.type	       = VE_STR,
+	.def.value.Ptr = "",
+};
+
+static struct VeSettingProperties rate_limit_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 1000,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 100000,
+};
+
+static struct VeSettingProperties adv_rate_limit_props = {
+	.type		= VE_SN32,
+	.def.value.SN32 = 50,
+	.min.value.SN32 = 0,
+	.max.value.SN32 = 1000,
+};
+
+static void ble_bucket_fill(struct ble_bucket *b, int rate)
 {
-	if (ble_sock.ev) {
-		event_free(ble_sock.ev);
-		ble_sock.ev = NULL;
+	b->tokens  = rate * 1000ull;
+	b->last_ms = now_ms;
+}
+
+static int ble_bucket_take(struct ble_bucket *b, int rate)
+{
+	uint64_t cap = rate * 1000ull;
+
+	b->tokens += (now_ms - b->last_ms) * rate;
+	if (b->tokens > cap)
+		b->tokens = cap;
+	b->last_ms = now_ms;
+
+	if (b->tokens < 1000)
+		return 0;
+
+	b->tokens -= 1000;
+	return 1;
+}
+
+/*
+ * Whether to take a packet from a gateway, each gets rate_limit packets
+ * per second. A gateway silent for BLE_SOCKET_GATEWAY_IDLE makes room
+ * for a new one. Until then, new gateways share one bucket, so a flood
+ * of spoofed addresses cannot reset the bucket of a busy gateway.
+ */
+static int ble_socket_admit_gateway(const struct ingest_msg *msg)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)&msg->addr;
+	struct ble_gateway_bucket *g = NULL;
+	int i;
+
+	if (!rate_limit || msg->addrlen < sizeof(*sin) || sin->sin_family != AF_INET)
+		return 1;
+
+	for (i = 0; i < num_gw_buckets; i++) {
+		if (gw_buckets[i].addr.s_addr == sin->sin_addr.s_addr) {
+			g = &gw_buckets[i];
+			break;
+		}
+	}
+
+	if (!g) {
+		if (num_gw_buckets < BLE_SOCKET_MAX_GATEWAYS) {
+			g = &gw_buckets[num_gw_buckets++];
+		} else {
+			g = &gw_buckets[0];
+			for (i = 1; i < num_gw_buckets; i++)
+				if (gw_buckets[i].bucket.last_ms < g->bucket.last_ms)
+					g = &gw_buckets[i];
+
+			if (now_ms - g->bucket.last_ms < BLE_SOCKET_GATEWAY_IDLE)
+				return ble_bucket_take(&gw_overflow, rate_limit);
+		}
+
+		g->addr = sin->sin_addr;
+		ble_bucket_fill(&g->bucket, rate_limit);
+	}
+
+	return ble_bucket_take(&g->bucket, rate_limit);
+}
+
+/*
+ * Whether to handle an advertisement from @addr. While shedding, only
+ * enabled devices get through. Each advertiser gets adv_rate_limit
+ * advertisements per second. Advertisers hashing to the same bucket
+ * share its tokens, so alternating between them gains nothing. Enabled
+ * devices hash into buckets of their own, which unknown advertisers
+ * cannot drain.
+ */
+static int ble_socket_admit(const bdaddr_t *addr)
+{
+	int enabled = ble_dbus_addr_enabled(addr);
+	struct ble_adv_bucket *b;
+	uint32_t h = 0;
+	int i;
+
+	if (shedding && !enabled) {
+		shed_overload++;
+		return 0;
+	}
+
+	if (!adv_rate_limit)
+		return 1;
+
+	for (i = 0; i < 6; i++)
+		h = h * 31 + addr->b[i];
+
+	b = &adv_buckets[enabled][h % BLE_SOCKET_ADV_BUCKETS];
+	if (!b->used) {
+		b->used = 1;
+		ble_bucket_fill(&b->bucket, adv_rate_limit);
 	}
 
+	if (!ble_bucket_take(&b->bucket, adv_rate_limit)) {
+		shed_adv++;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void ble_socket_stop(void)
+{
 	if (ble_sock.sock >= 0) {
+		ble_feedback_detach(ble_sock.sock);
+		ble_ingest_remove(&ble_sock.src);
+		ble_filter_detach(ble_sock.sock);
 		close(ble_sock.sock);
 		ble_sock.sock = -1;
 	}
 }
 
+/*
+ * Packets that do not name their gateway are told apart by where they
+ * came from, so that each link stays a source of its own. The sender
+ * stands in for the gateway address: the IPv4 address and port of a UDP
+ * gateway, with an IPv6 address folded into four bytes, or
+ * FF:01:00:00:00:<n> for local forwarder n.
+ */
+static void ble_socket_set_sender(const struct ingest_msg *msg)
+{
+	const struct sockaddr_in *sin = (const void *)&msg->addr;
+	const struct sockaddr_in6 *sin6 = (const void *)&msg->addr;
+	const uint8_t *ip;
+	uint16_t port;
+	int i;
+
+	bacpy(&sender, BDADDR_ANY);
+
+	if (!msg->addrlen)
+		return;
+
+	switch (msg->addr.ss_family) {
+	case AF_INET:
+		ip = (const uint8_t *)&sin->sin_addr;
+		for (i = 0; i < 4; i++)
+			sender.b[5 - i] = ip[i];
+		port = ntohs(sin->sin_port);
+		break;
+	case AF_INET6:
+		ip = sin6->sin6_addr.s6_addr;
+		for (i = 0; i < 16; i++)
+			sender.b[5 - i % 4] ^= ip[i];
+		port = ntohs(sin6->sin6_port);
+		break;
+	default:
+		return;
+	}
+
+	sender.b[1] = port >> 8;
+	sender.b[0] = port;
+}
+
+static void ble_local_set_sender(int n)
+{
+	bacpy(&sender, BDADDR_ANY);
+	sender.b[5] = 0xff;
+	sender.b[4] = 0x01;
+	sender.b[0] = n;
+}
+
+/* The named gateway, or the sender if the packet names none */
+static const bdaddr_t *ble_socket_gateway(const bdaddr_t *gateway)
+{
+	return bacmp(gateway, BDADDR_ANY) ? gateway : &sender;
+}
+
+/* Format 3:
+ * byte 0: version (3)
+ * byte 1: number of records
+ * bytes 2-7: gateway bdaddr
+ * records follow back to back, each:
+ *   bytes 0-5: advertisement bdaddr
+ *   byte 6: rssi (signed), 0x7F means invalid
+ *   bytes 7-8: capture age, ms before the packet was sent (little endian)
+ *   byte 9: advertisement data length N
+ *   bytes 10..(10+N): raw advertisement data (same format as in BLE scan results)
+ *
+ * The gateway, RSSI and age of each record are its origin for the
+ * per-device source selection.
+ */
+static void ble_socket_parse_v3(const uint8_t *buf, int len)
+{
+	bdaddr_t gateway;
+	bdaddr_t bdaddr;
+	int8_t rssi;
+	uint16_t age;
+	int count;
+	int adlen;
+	int offset;
+
+	if (len < BLE_SOCKET_MIN_SIZE_V3)
+		return;
+
+	count  = buf[1];
+	offset = BLE_SOCKET_MIN_SIZE_V3;
+	memcpy(&gateway, buf + 2, 6);
+
+	while (count--) {
+		if (len < offset + BLE_SOCKET_RECORD_SIZE_V3)
+			return;
+
+		memcpy(&bdaddr, buf + offset, 6);
+		rssi   = buf[offset + 6];
+		age    = buf[offset + 7] | buf[offset + 8] << 8;
+		adlen  = buf[offset + 9];
+		ble_set_origin(DATA_SOURCE_GATEWAY, ble_socket_gateway(&gateway),
+			       rssi, age);
+		offset += BLE_SOCKET_RECORD_SIZE_V3;
+
+		if (len < offset + adlen)
+			return;
+
+		if (ble_socket_admit(&bdaddr))
+			ble_parse_adv(&bdaddr, buf + offset, adlen);
+		offset += adlen;
+	}
+}
+
 static void ble_socket_parse(const uint8_t *buf, int len)
 {
+	bdaddr_t gateway;
 	bdaddr_t bdaddr;
+	int rssi;
+	int opt;
 	uint8_t version;
 	uint8_t flags;
 	uint16_t mfg_id;
@@ -103,6 +406,21 @@ static void ble_socket_parse(const uint8_t *buf, int len)
 
 		if (len < offset)
 			return;
+
+		if (!ble_socket_admit(&bdaddr))
+			return;
+
+		/* Look ahead for the link details, used to pick a gateway */
+		bacpy(&gateway, BDADDR_ANY);
+		rssi = BLE_RSSI_INVALID;
+		opt  = offset;
+		if ((flags & BLE_SOCKET_FLAG_RSSI) && len > opt)
+			rssi = (int8_t)buf[opt++];
+		if ((flags & BLE_SOCKET_FLAG_REPEATER) && len >= opt + 6)
+			memcpy(&gateway, buf + opt, 6);
+
+		ble_set_origin(DATA_SOURCE_GATEWAY, ble_socket_gateway(&gateway),
+			       rssi, 0);
 		ble_handle_mfg(&bdaddr, mfg_id, payload, payload_len, DATA_SOURCE_GATEWAY);
 
 		if (flags & BLE_SOCKET_FLAG_RSSI) {
@@ -140,36 +458,270 @@ static void ble_socket_parse(const uint8_t *buf, int len)
 		if (len < BLE_SOCKET_MIN_SIZE_V2) {
 			return;
 		}
+		memcpy(&gateway, buf + 1, 6);
 		memcpy(&bdaddr, buf + 7, 6);
 		payload_len = len - 14;
 		payload	    = buf + 14;
 
+		if (!ble_socket_admit(&bdaddr))
+			return;
+
+		ble_set_origin(DATA_SOURCE_GATEWAY, ble_socket_gateway(&gateway),
+			       (int8_t)buf[13], 0);
+
 		ble_parse_adv(&bdaddr, payload, payload_len);
+	} else if (version == 3) {
+		ble_socket_parse_v3(buf, len);
 	}
 
 
 	return;
 }
 
-static void ble_socket_read(evutil_socket_t fd, short events, void *arg)
+static void on_socket_msg(struct ingest_source *src, const struct ingest_msg *msg)
 {
-	uint8_t buf[BLE_SOCKET_MAX_PACKET];
-	struct sockaddr_in src;
-	socklen_t srclen = sizeof(src);
-	int len;
-
-	len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&src, &srclen);
-	if (len < 0) {
-		if (errno != EAGAIN)
-			perror("socket recvfrom");
+	if (msg->len < 0) {
+		fprintf(stderr, "socket recv: %s\n", strerror(-msg->len));
+		return;
+	}
+
+	now_ms	 = msg->time / 1000;
+	shedding = ble_ingest_overloaded();
+
+	/* A gateway over its budget only gets enabled devices through */
+	if (!ble_socket_admit_gateway(msg)) {
+		shed_gateway++;
+		shedding = 1;
+	}
+
+	/* Answered through the socket it came in on */
+	if (msg->len > 0 && msg->buf[0] == BLE_FEEDBACK_SUBSCRIBE) {
+		if (msg->addrlen)
+			ble_feedback_subscribe(ble_sock.sock, (const struct sockaddr *)&msg->addr,
+					       msg->addrlen, msg->buf, msg->len);
 		return;
 	}
 
-	ble_socket_parse(buf, len);
+	/* Only hosts that sent gateway data may subscribe */
+	if (msg->len > 0 && msg->buf[0] >= 1 && msg->buf[0] <= 3)
+		ble_feedback_source((const struct sockaddr *)&msg->addr,
+				    msg->addrlen);
+
+	ble_socket_set_sender(msg);
+	ble_socket_parse(msg->buf, msg->len);
+}
+
+/* Statistics published below Socket/Local/<n>, created once per slot */
+enum local_stat {
+	LOCAL_STAT_PID,
+	LOCAL_STAT_UID,
+	LOCAL_STAT_NAME,
+	LOCAL_STAT_PACKETS,
+	LOCAL_STAT_BYTES,
+	LOCAL_STAT_NUM,
+};
+
+static const char *const local_stat_names[LOCAL_STAT_NUM] = {
+	"Pid", "Uid", "Name", "Packets", "Bytes",
+};
+
+static struct VeItem *local_stats[BLE_SOCKET_MAX_LOCAL][LOCAL_STAT_NUM];
+
+static void ble_local_publish(int n)
+{
+	struct ble_local_conn *conn = &ble_local.conns[n];
+	struct VeItem **stats = local_stats[n];
+	char path[32];
+	int i;
+
+	for (i = 0; i < LOCAL_STAT_NUM && !stats[i]; i++) {
+		snprintf(path, sizeof(path), "Socket/Local/%d/%s", n,
+			 local_stat_names[i]);
+		if (i == LOCAL_STAT_NAME)
+			stats[i] = ble_dbus_create_str(get_control(), path, "");
+		else
+			stats[i] = ble_dbus_create_int(get_control(), path, 0);
+	}
+
+	ble_dbus_item_set_int(stats[LOCAL_STAT_PID], conn->cred.pid);
+	ble_dbus_item_set_int(stats[LOCAL_STAT_UID], conn->cred.uid);
+	ble_dbus_item_set_str(stats[LOCAL_STAT_NAME], conn->name);
+	ble_dbus_item_set_int(stats[LOCAL_STAT_PACKETS], conn->packets);
+	ble_dbus_item_set_int(stats[LOCAL_STAT_BYTES], conn->bytes);
+}
+
+static void ble_local_unpublish(int n)
+{
+	int i;
+
+	for (i = 0; i < LOCAL_STAT_NUM; i++)
+		if (local_stats[n][i])
+			veItemInvalidate(local_stats[n][i]);
+}
+
+static void ble_local_disconnect(struct ble_local_conn *conn)
+{
+	int n = conn - ble_local.conns;
+
+	fprintf(stderr, "Local forwarder %s (pid %d) disconnected\n",
+		conn->name, conn->cred.pid);
+
+	ble_feedback_detach(conn->sock);
+	ble_ingest_remove(&conn->src);
+	close(conn->sock);
+	conn->sock = -1;
+
+	ble_local_unpublish(n);
+}
+
+static int ble_local_read(struct ingest_source *src, struct ingest_msg *msg)
+{
+	/* MSG_TRUNC reports the full length of an oversized packet */
+	return recv(src->fd, msg->buf, sizeof(msg->buf),
+		    MSG_DONTWAIT | MSG_TRUNC);
+}
+
+static void on_local_msg(struct ingest_source *src, const struct ingest_msg *msg)
+{
+	struct ble_local_conn *conn = src->ctx;
+
+	if (msg->len <= 0) {
+		if (msg->len < 0)
+			fprintf(stderr, "local recv: %s\n", strerror(-msg->len));
+		ble_local_disconnect(conn);
+		return;
+	}
+
+	conn->packets++;
+	conn->bytes += msg->len;
+
+	/* Local forwarders are held back by the ring instead of rate limited */
+	now_ms	 = msg->time / 1000;
+	shedding = ble_ingest_overloaded();
+
+	if (msg->buf[0] == BLE_FEEDBACK_SUBSCRIBE) {
+		ble_feedback_subscribe(conn->sock, NULL, 0, msg->buf, msg->len);
+		return;
+	}
+
+	ble_local_set_sender(conn - ble_local.conns);
+	ble_socket_parse(msg->buf, msg->len);
+}
+
+static void ble_local_name(struct ble_local_conn *conn)
+{
+	char path[32];
+	ssize_t len;
+	int fd;
+
+	snprintf(conn->name, sizeof(conn->name), "%d", conn->cred.pid);
+	snprintf(path, sizeof(path), "/proc/%d/comm", conn->cred.pid);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	len = read(fd, conn->name, sizeof(conn->name) - 1);
+	if (len > 0 && conn->name[len - 1] == '\n')
+		len--;
+	if (len > 0)
+		conn->name[len] = 0;
+	else
+		snprintf(conn->name, sizeof(conn->name), "%d", conn->cred.pid);
+
+	close(fd);
+}
+
+static void on_local_accept(evutil_socket_t fd, short events, void *ctx)
+{
+	struct ble_local_conn *conn = NULL;
+	socklen_t len;
+	uint32_t gen;
+	int sock;
+	int n;
+
+	sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (sock < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("local accept");
+		return;
+	}
+
+	for (n = 0; n < BLE_SOCKET_MAX_LOCAL; n++) {
+		if (ble_local.conns[n].sock < 0) {
+			conn = &ble_local.conns[n];
+			break;
+		}
+	}
+
+	if (!conn) {
+		fprintf(stderr, "too many local forwarders\n");
+		close(sock);
+		return;
+	}
+
+	/* Messages of the slot's previous connection may still be queued */
+	gen = conn->src.gen;
+	memset(conn, 0, sizeof(*conn));
+	conn->src.gen = gen;
+
+	len = sizeof(conn->cred);
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &conn->cred, &len) < 0) {
+		perror("SO_PEERCRED");
+		close(sock);
+		conn->sock = -1;
+		return;
+	}
+
+	ble_local_name(conn);
+
+	/* Hold the forwarder back instead of dropping when the ring is full */
+	conn->src.fd = sock;
+	conn->src.read = ble_local_read;
+	conn->src.handle = on_local_msg;
+	conn->src.ctx = conn;
+	conn->src.backpressure = 1;
+
+	if (ble_ingest_add(&conn->src) < 0) {
+		close(sock);
+		conn->sock = -1;
+		return;
+	}
+
+	conn->sock = sock;
+
+	fprintf(stderr, "Local forwarder %s (pid %d, uid %d) connected\n",
+		conn->name, conn->cred.pid, conn->cred.uid);
+
+	ble_local_publish(n);
+}
+
+static void ble_local_stop(void)
+{
+	int i;
+
+	for (i = 0; i < BLE_SOCKET_MAX_LOCAL; i++)
+		if (ble_local.conns[i].sock >= 0)
+			ble_local_disconnect(&ble_local.conns[i]);
+
+	ble_unix_close(&ble_local.listener);
+}
+
+static void ble_local_open(void)
+{
+	const char *path = ble_unix_path("Socket/LocalPath");
+
+	if (ble_unix_listening(&ble_local.listener, path))
+		return;
+
+	ble_local_stop();
+	ble_unix_listen(&ble_local.listener, path, BLE_SOCKET_MAX_LOCAL,
+			on_local_accept);
 }
 
 static int ble_socket_start(const char *bind_addr, int port)
 {
+	int flags;
 	int sock;
 	int err;
 
@@ -205,14 +757,27 @@ static int ble_socket_start(const char *bind_addr, int port)
 		return -1;
 	}
 
-	ble_sock.ev = event_new(pltGetLibEventBase(), sock, EV_READ | EV_PERSIST, ble_socket_read, NULL);
-	if (!ble_sock.ev) {
-		fprintf(stderr, "event_new failed\n");
+	if (ble_filter_attach(sock, BLE_FILTER_SOCKET) < 0)
+		fprintf(stderr, "no socket filter\n");
+
+	/* Drained on the ingest thread, which needs it non-blocking */
+	flags = fcntl(sock, F_GETFL);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		ble_filter_detach(sock);
+		close(sock);
+		return -1;
+	}
+
+	ble_sock.src.fd = sock;
+	ble_sock.src.handle = on_socket_msg;
+
+	if (ble_ingest_add(&ble_sock.src) < 0) {
+		ble_filter_detach(sock);
 		close(sock);
 		return -1;
 	}
 
-	event_add(ble_sock.ev, NULL);
 	ble_sock.sock = sock;
 
 	fprintf(stderr, "Socket enabled. Listening on %s:%d\n", bind_addr, port);
@@ -240,6 +805,7 @@ void ble_socket_open(void)
 		ble_socket_stop();
 
 	ble_socket_start(bind_addr, port);
+	ble_local_open();
 }
 
 static void on_socket_setting_changed(struct VeItem *item)
@@ -247,11 +813,35 @@ static void on_socket_setting_changed(struct VeItem *item)
 	ble_socket_open();
 }
 
+static void on_local_path_changed(struct VeItem *item)
+{
+	ble_local_open();
+}
+
+static void on_rate_limit_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		rate_limit = val.value.SN32;
+}
+
+static void on_adv_rate_limit_changed(struct VeItem *item)
+{
+	VeVariant val;
+
+	veItemLocalValue(item, &val);
+	if (veVariantIsValid(&val))
+		adv_rate_limit = val.value.SN32;
+}
+
 int ble_socket_init(void)
 {
 	struct VeItem *settings = get_settings();
 	struct VeItem *ctl	= get_control();
 	struct VeItem *item;
+	int i;
 
 	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Socket/Port",
 					     veVariantFmt, &veUnitNone, &port_props);
@@ -261,10 +851,51 @@ int ble_socket_init(void)
 					     veVariantFmt, &veUnitNone, &bind_props);
 	veItemSetChanged(item, on_socket_setting_changed);
 
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Socket/LocalPath",
+					     veVariantFmt, &veUnitNone, &local_path_props);
+	veItemSetChanged(item, on_local_path_changed);
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Socket/RateLimit",
+					     veVariantFmt, &veUnitNone, &rate_limit_props);
+	veItemSetChanged(item, on_rate_limit_changed);
+	on_rate_limit_changed(item);
+
+	item = veItemCreateSettingsProxySync(settings, "Settings/BleSensors", ctl, "Socket/AdvRateLimit",
+					     veVariantFmt, &veUnitNone, &adv_rate_limit_props);
+	veItemSetChanged(item, on_adv_rate_limit_changed);
+	on_adv_rate_limit_changed(item);
+
+	shed_gateway_item = ble_dbus_create_int(ctl, "Socket/Shed/GatewayRate", 0);
+	shed_adv_item = ble_dbus_create_int(ctl, "Socket/Shed/AdvRate", 0);
+	shed_overload_item = ble_dbus_create_int(ctl, "Socket/Shed/Overload", 0);
+
+	for (i = 0; i < BLE_SOCKET_MAX_LOCAL; i++)
+		ble_local.conns[i].sock = -1;
+
 	return 0;
 }
 
 void ble_socket_close(void)
 {
 	ble_socket_stop();
+	ble_local_stop();
+}
+
+void ble_socket_tick(void)
+{
+	static uint32_t ticks = 10 * TICKS_PER_SEC;
+	int i;
+
+	if (--ticks)
+		return;
+
+	ticks = 10 * TICKS_PER_SEC;
+
+	ble_dbus_item_set_int(shed_gateway_item, shed_gateway);
+	ble_dbus_item_set_int(shed_adv_item, shed_adv);
+	ble_dbus_item_set_int(shed_overload_item, shed_overload);
+
+	for (i = 0; i < BLE_SOCKET_MAX_LOCAL; i++)
+		if (ble_local.conns[i].sock >= 0)
+			ble_local_publish(i);
 }
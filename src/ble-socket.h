@@ -15,5 +15,6 @@
 int ble_socket_init(void);
 void ble_socket_open(void);
 void ble_socket_close(void);
+void ble_socket_tick(void);
 
 #endif
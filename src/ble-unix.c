@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <event2/event.h>
+
+#include <velib/platform/plt.h>
+#include <velib/types/ve_item.h>
+#include <velib/utils/ve_item_utils.h>
+
+#include "ble-unix.h"
+#include "task.h"
+
+/* The current value of the path setting @uid, empty if unset */
+const char *ble_unix_path(const char *uid)
+{
+	struct VeItem *item = veItemByUid(get_control(), uid);
+	VeVariant val;
+
+	if (!item || !veItemIsValid(item))
+		return "";
+
+	veItemLocalValue(item, &val);
+
+	return val.value.Ptr;
+}
+
+int ble_unix_listening(const struct ble_unix *l, const char *path)
+{
+	return l->sock >= 0 && !strcmp(path, l->addr.sun_path);
+}
+
+/*
+ * The path comes from a setting any D-Bus client can write, so only
+ * ever remove a socket, such as a stale one left by an earlier run.
+ */
+static void ble_unix_unlink(const char *path)
+{
+	struct stat st;
+
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+}
+
+/*
+ * Listens on @path, an empty path disables the listener. The socket
+ * keeps the default mode, so only root can connect.
+ */
+int ble_unix_listen(struct ble_unix *l, const char *path, int backlog,
+		    event_callback_fn on_accept)
+{
+	int sock;
+
+	if (!path || !strlen(path))
+		return 0;
+
+	if (strlen(path) >= sizeof(l->addr.sun_path)) {
+		fprintf(stderr, "%s path too long: %s\n", l->name, path);
+		return -1;
+	}
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		fprintf(stderr, "%s socket: %s\n", l->name, strerror(errno));
+		return -1;
+	}
+
+	memset(&l->addr, 0, sizeof(l->addr));
+	l->addr.sun_family = AF_UNIX;
+	strcpy(l->addr.sun_path, path);
+
+	ble_unix_unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&l->addr, sizeof(l->addr)) < 0) {
+		fprintf(stderr, "%s bind: %s\n", l->name, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	if (listen(sock, backlog) < 0) {
+		fprintf(stderr, "%s listen: %s\n", l->name, strerror(errno));
+		goto err;
+	}
+
+	l->ev = event_new(pltGetLibEventBase(), sock, EV_READ | EV_PERSIST,
+			  on_accept, NULL);
+	if (!l->ev) {
+		perror("event_new");
+		goto err;
+	}
+
+	if (event_add(l->ev, NULL) < 0) {
+		perror("event_add");
+		event_free(l->ev);
+		l->ev = NULL;
+		goto err;
+	}
+
+	l->sock = sock;
+
+	fprintf(stderr, "%s enabled on %s\n", l->name, path);
+	return 0;
+
+err:
+	close(sock);
+	ble_unix_unlink(path);
+	return -1;
+}
+
+void ble_unix_close(struct ble_unix *l)
+{
+	if (l->sock < 0)
+		return;
+
+	event_free(l->ev);
+	l->ev = NULL;
+	close(l->sock);
+	ble_unix_unlink(l->addr.sun_path);
+	l->sock = -1;
+}
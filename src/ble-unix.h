@@ -0,0 +1,21 @@
+#ifndef BLE_UNIX_H
+#define BLE_UNIX_H
+
+#include <sys/un.h>
+#include <event2/event.h>
+
+/* A SOCK_SEQPACKET listener on a unix socket whose path is a setting */
+struct ble_unix {
+	int sock;
+	struct event *ev;
+	struct sockaddr_un addr;
+	const char *name;
+};
+
+const char *ble_unix_path(const char *uid);
+int ble_unix_listening(const struct ble_unix *l, const char *path);
+int ble_unix_listen(struct ble_unix *l, const char *path, int backlog,
+		    event_callback_fn on_accept);
+void ble_unix_close(struct ble_unix *l);
+
+#endif
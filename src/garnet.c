@@ -35,7 +35,7 @@
  *   11   : Battery V * 10 (14.1V => 141)
  */
 
-static int garnet_level(struct VeItem *root, VeVariant *val, uint64_t rawval)
+static int garnet_level(const struct reg_ctx *ctx, VeVariant *val, uint64_t rawval)
 {
 	if (rawval > 100)
 		return -1;
@@ -139,7 +139,6 @@ int garnet_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 {
 	struct VeItem *droot;
 	char name[32];
-	char dev[20];
 	int serial;
 	int i;
 
@@ -152,14 +151,11 @@ int garnet_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 		if (buf[3 + i] == GARNET_709_DISABLED)
 			continue;
 
-		snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x_%d",
-			 addr->b[5], addr->b[4], addr->b[3],
-			 addr->b[2], addr->b[1], addr->b[0], i);
 		snprintf(name, sizeof(name), "SeeLeveL %d %s", serial,
 			 garnet_names[i]);
 
-		droot = ble_dbus_create(dev, &garnet_sensor[i],
-					&garnet_tank_info[i]);
+		droot = ble_dbus_create_addr(addr, i, &garnet_sensor[i],
+					     &garnet_tank_info[i]);
 		if (!droot)
 			return -1;
 
@@ -171,6 +167,9 @@ int garnet_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 		if (ble_dbus_check_dup(droot, source))
 			continue;
 
+		if (ble_dbus_check_unchanged(droot, buf, len))
+			continue;
+
 		ble_dbus_set_regs(droot, buf, len);
 		ble_dbus_update(droot);
 	}
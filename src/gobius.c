@@ -22,7 +22,7 @@ static const struct tank_info gobius_tank_info = {
 #define GOBIUS_ERROR	0xffff
 #define GOBIUS_STARTUP	0xfffe
 
-static int gobius_level(struct VeItem *root, VeVariant *val, uint64_t rawval)
+static int gobius_level(const struct reg_ctx *ctx, VeVariant *val, uint64_t rawval)
 {
 	switch (rawval) {
 	case GOBIUS_STARTUP:
@@ -87,7 +87,6 @@ int gobius_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	struct VeItem *root;
 	const uint8_t *uid;
 	char name[24];
-	char dev[16];
 	char fw[16];
 
 	/* Expect 14-byte payload after Company ID */
@@ -101,11 +100,7 @@ int gobius_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	    uid[2] != addr->b[0])
 		return -1;
 
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x",
-		 addr->b[5], addr->b[4], addr->b[3],
-		 addr->b[2], addr->b[1], addr->b[0]);
-
-	root = ble_dbus_create(dev, &gobius_sensor, &gobius_tank_info);
+	root = ble_dbus_create_addr(addr, -1, &gobius_sensor, &gobius_tank_info);
 	if (!root)
 		return -1;
 
@@ -119,6 +114,9 @@ int gobius_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	if (ble_dbus_check_dup(root, source))
 		return 0;
 
+	if (ble_dbus_check_unchanged(root, buf, len))
+		return 0;
+
 	/* Firmware version at payload offsets 7..9 */
 	snprintf(fw, sizeof(fw), "%u.%u.%u", buf[8], buf[8], buf[9]);
 	ble_dbus_set_str(root, "FirmwareVersion", fw);
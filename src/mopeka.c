@@ -28,6 +28,25 @@ struct mopeka_model {
 
 #define MOPEKA_FLAG_BUTANE	(1 << 0)
 
+/* Registers of mopeka_adv, xlate callbacks refer to them by index */
+enum {
+	MOPEKA_HWID,
+	MOPEKA_LEVEL_EXT,
+	MOPEKA_BATTERY,
+	MOPEKA_TEMPERATURE,
+	MOPEKA_SYNC_BUTTON,
+	MOPEKA_RAW_VALUE,
+	MOPEKA_QUALITY,
+	MOPEKA_ACCEL_X,
+	MOPEKA_ACCEL_Y,
+};
+
+/* Settings the level depends on, found once at init */
+struct mopeka_data {
+	struct VeItem	*fluid_type;
+	struct VeItem	*butane_ratio;
+};
+
 static struct VeSettingProperties butane_props = {
 	.type			= VE_SN32,
 	.def.value.SN32		= 0,
@@ -45,12 +64,16 @@ static const struct dev_setting mopeka_lpg_settings[] = {
 static int mopeka_init(struct VeItem *root, const void *data)
 {
 	const struct mopeka_model *model = data;
+	struct mopeka_data *md = ble_dbus_get_pdata(root);
 
 	if (model->flags & MOPEKA_FLAG_BUTANE) {
 		ble_dbus_add_settings(root, mopeka_lpg_settings,
 				      array_size(mopeka_lpg_settings));
+		md->butane_ratio = veItemByUid(root, "ButaneRatio");
 	}
 
+	md->fluid_type = veItemByUid(root, "FluidType");
+
 	return 0;
 }
 
@@ -147,26 +170,29 @@ static const struct mopeka_model *mopeka_get_model(uint32_t hwid)
 	return NULL;
 }
 
-static float mopeka_scale_butane(struct VeItem *root, int temp)
+static float mopeka_scale_butane(const struct mopeka_data *md, int temp)
 {
-	float r = veItemValueInt(root, "ButaneRatio") / 100.0;
+	float r = md->butane_ratio ? ble_dbus_item_int(md->butane_ratio) / 100.0 : 0;
 
 	return mopeka_coefs_butane[0] * r + mopeka_coefs_butane[1] * r * temp;
 }
 
-static int mopeka_xlate_level(struct VeItem *root, VeVariant *val, uint64_t rv)
+static int mopeka_xlate_level(const struct reg_ctx *ctx, VeVariant *val, uint64_t rv)
 {
+	const struct mopeka_data *md = ble_dbus_get_pdata(ble_dbus_reg_root(ctx));
 	const struct mopeka_model *model;
 	const float *coefs;
 	float scale = 0;
 	float level;
-	int hwid;
-	int temp;
-	int tank_level_ext;
-
-	hwid = veItemValueInt(root, "HardwareID");
-	temp = veItemValueInt(root, "Temperature");
-	temp += 40;
+	uint64_t hwid;
+	uint64_t temp;
+	uint64_t tank_level_ext;
+
+	/* Temperature in degrees above -40, as sent */
+	if (ble_dbus_reg_raw(ctx, MOPEKA_HWID, &hwid) ||
+	    ble_dbus_reg_raw(ctx, MOPEKA_TEMPERATURE, &temp) ||
+	    ble_dbus_reg_raw(ctx, MOPEKA_LEVEL_EXT, &tank_level_ext))
+		return -1;
 
 	/*
 	  Check for presence of extension bit on certain hardware/firmware.
@@ -177,7 +203,6 @@ static int mopeka_xlate_level(struct VeItem *root, VeVariant *val, uint64_t rv)
 	  versions add the range 16384 us to 81916 us with 4 us
 	  resolution.
 	*/
-	tank_level_ext = veItemValueInt(root, "TankLevelExtension");
 	if (tank_level_ext)
 		rv = 16384 + 4 * rv;
 
@@ -188,7 +213,7 @@ static int mopeka_xlate_level(struct VeItem *root, VeVariant *val, uint64_t rv)
 	coefs = model->coefs;
 
 	if (!coefs) {
-		int fluid_type = veItemValueInt(root, "FluidType");
+		int fluid_type = md->fluid_type ? ble_dbus_item_int(md->fluid_type) : -1;
 
 		switch (fluid_type) {
 		case FLUID_TYPE_FRESH_WATER:
@@ -211,7 +236,7 @@ static int mopeka_xlate_level(struct VeItem *root, VeVariant *val, uint64_t rv)
 	}
 
 	if (coefs == mopeka_coefs_lpg)
-		scale = mopeka_scale_butane(root, temp);
+		scale = mopeka_scale_butane(md, temp);
 
 	scale += coefs[0] + coefs[1] * temp + coefs[2] * temp * temp;
 	level = rv * scale;
@@ -221,14 +246,14 @@ static int mopeka_xlate_level(struct VeItem *root, VeVariant *val, uint64_t rv)
 }
 
 static const struct reg_info mopeka_adv[] = {
-	{
+	[MOPEKA_HWID] = {
 		.type	= VE_UN8,
 		.offset	= 0,
 		.bits	= 7,
 		.name	= "HardwareID",
 		.format	= &veUnitNone,
 	},
-	{
+	[MOPEKA_LEVEL_EXT] = {
 		.type	= VE_UN8,
 		.offset	= 0,
 		.shift	= 7,
@@ -236,7 +261,7 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "TankLevelExtension",
 		.format	= &veUnitNone,
 	},
-	{
+	[MOPEKA_BATTERY] = {
 		.type	= VE_UN8,
 		.offset	= 1,
 		.bits	= 7,
@@ -244,7 +269,7 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "BatteryVoltage",
 		.format = &veUnitVolt2Dec,
 	},
-	{
+	[MOPEKA_TEMPERATURE] = {
 		.type	= VE_UN8,
 		.offset	= 2,
 		.bits	= 7,
@@ -253,7 +278,7 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "Temperature",
 		.format	= &veUnitCelsius1Dec,
 	},
-	{
+	[MOPEKA_SYNC_BUTTON] = {
 		.type	= VE_UN8,
 		.offset	= 2,
 		.shift	= 7,
@@ -261,7 +286,7 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "SyncButton",
 		.format = &veUnitNone,
 	},
-	{
+	[MOPEKA_RAW_VALUE] = {
 		.type	= VE_UN16,
 		.offset	= 3,
 		.bits	= 14,
@@ -269,7 +294,7 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "RawValue",
 		.format	= &veUnitcm,
 	},
-	{
+	[MOPEKA_QUALITY] = {
 		.type	= VE_UN8,
 		.offset	= 4,
 		.shift	= 6,
@@ -277,14 +302,14 @@ static const struct reg_info mopeka_adv[] = {
 		.name	= "Quality",
 		.format	= &veUnitNone,
 	},
-	{
+	[MOPEKA_ACCEL_X] = {
 		.type	= VE_SN8,
 		.offset	= 8,
 		.scale	= 1024,
 		.name	= "AccelX",
 		.format	= &veUnitG2Dec,
 	},
-	{
+	[MOPEKA_ACCEL_Y] = {
 		.type	= VE_SN8,
 		.offset	= 9,
 		.scale	= 1024,
@@ -300,6 +325,7 @@ static const struct dev_info mopeka_sensor = {
 	.dev_prefix	= "mopeka_",
 	.num_regs	= array_size(mopeka_adv),
 	.regs		= mopeka_adv,
+	.pdata_size	= sizeof(struct mopeka_data),
 	.init		= mopeka_init,
 };
 
@@ -309,7 +335,6 @@ int mopeka_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	const uint8_t *uid = buf + 5;
 	const struct mopeka_model *model;
 	char name[24];
-	char dev[16];
 	int hwid;
 
 	if (len != 10)
@@ -326,11 +351,7 @@ int mopeka_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	if (!model)
 		return -1;
 
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x",
-		 addr->b[5], addr->b[4], addr->b[3],
-		 addr->b[2], addr->b[1], addr->b[0]);
-
-	root = ble_dbus_create(dev, &mopeka_sensor, model);
+	root = ble_dbus_create_addr(addr, -1, &mopeka_sensor, model);
 	if (!root)
 		return -1;
 
@@ -344,6 +365,9 @@ int mopeka_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum da
 	if (!ble_dbus_is_enabled(root))
 		return 0;
 
+	if (ble_dbus_check_unchanged(root, buf, len))
+		return 0;
+
 	ble_dbus_set_regs(root, buf, len);
 	ble_dbus_update(root);
 
@@ -1,7 +1,13 @@
 SRCS += ble-dbus.c
+SRCS += ble-feedback.c
+SRCS += ble-filter.c
 SRCS += ble-handler.c
+SRCS += ble-ingest.c
+SRCS += ble-regs.c
 SRCS += ble-scan.c
+SRCS += ble-shm.c
 SRCS += ble-socket.c
+SRCS += ble-unix.c
 SRCS += task.c
 
 SRCS += tank.c
@@ -141,13 +141,27 @@ static const struct dev_info ruuvi_tag = {
 	.seqnr_window	= 100,
 };
 
-static int ruuvi_xlate_9bit(struct VeItem *root, VeVariant *val, uint64_t rv,
+/* Registers of format 6, xlate callbacks refer to them by index */
+enum {
+	RUUVI6_TEMPERATURE,
+	RUUVI6_HUMIDITY,
+	RUUVI6_PRESSURE,
+	RUUVI6_PM25,
+	RUUVI6_CO2,
+	RUUVI6_FLAGS,
+	RUUVI6_VOC,
+	RUUVI6_NOX,
+	RUUVI6_LUMINOSITY,
+	RUUVI6_SEQNO,
+};
+
+static int ruuvi_xlate_9bit(const struct reg_ctx *ctx, VeVariant *val, uint64_t rv,
 			    int flag_bit)
 {
-	uint32_t flags = veItemValueInt(root, "Flags");
+	uint64_t flags;
 	uint32_t value;
 
-	if (flags > 255)
+	if (ble_dbus_reg_raw(ctx, RUUVI6_FLAGS, &flags))
 		return -1;
 
 	value = (rv << 1) | ((flags >> flag_bit) & 1);
@@ -160,17 +174,17 @@ static int ruuvi_xlate_9bit(struct VeItem *root, VeVariant *val, uint64_t rv,
 	return 0;
 }
 
-static int ruuvi_xlate_voc(struct VeItem *root, VeVariant *val, uint64_t rv)
+static int ruuvi_xlate_voc(const struct reg_ctx *ctx, VeVariant *val, uint64_t rv)
 {
-	return ruuvi_xlate_9bit(root, val, rv, 6);
+	return ruuvi_xlate_9bit(ctx, val, rv, 6);
 }
 
-static int ruuvi_xlate_nox(struct VeItem *root, VeVariant *val, uint64_t rv)
+static int ruuvi_xlate_nox(const struct reg_ctx *ctx, VeVariant *val, uint64_t rv)
 {
-	return ruuvi_xlate_9bit(root, val, rv, 7);
+	return ruuvi_xlate_9bit(ctx, val, rv, 7);
 }
 
-static int ruuvi_xlate_lum(struct VeItem *root, VeVariant *val, uint64_t rv)
+static int ruuvi_xlate_lum(const struct reg_ctx *ctx, VeVariant *val, uint64_t rv)
 {
 	float scale = 16 / M_LOG2E / 254;
 	float lux = expf((uint8_t)rv * scale) - 1;
@@ -182,7 +196,7 @@ static int ruuvi_xlate_lum(struct VeItem *root, VeVariant *val, uint64_t rv)
 
 /* Format 6 (Bluetooth 4 compatible) */
 static const struct reg_info ruuvi_format6[] = {
-	{
+	[RUUVI6_TEMPERATURE] = {
 		.type	= VE_SN16,
 		.offset	= 1,
 		.scale	= 200,
@@ -191,7 +205,7 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "Temperature",
 		.format	= &veUnitCelsius1Dec,
 	},
-	{
+	[RUUVI6_HUMIDITY] = {
 		.type	= VE_UN16,
 		.offset	= 3,
 		.scale	= 400,
@@ -200,7 +214,7 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "Humidity",
 		.format	= &veUnitPercentage,
 	},
-	{
+	[RUUVI6_PRESSURE] = {
 		.type	= VE_UN16,
 		.offset	= 5,
 		.scale	= 100,
@@ -210,7 +224,7 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "Pressure",
 		.format	= &veUnitHectoPascal,
 	},
-	{
+	[RUUVI6_PM25] = {
 		.type	= VE_UN16,
 		.offset	= 7,
 		.scale	= 10,
@@ -219,7 +233,7 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "PM25",
 		.format	= &veUnitUgM3,
 	},
-	{
+	[RUUVI6_CO2] = {
 		.type	= VE_UN16,
 		.offset	= 9,
 		.inval	= 0xffff,
@@ -227,27 +241,27 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "CO2",
 		.format	= &veUnitPPM,
 	},
-	{
+	[RUUVI6_FLAGS] = {
 		.type	= VE_UN8,
 		.offset	= 16,
 		.name	= "Flags",
 		.format	= &veUnitNone,
 	},
-	{
+	[RUUVI6_VOC] = {
 		.type	= VE_UN8,
 		.offset	= 11,
 		.xlate	= ruuvi_xlate_voc,
 		.name	= "VOC",
 		.format	= &veUnitIndex,
 	},
-	{
+	[RUUVI6_NOX] = {
 		.type	= VE_UN8,
 		.offset	= 12,
 		.xlate	= ruuvi_xlate_nox,
 		.name	= "NOX",
 		.format	= &veUnitIndex,
 	},
-	{
+	[RUUVI6_LUMINOSITY] = {
 		.type	= VE_UN8,
 		.offset	= 13,
 		.inval	= 0xff,
@@ -256,7 +270,7 @@ static const struct reg_info ruuvi_format6[] = {
 		.name	= "Luminosity",
 		.format	= &veUnitLux,
 	},
-	{
+	[RUUVI6_SEQNO] = {
 		.type	= VE_UN8,
 		.offset	= 15,
 		.name	= "SeqNo",
@@ -281,7 +295,6 @@ int ruuvi_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum dat
 	const struct dev_info *info;
 	struct VeItem *root;
 	char name[16];
-	char dev[16];
 	char *label;
 	uint16_t seqno;
 
@@ -311,10 +324,7 @@ int ruuvi_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum dat
 		return -1;
 	}
 
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x",
-		 mac[5], mac[4], mac[3], mac[2], mac[1], mac[0]);
-
-	root = ble_dbus_create(dev, info, NULL);
+	root = ble_dbus_create_addr(addr, -1, info, NULL);
 	if (!root)
 		return -1;
 
@@ -327,6 +337,9 @@ int ruuvi_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum dat
 	if (!ble_dbus_is_enabled(root))
 		return 0;
 
+	if (ble_dbus_check_unchanged(root, buf, len))
+		return 0;
+
 	ble_dbus_set_regs(root, buf, len);
 	ble_dbus_update(root);
 
@@ -92,7 +92,6 @@ int safiery_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	struct VeItem *root;
 	const uint8_t *uid = buf + 5;
 	char name[24];
-	char dev[16];
 
 	if (len != 10)
 		return -1;
@@ -102,11 +101,7 @@ int safiery_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	    uid[2] != addr->b[0])
 		return -1;
 
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x",
-		 addr->b[5], addr->b[4], addr->b[3],
-		 addr->b[2], addr->b[1], addr->b[0]);
-
-	root = ble_dbus_create(dev, &safiery_sensor, &safiery_tank_info);
+	root = ble_dbus_create_addr(addr, -1, &safiery_sensor, &safiery_tank_info);
 	if (!root)
 		return -1;
 
@@ -120,6 +115,9 @@ int safiery_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	if (!ble_dbus_is_enabled(root))
 		return 0;
 
+	if (ble_dbus_check_unchanged(root, buf, len))
+		return 0;
+
 	ble_dbus_set_regs(root, buf, len);
 	ble_dbus_update(root);
 
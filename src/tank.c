@@ -10,6 +10,13 @@
 struct tank_data {
 	int		shape_map_len;
 	float		shape_map[TANK_SHAPE_MAX_POINTS + 2][2];
+	struct VeItem	*raw_value;
+	struct VeItem	*capacity;
+	struct VeItem	*raw_empty;
+	struct VeItem	*raw_full;
+	struct VeItem	*remaining;
+	struct VeItem	*level;
+	struct VeItem	*status;
 };
 
 static void tank_setting_changed(struct VeItem *root, struct VeItem *setting,
@@ -142,6 +149,7 @@ static const struct alarm tank_alarms[] = {
 static void tank_init(struct VeItem *root, const void *data)
 {
 	const struct tank_info *ti = data;
+	struct tank_data *td = ble_dbus_get_cdata(root);
 	struct dev_setting fluid_type_setting;
 	struct VeSettingProperties fluid_type;
 	struct dev_setting raw_settings[2];
@@ -150,9 +158,12 @@ static void tank_init(struct VeItem *root, const void *data)
 	VeVariant v;
 
 	ble_dbus_create_item(root, "RawUnit", veVariantHeapStr(&v, ti->raw_unit ?: "cm"), &veUnitNone);
-	ble_dbus_create_item(root, "Remaining", veVariantInvalidType(&v, VE_FLOAT), &veUnitm3);
-	ble_dbus_create_item(root, "Level", veVariantInvalidType(&v, VE_FLOAT), &veUnitNone);
-	ble_dbus_create_item(root, "Status", veVariantInvalidType(&v, VE_UN32), &veUnitNone);
+	td->remaining = ble_dbus_create_item(root, "Remaining",
+					     veVariantInvalidType(&v, VE_FLOAT), &veUnitm3);
+	td->level = ble_dbus_create_item(root, "Level",
+					 veVariantInvalidType(&v, VE_FLOAT), &veUnitNone);
+	td->status = ble_dbus_create_item(root, "Status",
+					  veVariantInvalidType(&v, VE_UN32), &veUnitNone);
 
 	fluid_type = fluid_type_props;
 	fluid_type.def.value.SN32 = ti->default_fluid_type;
@@ -183,13 +194,18 @@ static void tank_init(struct VeItem *root, const void *data)
 	}
 
 	ble_dbus_add_settings(root, raw_settings, array_size(raw_settings));
+
+	td->raw_value = veItemByUid(root, "RawValue");
+	td->capacity = veItemByUid(root, "Capacity");
+	td->raw_empty = veItemByUid(root, "RawValueEmpty");
+	td->raw_full = veItemByUid(root, "RawValueFull");
 }
 
 static void tank_update(struct VeItem *root, const void *data)
 {
 	const struct tank_info *ti = data;
 	struct tank_data *td = ble_dbus_get_cdata(root);
-	struct VeItem *item;
+	VeVariant v;
 	float capacity;
 	float height;
 	float empty;
@@ -198,14 +214,17 @@ static void tank_update(struct VeItem *root, const void *data)
 	float remain;
 	int i;
 
-	item = veItemByUid(root, "RawValue");
-	if (!item || !veItemIsValid(item))
+	/* Not initialised yet */
+	if (!td->capacity)
+		return;
+
+	if (!td->raw_value || !veItemIsValid(td->raw_value))
 		goto out_inval;
 
-	capacity = veItemValueFloat(root, "Capacity");
-	height = veItemValueFloat(root, "RawValue");
-	empty = veItemValueFloat(root, "RawValueEmpty");
-	full = veItemValueFloat(root, "RawValueFull");
+	capacity = ble_dbus_item_float(td->capacity);
+	height = ble_dbus_item_float(td->raw_value);
+	empty = ble_dbus_item_float(td->raw_empty);
+	full = ble_dbus_item_float(td->raw_full);
 
 	if (ti->flags & TANK_FLAG_TOPDOWN) {
 		if (empty <= full)
@@ -235,16 +254,16 @@ static void tank_update(struct VeItem *root, const void *data)
 
 	remain = level * capacity;
 
-	ble_dbus_set_int(root, "Level", lrintf(100 * level));
-	ble_dbus_set_float(root, "Remaining", remain);
-	ble_dbus_set_int(root, "Status", STATUS_OK);
+	veItemOwnerSet(td->level, veVariantSn32(&v, lrintf(100 * level)));
+	veItemOwnerSet(td->remaining, veVariantFloat(&v, remain));
+	veItemOwnerSet(td->status, veVariantSn32(&v, STATUS_OK));
 
 	return;
 
 out_inval:
-	ble_dbus_set_invalid(root, "Level");
-	ble_dbus_set_invalid(root, "Remaining");
-	ble_dbus_set_int(root, "Status", 4);
+	veItemInvalidate(td->level);
+	veItemInvalidate(td->remaining);
+	veItemOwnerSet(td->status, veVariantSn32(&v, 4));
 }
 
 static void tank_setting_changed(struct VeItem *root, struct VeItem *setting,
@@ -20,7 +20,11 @@
 #include <velib/types/ve_values.h>
 
 #include "ble-dbus.h"
+#include "ble-feedback.h"
+#include "ble-filter.h"
+#include "ble-ingest.h"
 #include "ble-scan.h"
+#include "ble-shm.h"
 #include "ble-socket.h"
 #include "task.h"
 
@@ -155,8 +159,15 @@ void taskInit(void)
 
 	connect_dbus();
 	ble_dbus_init();
+
+	if (ble_ingest_init() < 0) {
+		fprintf(stderr, "failed to start ingest thread\n");
+		pltExit(1);
+	}
+
 	ble_scan_init();
 	ble_socket_init();
+	ble_shm_init();
 
 	sa.sa_handler = sighand;
 	sigaction(SIGINT, &sa, NULL);
@@ -169,9 +180,11 @@ void taskInit(void)
 	}
 
 	ble_socket_open();
+	ble_shm_open();
 
 	atexit(ble_scan_close);
 	atexit(ble_socket_close);
+	atexit(ble_shm_close);
 }
 
 void taskUpdate(void)
@@ -181,7 +194,12 @@ void taskUpdate(void)
 void taskTick(void)
 {
 	ble_dbus_tick();
+	ble_ingest_tick();
+	ble_socket_tick();
+	ble_shm_tick();
 	ble_scan_tick();
+	ble_filter_tick();
+	ble_feedback_tick();
 }
 
 char const *pltProgramVersion(void)
@@ -7,7 +7,7 @@
 #include <velib/utils/ve_item_utils.h>
 #include <velib/vecan/products.h>
 
-static int xlate_bms_io(struct VeItem *root, VeVariant *val, uint64_t rawval)
+static int xlate_bms_io(const struct reg_ctx *ctx, VeVariant *val, uint64_t rawval)
 {
 	if (rawval == 0) {
 		veVariantUn16(val, VE_INVALID_UN16);
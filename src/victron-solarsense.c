@@ -6,7 +6,7 @@
 #include <velib/types/variant.h>
 #include <velib/utils/ve_item_utils.h>
 
-static int solarsense_xlate_txpower(struct VeItem *root, VeVariant *val,
+static int solarsense_xlate_txpower(const struct reg_ctx *ctx, VeVariant *val,
 				    uint64_t rawval)
 {
 	int txp = rawval ? 6 : 0;
@@ -16,7 +16,7 @@ static int solarsense_xlate_txpower(struct VeItem *root, VeVariant *val,
 	return 0;
 }
 
-static int solarsense_xlate_tss(struct VeItem *root, VeVariant *val,
+static int solarsense_xlate_tss(const struct reg_ctx *ctx, VeVariant *val,
 				uint64_t rawval)
 {
 	int tss;
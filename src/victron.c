@@ -163,7 +163,6 @@ int victron_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	int i;
 	uint16_t record_type;
 	char name[24];
-	char dev[16];
 	struct VeItem *droot;
 	const struct instant_readout_handler *instant_readout_handler = NULL;
 	const struct victron_device *victron_device;
@@ -209,9 +208,7 @@ int victron_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	// This way, when a device switches instant readout format, it will keep its key and enabled
 	// setting.
 	info.dev_prefix = victron_device == &solarsense_victron_device ? "solarsense_" : "victron_";
-	snprintf(dev, sizeof(dev), "%02x%02x%02x%02x%02x%02x", addr->b[5], addr->b[4], addr->b[3],
-		 addr->b[2], addr->b[1], addr->b[0]);
-	droot = ble_dbus_create(dev, &info, instant_readout_handler);
+	droot = ble_dbus_create_addr(addr, -1, &info, instant_readout_handler);
 	if (!droot)
 		return -1;
 
@@ -225,6 +222,9 @@ int victron_handle_mfg(const bdaddr_t *addr, const uint8_t *buf, int len, enum d
 	if (ble_dbus_check_dup_seq(droot, source, seqnr))
 		return 0;
 
+	if (ble_dbus_check_unchanged(droot, buf, len))
+		return 0;
+
 	if (record_type < 0xFF00) {
 		// Encrypted record, decode it
 		uint8_t decrypted[16];
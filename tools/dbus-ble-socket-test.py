@@ -9,6 +9,8 @@ import socket
 import struct
 import argparse
 import json
+import mmap
+import fcntl
 import os
 import ssl
 import urllib.parse
@@ -47,8 +49,25 @@ Packet format (v2):
                                 - [len][type][data...]
                                 - type 0x09: Complete Local Name
                                 - type 0xFF: Manufacturer Specific Data
+
+Packet format (v3), any number of advertisements per packet:
+    Offset  Size  Description
+    ------  ----  -----------
+    0       1     Version (0x03)
+    1       1     Number of records
+    2       6     Gateway BD address
+    8       ...   Records, back to back:
+                    Offset  Size  Description
+                    0       6     Advertisement BD address
+                    6       1     RSSI (int8_t), 0x7F means invalid
+                    7       2     Capture age, ms before the packet was sent
+                                  (little-endian)
+                    9       1     Advertisement data length (N)
+                    10      N     Raw BLE advertisement AD structures, as in v2
 """
 
+V3_MAX_PACKET = 1472
+
 # Manufacturer IDs
 MFG_ID_RUUVI = 0x0499
 MFG_ID_MOPEKA = 0x0059  # Nordic
@@ -128,14 +147,157 @@ def build_packet_v2(sensor_mac, mfg_id, payload, rssi=None, gw_mac=None, name=No
     return packet
 
 
+def build_record_v3(sensor_mac, adv_data, rssi=None, age_ms=0):
+    """Build one V3 advertisement record."""
+    rssi_byte = 0x7F if rssi is None else struct.pack('b', rssi)[0]
+    age_ms = min(max(int(age_ms), 0), 0xFFFF)
+
+    record = mac_to_bytes(sensor_mac)
+    record += struct.pack('<BHB', rssi_byte, age_ms, len(adv_data))
+    record += adv_data
+    return record
+
+
+def build_packet_v3(records, gw_mac=None):
+    """Build a V3 UDP packet from already built records."""
+    if not gw_mac:
+        gw_mac = "00:00:00:00:00:00"
+    if len(records) > 255:
+        raise ValueError("Too many records for one packet")
+
+    packet = struct.pack('B', 3)
+    packet += struct.pack('B', len(records))
+    packet += mac_to_bytes(gw_mac)
+    for record in records:
+        packet += record
+    return packet
+
+
+class SeqpacketSender:
+    """Sends packets to the local unix socket, like a UDP socket would."""
+
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.connect(path)
+
+    def sendto(self, packet, addr):
+        self.sock.send(packet)
+
+
+class RingWriter:
+    """Writes advertisements into a shared memory ring (Socket/RingPath)."""
+
+    MAGIC = 0x524d4853
+    HEADER = 192
+    HEAD = 64
+    TAIL = 128
+    WAKE = 132
+
+    def __init__(self, path, size=1 << 16):
+        self.size = size
+        memfd = os.memfd_create('ble-ring', os.MFD_ALLOW_SEALING)
+        os.ftruncate(memfd, self.HEADER + size)
+        fcntl.fcntl(memfd, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK)
+        self.map = mmap.mmap(memfd, self.HEADER + size)
+        struct.pack_into('=IIII', self.map, 0, self.MAGIC, 1, size, 0)
+        self.efd = os.eventfd(0)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.connect(path)
+        socket.send_fds(self.sock, [struct.pack('=I', self.MAGIC)], [memfd, self.efd])
+        os.close(memfd)
+
+    def _load(self, offset):
+        return struct.unpack_from('=I', self.map, offset)[0]
+
+    def _store(self, offset, value):
+        struct.pack_into('=I', self.map, offset, value & 0xffffffff)
+
+    def add(self, sensor_mac, adv_data, rssi=None):
+        size = (14 + len(adv_data) + 7) & ~7
+        record = struct.pack('=HBbHBB', size, 1, 0x7f if rssi is None else rssi,
+                             0, len(adv_data), 0)
+        record += mac_to_bytes(sensor_mac) + adv_data
+        record += bytes(size - len(record))
+
+        head = self._load(self.HEAD)
+        offset = head & (self.size - 1)
+        pad = self.size - offset if self.size - offset < size else 0
+
+        # Wait for the daemon to make room
+        while self.size - ((head - self._load(self.TAIL)) & 0xffffffff) < pad + size:
+            time.sleep(0.001)
+
+        if pad:
+            struct.pack_into('=HB', self.map, self.HEADER + offset, pad, 0)
+            head += pad
+            offset = 0
+
+        self.map[self.HEADER + offset:self.HEADER + offset + size] = record
+        self._store(self.HEAD, head + size)
+
+        if self._load(self.WAKE):
+            self._store(self.WAKE, 0)
+            os.eventfd_write(self.efd, 1)
+        print(f"Wrote {size} byte ring record for {sensor_mac}")
+
+    def flush(self):
+        pass
+
+
+class V3Batcher:
+    """Collects advertisements and sends them packed into V3 packets."""
+
+    def __init__(self, sock, addr, gw_mac, batch):
+        self.sock = sock
+        self.addr = addr
+        self.gw_mac = gw_mac
+        self.batch = batch
+        self.pending = []
+
+    def add(self, sensor_mac, adv_data, rssi=None):
+        self.pending.append((time.monotonic(), sensor_mac, adv_data, rssi))
+        if len(self.pending) >= self.batch:
+            self.flush()
+
+    def flush(self):
+        now = time.monotonic()
+        records = []
+        size = 8
+        for captured, sensor_mac, adv_data, rssi in self.pending:
+            record = build_record_v3(sensor_mac, adv_data, rssi=rssi,
+                                     age_ms=(now - captured) * 1000)
+            if records and (size + len(record) > V3_MAX_PACKET or len(records) == 255):
+                self._send(records)
+                records = []
+                size = 8
+            records.append(record)
+            size += len(record)
+        if records:
+            self._send(records)
+        self.pending = []
+
+    def _send(self, records):
+        packet = build_packet_v3(records, gw_mac=self.gw_mac)
+        try:
+            self.sock.sendto(packet, self.addr)
+        except OSError as e:
+            print(f"Error: Failed to send UDP packet to {self.addr}: {e}", file=sys.stderr)
+            sys.exit(1)
+        print(f"Sent V3 packet with {len(records)} records, {len(packet)} bytes")
+
+
 def build_packet(version, sensor_mac, mfg_id, payload, rssi=None, gw_mac=None, name=None):
-    """Build a UDP packet in either V1 or V2 format."""
+    """Build a UDP packet in V1, V2 or single record V3 format."""
     if version == 1:
         return build_packet_v1(sensor_mac, mfg_id, payload, rssi=rssi,
                                gw_mac=gw_mac, name=name)
     if version == 2:
         return build_packet_v2(sensor_mac, mfg_id, payload, rssi=rssi,
                                gw_mac=gw_mac, name=name)
+    if version == 3:
+        adv_data = build_adv_data(mfg_id, payload, name=name)
+        return build_packet_v3([build_record_v3(sensor_mac, adv_data, rssi=rssi)],
+                               gw_mac=gw_mac)
     raise ValueError(f"Unsupported packet version: {version}")
 
 
@@ -323,7 +485,7 @@ def build_garnet_soul_example(_seqnr):
 
 
 def send_example(sock, addr, transport, post_url, packet_version, gw_mac,
-                 http_poster, example, name_override=None):
+                 http_poster, example, name_override=None, batcher=None):
     """Send one built example over either UDP or HTTP(S) POST."""
     sensor_mac = example['sensor_mac']
     mfg_id = example['mfg_id']
@@ -334,7 +496,11 @@ def send_example(sock, addr, transport, post_url, packet_version, gw_mac,
     print(f"Payload length: {len(payload)} bytes")
     print(f"Payload hex: {payload.hex()}")
 
-    if transport == 'udp':
+    if batcher:
+        batcher.add(sensor_mac, build_adv_data(mfg_id, payload, name=name), rssi=rssi)
+        return
+
+    if transport in ('udp', 'unix'):
         packet = build_packet(packet_version, sensor_mac, mfg_id, payload,
                               rssi=rssi, gw_mac=gw_mac, name=name)
         print(f"Total packet length: {len(packet)} bytes")
@@ -353,9 +519,12 @@ def send_example(sock, addr, transport, post_url, packet_version, gw_mac,
 
 
 def send_raw(sock, addr, packet_version, sensor_mac, mfg_id, payload_hex,
-             rssi=None, gw_mac=None, name=None):
+             rssi=None, gw_mac=None, name=None, batcher=None):
     """Send raw payload."""
     payload = bytes.fromhex(payload_hex)
+    if batcher:
+        batcher.add(sensor_mac, build_adv_data(mfg_id, payload, name=name), rssi=rssi)
+        return
     packet = build_packet(packet_version, sensor_mac, mfg_id, payload,
                           rssi=rssi, gw_mac=gw_mac, name=name)
     try:
@@ -559,8 +728,11 @@ def main():
                         help='Target host (UDP socket host or GX host for POST, default: 127.0.0.1)')
     parser.add_argument('--port', type=int, default=18542,
                         help='Target port (default: 18542)')
-    parser.add_argument('--transport', choices=['udp', 'http', 'https'], default='udp',
-                        help='Output transport (default: udp)')
+    parser.add_argument('--transport', choices=['udp', 'unix', 'ring', 'http', 'https'],
+                        default='udp', help='Output transport (default: udp)')
+    parser.add_argument('--path', default=None,
+                        help='Socket path for the unix (Socket/LocalPath) or '
+                             'ring (Socket/RingPath) transport')
     # HTTP/HTTPS POST options
     parser.add_argument('--post-timeout', type=float, default=3.0,
                         help='HTTP(S) POST timeout in seconds (default: 3.0)')
@@ -569,8 +741,10 @@ def main():
     parser.add_argument('--password', default=None,
                         help='Optional GX password used for login.php session auth')
     # UDP packet options
-    parser.add_argument('--packet-version', type=int, choices=[1, 2], default=2,
+    parser.add_argument('--packet-version', type=int, choices=[1, 2, 3], default=2,
                         help='UDP socket packet version to emit (default: 2)')
+    parser.add_argument('--batch', type=int, default=1,
+                        help='Advertisements packed per V3 packet (default: 1)')
     # Sensor data options
     parser.add_argument('--mac', default='AA:BB:CC:DD:EE:01',
                         help='Sensor MAC address')
@@ -594,6 +768,12 @@ def main():
 
     if args.rssi is not None and not (-127 <= args.rssi <= 126):
         parser.error(f"RSSI must be between -127 and 126, got {args.rssi}")
+    if args.batch < 1:
+        parser.error(f"Batch size must be at least 1, got {args.batch}")
+    if args.batch > 1 and (args.transport not in ('udp', 'unix') or args.packet_version != 3):
+        parser.error("--batch requires UDP or unix transport and --packet-version 3")
+    if args.transport in ('unix', 'ring') and not args.path:
+        parser.error(f"--transport {args.transport} requires --path")
 
     sock = None
     addr = None
@@ -602,6 +782,11 @@ def main():
     if args.transport == 'udp':
         sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
         addr = (args.host, args.port)
+    elif args.transport == 'unix':
+        sock = SeqpacketSender(args.path)
+        addr = args.path
+    elif args.transport == 'ring':
+        addr = args.path
     else:
         post_url = f"{args.transport}://{args.host}/ble-gw"
         http_poster = AuthenticatedPoster(
@@ -613,35 +798,44 @@ def main():
 
     name = args.name
 
+    batcher = None
+    if args.transport == 'ring':
+        batcher = RingWriter(args.path)
+    elif args.batch > 1:
+        batcher = V3Batcher(sock, addr, args.gw_mac, args.batch)
+
     if args.example == 'ruuvi':
         interval = args.interval if args.interval is not None else 1.285
         seqnr_repeat = args.seqnr_repeat if args.seqnr_repeat is not None else 1
         def f(s):
             send_example(sock, addr, args.transport, post_url, args.packet_version,
                          args.gw_mac, http_poster,
-                         build_ruuvi_example(s), name_override=name)
+                         build_ruuvi_example(s), name_override=name,
+                         batcher=batcher)
     elif args.example == 'solarsense':
         interval = args.interval if args.interval is not None else 0.16
         seqnr_repeat = args.seqnr_repeat if args.seqnr_repeat is not None else 7
         def f(s):
             send_example(sock, addr, args.transport, post_url, args.packet_version,
                          args.gw_mac, http_poster,
-                         build_solarsense_example(s), name_override=name)
+                         build_solarsense_example(s), name_override=name,
+                         batcher=batcher)
     elif args.example == 'garnet_soul':
         interval = args.interval if args.interval is not None else 0.125
         seqnr_repeat = args.seqnr_repeat if args.seqnr_repeat is not None else 1
         def f(s):
             send_example(sock, addr, args.transport, post_url, args.packet_version,
                          args.gw_mac, http_poster,
-                         build_garnet_soul_example(s), name_override=name)
+                         build_garnet_soul_example(s), name_override=name,
+                         batcher=batcher)
     elif args.mfg_id and args.mfg_data:
         interval = args.interval if args.interval is not None else 1.0
         seqnr_repeat = args.seqnr_repeat if args.seqnr_repeat is not None else 1
-        if args.transport == 'udp':
+        if args.transport in ('udp', 'unix', 'ring'):
             def f(s):
                 send_raw(sock, addr, args.packet_version, args.mac, args.mfg_id,
                          args.mfg_data, rssi=args.rssi, gw_mac=args.gw_mac,
-                         name=name)
+                         name=name, batcher=batcher)
         else:
             def f(s):
                 send_post_raw(http_poster, post_url, args.mac, args.mfg_id, args.mfg_data,
@@ -658,6 +852,12 @@ def main():
         print("    ./ble-socket-test.py --transport https --host 192.168.1.50 --example ruuvi")
         print("  Send Ruuvi example as V2 packet:")
         print("    ./ble-socket-test.py --example ruuvi --packet-version 2")
+        print("  Send 200 Ruuvi readings packed 20 per V3 packet:")
+        print("    ./ble-socket-test.py --example ruuvi --packet-version 3 --batch 20 --repeat 200 --interval 0")
+        print("  Send Ruuvi example over the local unix socket:")
+        print("    ./ble-socket-test.py --transport unix --path /run/dbus-ble-sensors.sock --example ruuvi")
+        print("  Write Ruuvi readings into a shared memory ring:")
+        print("    ./ble-socket-test.py --transport ring --path /run/dbus-ble-sensors-ring.sock --example ruuvi --repeat 200")
         print("  Send SolarSense example:")
         print("    ./ble-socket-test.py --example solarsense --repeat 200")
         print("  Send raw Ruuvi format 5:")
@@ -670,6 +870,8 @@ def main():
             f(seqnr)
             if interval > 0 and i < args.repeat - 1:
                 time.sleep(interval)
+        if batcher:
+            batcher.flush()
     finally:
         if sock:
             sock.close()
@@ -0,0 +1,278 @@
+/*
+ * Checks the compiled register decoders of src/ble-regs.c against the
+ * reference interpreter of regs-ref.c on random register tables and
+ * payloads, then times both on a table the size of a typical sensor's.
+ *
+ *   make -C tools regs-check && tools/regs-check [seed]
+ *
+ * Exits non-zero if any register decodes differently.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ble-dbus.h"
+#include "ble-regs.h"
+#include "regs-ref.h"
+
+#define CHECK_TABLES	64
+#define CHECK_PACKETS	2000
+#define PAYLOAD_LEN	40
+
+#define BENCH_REGS	10
+#define BENCH_LEN	24
+#define BENCH_PACKETS	2000000
+
+static uint64_t rnd_state;
+
+/* The packet the reference interpreter is decoding, for xlate_peer */
+static const struct reg_info *ref_regs;
+static const uint8_t *ref_buf;
+static int ref_len;
+
+static uint64_t rnd(void)
+{
+	uint64_t s = rnd_state;
+
+	s ^= s << 13;
+	s ^= s >> 7;
+	s ^= s << 17;
+
+	return rnd_state = s;
+}
+
+/* Rejects odd raw values, so both decoders pass on callback errors */
+static int xlate_odd(const struct reg_ctx *ctx, VeVariant *val, uint64_t raw)
+{
+	if (raw & 1)
+		return -1;
+
+	veVariantUn32(val, raw * 3 + 1);
+
+	return 0;
+}
+
+/*
+ * Combines the value with the first registers of the same packet. The
+ * compiled decoders pass a context, and the peers are read through it.
+ * The reference passes none, and the peers are decoded by the reference
+ * from the packet, so the context is checked as well. As through the
+ * context, a peer translated by a callback has no value. Warnings and
+ * alarms never are.
+ */
+static int xlate_peer(const struct reg_ctx *ctx, VeVariant *val, uint64_t raw)
+{
+	VeVariant peer;
+	uint64_t first;
+	int err;
+
+	if (ctx)
+		err = ble_dbus_reg_raw(ctx, 0, &first);
+	else
+		err = regs_ref_raw(&ref_regs[0], ref_buf, ref_len, &first);
+	if (err)
+		return -1;
+
+	memset(&peer, 0, sizeof(peer));
+	if (ctx)
+		err = ble_dbus_reg_value(ctx, 1, &peer);
+	else if (ref_regs[1].xlate && !(ref_regs[1].flags & REG_FLAG_WARN_ALARM))
+		err = -1;
+	else
+		err = regs_ref_interpret(&ref_regs[1], &peer, ref_buf, ref_len);
+	if (err)
+		veVariantSn32(&peer, -1);
+
+	veVariantUn32(val, raw ^ first ^ peer.value.UN32);
+
+	return 0;
+}
+
+static void random_reg(struct reg_info *reg)
+{
+	int width;
+
+	memset(reg, 0, sizeof(*reg));
+
+	/* Mostly integers, some of a type that never decodes */
+	reg->type = rnd() % 16 ? VE_UN8 + rnd() % (VE_SN32 - VE_UN8 + 1) : VE_FLOAT;
+	width = 8 * ((reg->type + 1) / 2);
+	if (reg->type == VE_FLOAT)
+		width = 32;
+
+	reg->offset = rnd() % (PAYLOAD_LEN - 8);
+	reg->shift = rnd() % 8;
+	reg->bits = rnd() % 3 ? 1 + rnd() % width : 0;
+
+	if (rnd() % 2)
+		reg->flags |= REG_FLAG_BIG_ENDIAN;
+	if (rnd() % 2)
+		reg->flags |= REG_FLAG_INVALID;
+	if (rnd() % 8 == 0)
+		reg->flags |= REG_FLAG_WARN_ALARM;
+
+	/* Often the top value of the field, which all ones payloads hit */
+	reg->inval = rnd() % 2 ? (1ull << (reg->bits ?: width)) - 1 : rnd() % 4;
+
+	if (rnd() % 2)
+		reg->scale = (float)(1 + rnd() % 1000) / 10;
+	if (rnd() % 2)
+		reg->bias = (float)(rnd() % 500) - 250;
+
+	switch (rnd() % 10) {
+	case 0:
+		reg->xlate = xlate_odd;
+		break;
+	case 1:
+		reg->xlate = xlate_peer;
+		break;
+	}
+}
+
+static int check(void)
+{
+	static struct reg_info regs[CHECK_TABLES][REG_CTX_MAX];
+	uint8_t buf[PAYLOAD_LEN];
+	int mismatches = 0;
+	int checked = 0;
+	int t, n, i;
+
+	for (t = 0; t < CHECK_TABLES; t++) {
+		struct reg_ctx ctx;
+
+		for (i = 0; i < REG_CTX_MAX; i++)
+			random_reg(&regs[t][i]);
+
+		ctx.root = NULL;
+		ctx.table = ble_regs_compile(regs[t], REG_CTX_MAX);
+		if (!ctx.table) {
+			fprintf(stderr, "failed to compile table %d\n", t);
+			return -1;
+		}
+
+		for (n = 0; n < CHECK_PACKETS; n++) {
+			int len = rnd() % (PAYLOAD_LEN + 1);
+
+			/* Some all ones and all zeroes packets for the edge values */
+			for (i = 0; i < PAYLOAD_LEN; i++)
+				buf[i] = rnd();
+			if (n % 5 == 0)
+				memset(buf, n % 10 ? 0xff : 0, sizeof(buf));
+
+			ble_regs_extract(&ctx, buf, len);
+			ref_regs = regs[t];
+			ref_buf = buf;
+			ref_len = len;
+
+			for (i = 0; i < REG_CTX_MAX; i++) {
+				VeVariant ref, val;
+				int eref, err;
+
+				memset(&ref, 0, sizeof(ref));
+				memset(&val, 0, sizeof(val));
+
+				eref = regs_ref_interpret(&regs[t][i], &ref, buf, len);
+				err = ble_regs_decode(&ctx, i, &val);
+				checked++;
+
+				if (eref == err && (err || !memcmp(&ref, &val, sizeof(ref))))
+					continue;
+
+				if (mismatches++ < 10)
+					printf("table %d packet %d reg %d: "
+					       "reference %d %08x, compiled %d %08x\n",
+					       t, n, i, eref, ref.value.UN32,
+					       err, val.value.UN32);
+			}
+		}
+	}
+
+	printf("%d registers decoded, %d mismatches\n", checked, mismatches);
+
+	return mismatches;
+}
+
+static double elapsed_ns(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (t1.tv_sec - t0->tv_sec) * 1e9 + (t1.tv_nsec - t0->tv_nsec);
+}
+
+static void bench(void)
+{
+	static const struct reg_info regs[BENCH_REGS] = {
+		{ .type = VE_SN16, .offset = 0, .scale = 100 },
+		{ .type = VE_UN16, .offset = 2, .scale = 400 },
+		{ .type = VE_UN16, .offset = 4, .scale = 10, .bias = -500,
+		  .flags = REG_FLAG_INVALID, .inval = 0xffff },
+		{ .type = VE_SN16, .offset = 6, .flags = REG_FLAG_BIG_ENDIAN },
+		{ .type = VE_UN8,  .offset = 8 },
+		{ .type = VE_UN16, .offset = 9, .bits = 11, .scale = 1000,
+		  .bias = 1.6 },
+		{ .type = VE_UN8,  .offset = 10, .shift = 3, .bits = 5 },
+		{ .type = VE_UN24, .offset = 11, .flags = REG_FLAG_BIG_ENDIAN },
+		{ .type = VE_SN32, .offset = 14, .scale = 10 },
+		{ .type = VE_UN8,  .offset = 18, .bits = 4,
+		  .flags = REG_FLAG_WARN_ALARM },
+	};
+	uint8_t buf[BENCH_LEN];
+	volatile uint32_t sink = 0;
+	struct timespec t0;
+	struct reg_ctx ctx;
+	double ref, comp;
+	VeVariant val;
+	long n;
+	int i;
+
+	for (i = 0; i < BENCH_LEN; i++)
+		buf[i] = rnd();
+
+	ctx.root = NULL;
+	ctx.table = ble_regs_compile(regs, BENCH_REGS);
+	if (!ctx.table)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < BENCH_PACKETS; n++) {
+		buf[n & 15]++;
+		for (i = 0; i < BENCH_REGS; i++) {
+			if (!regs_ref_interpret(&regs[i], &val, buf, BENCH_LEN))
+				sink += val.value.UN32;
+		}
+	}
+	ref = elapsed_ns(&t0) / BENCH_PACKETS;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (n = 0; n < BENCH_PACKETS; n++) {
+		buf[n & 15]++;
+		ble_regs_extract(&ctx, buf, BENCH_LEN);
+		for (i = 0; i < BENCH_REGS; i++) {
+			if (!ble_regs_decode(&ctx, i, &val))
+				sink += val.value.UN32;
+		}
+	}
+	comp = elapsed_ns(&t0) / BENCH_PACKETS;
+
+	printf("%d registers per packet: reference %.1f ns, compiled %.1f ns, "
+	       "%.2fx\n", BENCH_REGS, ref, comp, ref / comp);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : time(NULL);
+
+	printf("seed %llu\n", (unsigned long long)seed);
+	rnd_state = seed ?: 1;
+
+	if (check())
+		return 1;
+
+	bench();
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * The register interpreter the compiled tables of src/ble-regs.c
+ * replaced, decoding from the reg_info fields directly. It is only
+ * built into tools/regs-check, as the reference the compiled decoders
+ * are checked against. The only change is that the little endian load
+ * widens each byte before shifting it.
+ */
+#include <stdint.h>
+
+#include <velib/types/types.h>
+#include <velib/types/variant.h>
+
+#include "ble-dbus.h"
+#include "regs-ref.h"
+
+static int type_size(VeDataBasicType t)
+{
+	return (t + 1) / 2;
+}
+
+static int type_isint(VeDataBasicType t)
+{
+	if (t < VE_UN8)
+		return 0;
+	if (t <= VE_SN32)
+		return 1;
+	return 0;
+}
+
+static int type_issigned(VeDataBasicType t)
+{
+	return !(t & 1);
+}
+
+static int64_t sext(uint64_t v, int s)
+{
+	return (int64_t)(v << s) >> s;
+}
+
+static uint64_t zext(uint64_t v, int b)
+{
+	b = 64 - b;
+	return v << b >> b;
+}
+
+static int reg_bits(const struct reg_info *r)
+{
+	return r->bits ? r->bits : 8 * type_size(r->type);
+}
+
+/* Raw value of @reg in the packet, -1 if it is too short to hold it */
+int regs_ref_raw(const struct reg_info *r, const uint8_t *buf, int len,
+		 uint64_t *raw)
+{
+	int bits = reg_bits(r);
+	uint64_t v;
+	int size;
+	int i;
+
+	if (!type_isint(r->type))
+		return -1;
+
+	buf += r->offset;
+	len -= r->offset;
+
+	size = (bits + r->shift + 7) >> 3;
+
+	if (len < size)
+		return -1;
+
+	if (r->flags & REG_FLAG_BIG_ENDIAN) {
+		for (v = 0, i = 0; i < size; i++)
+			v = v << 8 | *buf++;
+	} else {
+		for (v = 0, i = 0; i < size; i++)
+			v |= (uint64_t)*buf++ << (8 * i);
+	}
+
+	*raw = zext(v >> r->shift, bits);
+
+	return 0;
+}
+
+/*
+ * Decodes @reg from a packet. Callbacks are passed no context, they
+ * must find the other registers of the packet without the daemon's.
+ */
+int regs_ref_interpret(const struct reg_info *r, VeVariant *val,
+		       const uint8_t *buf, int len)
+{
+	VeDataBasicType type = r->type;
+	float scale = r->scale;
+	float bias = r->bias;
+	int bits = reg_bits(r);
+	uint64_t v;
+	float f;
+
+	if (regs_ref_raw(r, buf, len, &v))
+		return -1;
+
+	if ((r->flags & REG_FLAG_WARN_ALARM)) {
+		if (v == 0)
+			return -1;
+		veVariantSn32(val, (int)v - 1);
+		return 0;
+	}
+	if ((r->flags & REG_FLAG_INVALID) && v == r->inval)
+		return -1;
+
+	if (r->xlate) {
+		return r->xlate(NULL, val, v);
+	} else if (scale) {
+		if (type_issigned(type))
+			f = sext(v, 64 - bits);
+		else
+			f = v;
+		veVariantFloat(val, f / scale + bias);
+	} else if (type_issigned(type)) {
+		veVariantSn32(val, sext(v, 64 - bits));
+	} else {
+		veVariantUn32(val, v);
+	}
+
+	return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef REGS_REF_H
+#define REGS_REF_H
+
+#include <stdint.h>
+
+#include <velib/types/variant.h>
+
+#include "ble-dbus.h"
+
+int regs_ref_raw(const struct reg_info *reg, const uint8_t *buf, int len,
+		 uint64_t *raw);
+int regs_ref_interpret(const struct reg_info *reg, VeVariant *val,
+		       const uint8_t *buf, int len);
+
+#endif